@@ -3,11 +3,23 @@
 #include <Windows.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <wctype.h>
 #include <tchar.h>
 #include <NTLib.h>
 #include <AVLTree.h>
 #include <CommonLib.h>
 #include <ConsolePrinter.h>
+#include <FormatPrinter.h>
+#include <FlightRecorder.h>
+#include <StringBuilder.h>
+#include <DirectoryCache.h>
+#include <FastString.h>
+#include <TaskScheduler.h>
+#include <Metrics.h>
+#include <ObjectPool.h>
+#include <LockFreeQueue.h>
+#include <UsnJournal.h>
+#include <LogFormat.h>
 
 /*TODO list:
 + Add IOCP support if needed
@@ -19,65 +31,264 @@
 + More informative errors
 - Investigate dir sharing violation
 + Investigate non-tracked deletion
-- Increase temp file generation speed
++ Increase temp file generation speed
 - Investigate issue with multithreading
 */
 
+#define StopCompletionKey ((ULONG_PTR)1)
+
+// Notifications of a network share fail with a bigger buffer
+#define MaxChangeInformationBlockSize 0x10000
+
+// Minimal delay between two rescans, overflows usually come by bursts
+#define RescanInterval 1000
+
+// Consecutive failed reads after that an operation isn't issued again
+#define MaxChangesReadFailures 3
+
+#define MaxScanWorkers          8
+#define ScanBatchSize           64
+#define ScanDirectoryBufferSize 0x40000
+#define ScanProgressInterval    5000
+
+// Temporary links are spread over subdirectories, a power of two
+#define TempDirFanout 64
+
+#define TreeDirectoriesInitialSize 0x1000
+// Deeper directories are resolved by the path cache of the journal
+#define MaxTreeDepth               512
+
+#define CoalesceBuckets  0x1000
+#define MaxCoalesceLanes 64
+// Kilobytes, additions of bigger files aren't delayed by the coalescing window
+#define DefaultCoalesceSizeLimit 1024
+
+#ifndef STATUS_NOTIFY_ENUM_DIR
+#define STATUS_NOTIFY_ENUM_DIR ((NTSTATUS)0x0000010CL)
+#endif
+
+enum WatcherBackends
+{
+    UsnJournalWatcher,
+    DirectoryChangesWatcher,
+};
+
+// An outstanding directory changes read
 struct OperationContext
 {
     OVERLAPPED Overlapped;
     PFILE_NOTIFY_INFORMATION ChangeInfo;
+    DWORD      BufferSize;
+    DWORD      Index;
+    DWORD      Failures;
+};
+
+// A thread that reaps completions of all operations
+struct ReaperContext
+{
     HANDLE     Thread;
     HANDLE     StartStopEvent;
     DWORD      Index;
 };
 
+// A copy of completed directory changes waiting for a backup worker
+struct ChangeBatch
+{
+    unsigned long long Received;
+    DWORD      Size;
+    DWORD      Index;
+    DWORD      Pooled;
+    DWORD      Data[1];
+};
+
+// A change waiting for the end of the coalescing window. Changes of the same
+// name are chained from the oldest to the latest, the latest one is in the
+// hash table.
+struct PendingChange
+{
+    PendingChange* Next;
+    PendingChange* Prev;
+    PendingChange* HashNext;
+    PendingChange* NewerSameName;
+    PendingChange* OlderSameName;
+    unsigned long long Received;
+    DWORD      Action;
+    DWORD      Index;
+    unsigned int Hash;
+    bool       Large;   // an addition of a file over the size limit, it's never cancelled
+    size_t     Length;
+    wchar_t*   Key;     // lowered copy of the name
+    wchar_t    Name[1];
+};
+
+// A directory of the monitored tree, the name isn't null-terminated
+struct TreeDirectory
+{
+    DWORDLONG  Id;
+    DWORDLONG  Parent;
+    wchar_t*   Name;
+    size_t     NameLength;
+};
+
+// A directory of the monitored tree waiting for a rescan
+struct RescanTask
+{
+    RescanTask* Next;
+    size_t     Length;
+    wchar_t    Path[1]; // relative to the monitored directory, empty for the root
+};
+
 struct
 {
+    WatcherBackends   Backend;
     HANDLE            SourceDirHandle;
     HANDLE            SourceDirIocp;
     wchar_t*          SourceDir;
+    wchar_t*          SourceDirVolumePath;
+    size_t            SourceDirVolumePathLen;
+    void*             Journal;
+    HANDLE            JournalThread;
+    HANDLE            JournalStopEvent;
+    TreeDirectory*    TreeDirectories;
+    unsigned int      TreeDirectoriesSize;
+    unsigned int      TreeDirectoriesCount;
+    bool              TreeDirectoriesFailed;
+    DWORDLONG         RootDirectoryId;
     wchar_t*          DestTempDir;
+    size_t            DestTempDirLen;
+    unsigned long long TempEpoch;
+    volatile long     TempWorkersCount;
+    bool              HandleFreeTracking;
+    HANDLE            DestTempDirHandle;
     wchar_t*          DestBackupDir;
+    void*             BackupDirCache;
     wchar_t*          ExcludedPath;
     size_t            ExcludedPathLen;
     CRITICAL_SECTION  FilesContextCS;
     AVL_TREE          FilesContext;
+    void*             FileNodesPool;
+    void*             RestoreContextsPool;
+    void*             Scheduler;
     OperationContext* Operations;
     unsigned int      OperationsCount;
+    ReaperContext*    Reapers;
+    unsigned int      ReapersCount;
+    void*             ChangesQueue;
+    HANDLE            ChangesSemaphore;
+    void*             ChangeBatchesPool;
+    HANDLE*           BackupWorkers;
+    unsigned int      BackupWorkersCount;
+    volatile long     BackupWorkersStopping;
+    volatile long     AbandonedOperations;
     void*             OperationsBuffer;
-    size_t            OperationsBufferSize;
+    HANDLE            RescanThread;
+    HANDLE            RescanRequestEvent;
+    HANDLE            RescanStopEvent;
+    HANDLE            RescanDoneEvent;
+    volatile long     RescanPending;
+    bool              StartupScan;
+    unsigned int      ScanBudget; // I/O operations per second, 0 is unlimited
+    unsigned int      ScanWorkersCount;
+    unsigned int      ScanWorkersRunning;
+    HANDLE            ScanSemaphore;
+    SpinAtom          ScanLock;
+    RescanTask*       ScanDirectories;
+    unsigned long long ScanStarted;
+    volatile LONGLONG ScanConsumed;
+    volatile long     ScannedDirectories;
+    volatile long     ScannedFiles;
+    volatile long     ScanAddedFiles;
+    unsigned int      CoalesceWindow; // milliseconds, 0 disables coalescing
+    unsigned long long CoalesceSizeLimit; // bytes, additions of bigger files aren't delayed
+    unsigned int      CoalesceLanesCount;
+    HANDLE            CoalesceThread;
+    HANDLE            CoalesceStopEvent;
+    HANDLE            CoalesceLanesDone;
+    volatile long     CoalesceLanesPending;
+    SpinAtom          CoalesceLock;
+    PendingChange**   PendingBuckets;
+    PendingChange*    PendingHead;
+    PendingChange*    PendingTail;
 } g_MonitorContext;
 
+// Key, BackupFileName and TempFileName share a single allocation owned by Key.
+// A context detached from the tree for a restoration has no BackupFileName in
+// the tree node, its resources are owned by the restore task.
+//
+// FileId is the NTFS file reference of the backed up file, the temp link
+// shares it. In the handle-free mode TempFile is INVALID_HANDLE_VALUE and the
+// temporary link is reopened by FileId when it's needed.
 struct FileContext
 {
     wchar_t* Key;
     wchar_t* BackupFileName;
     wchar_t* TempFileName;
     HANDLE   TempFile;
+    LONGLONG FileId;
 };
 
+struct
+{
+    unsigned int Changes;
+    unsigned int Batches;
+    unsigned int BatchLatency;
+    unsigned int ReapedCompletions;
+    unsigned int IntakeLatency;
+    unsigned int IntakeInline;
+    unsigned int QueueDepth;
+    unsigned int QueueLatency;
+    unsigned int Overflows;
+    unsigned int CoalesceCancelled;
+    unsigned int CoalesceDeduplicated;
+    unsigned int CoalesceBypassed;
+    unsigned int CoalesceFlushed;
+    unsigned int RescanDirectories;
+    unsigned int RescanAddedFiles;
+    unsigned int RescanRemovedFiles;
+    unsigned int RescanLatency;
+    unsigned int FilesLockWait;
+    unsigned int TempBackupLatency;
+    unsigned int UpgradeLatency;
+    unsigned int RestoreLatency;
+} g_Metrics;
+
 ConsoleInstance g_consoleContext = NULL;
 
+// A thread number and a counter of temporary names generated by the thread,
+// the number is taken again when the monitor is restarted with a new epoch
+_declspec(thread) unsigned long long st_TempEpoch = 0;
+_declspec(thread) unsigned int st_TempWorkerId = 0;
+_declspec(thread) unsigned long long st_TempCounter = 0;
+
 // =============================================
 
+// All tree nodes have the same size, they are taken from the pool
 void* AVLTreeAllocate(size_t NodeBufSize)
 {
-    return malloc(NodeBufSize);
+    if (NodeBufSize > GetObjectPoolObjectSize(g_MonitorContext.FileNodesPool))
+        return NULL;
+
+    return AllocateFromObjectPool(g_MonitorContext.FileNodesPool);
+}
+
+void ReleaseFileContext(FileContext* FileContext)
+{
+    ::DeleteFileW(FileContext->TempFileName);
+
+    FreeWideString(FileContext->Key);
+
+    if (FileContext->TempFile != INVALID_HANDLE_VALUE)
+        ::CloseHandle(FileContext->TempFile);
 }
 
 void AVLTreeFree(void* NodeBuf, void* Node)
 {
     FileContext* fileContext = (FileContext*)Node;
 
-    ::DeleteFileW(fileContext->TempFileName);
+    if (fileContext->BackupFileName)
+        ReleaseFileContext(fileContext);
 
-    FreeWideString(fileContext->BackupFileName);
-    FreeWideString(fileContext->TempFileName);
-    FreeWideString(fileContext->Key);
-    ::CloseHandle(fileContext->TempFile);
-
-    free(NodeBuf);
+    ReleaseToObjectPool(g_MonitorContext.FileNodesPool, NodeBuf);
 }
 
 int AVLTreeCompare(void* Node1, void* Node2)
@@ -89,234 +300,468 @@ int AVLTreeCompare(void* Node1, void* Node2)
 
 // =============================================
 
-bool IsPathExcluded(const wchar_t* Path)
+void RegisterMonitorMetrics()
+{
+    g_Metrics.Changes           = RegisterMetricCounter("monitor.changes");
+    g_Metrics.Batches           = RegisterMetricCounter("monitor.batches");
+    g_Metrics.BatchLatency      = RegisterMetricHistogram("monitor.batch_latency");
+    g_Metrics.ReapedCompletions = RegisterMetricHistogram("monitor.reaped_completions", MetricValue);
+    g_Metrics.IntakeLatency     = RegisterMetricHistogram("monitor.intake_latency");
+    g_Metrics.IntakeInline      = RegisterMetricCounter("monitor.intake_inline");
+    g_Metrics.QueueDepth        = RegisterMetricHistogram("monitor.queue_depth", MetricValue);
+    g_Metrics.QueueLatency      = RegisterMetricHistogram("monitor.queue_latency");
+    g_Metrics.Overflows         = RegisterMetricCounter("monitor.overflows");
+    g_Metrics.CoalesceCancelled = RegisterMetricCounter("coalesce.cancelled");
+    g_Metrics.CoalesceDeduplicated = RegisterMetricCounter("coalesce.deduplicated");
+    g_Metrics.CoalesceBypassed  = RegisterMetricCounter("coalesce.bypassed");
+    g_Metrics.CoalesceFlushed   = RegisterMetricCounter("coalesce.flushed");
+    g_Metrics.RescanDirectories = RegisterMetricCounter("rescan.directories");
+    g_Metrics.RescanAddedFiles  = RegisterMetricCounter("rescan.added_files");
+    g_Metrics.RescanRemovedFiles = RegisterMetricCounter("rescan.removed_files");
+    g_Metrics.RescanLatency     = RegisterMetricHistogram("rescan.latency");
+    g_Metrics.FilesLockWait     = RegisterMetricHistogram("monitor.files_lock_wait");
+    g_Metrics.TempBackupLatency = RegisterMetricHistogram("backup.temp_latency");
+    g_Metrics.UpgradeLatency    = RegisterMetricHistogram("backup.upgrade_latency");
+    g_Metrics.RestoreLatency    = RegisterMetricHistogram("backup.restore_link_latency");
+}
+
+// Records how long a thread waits for the files tree
+void EnterFilesContextLock()
+{
+    unsigned long long started = StartMetricTimer();
+    ::EnterCriticalSection(&g_MonitorContext.FilesContextCS);
+    RecordMetricLatency(g_Metrics.FilesLockWait, started);
+}
+
+bool IsPathExcluded(const wchar_t* Path, size_t Length)
 {
     if (!g_MonitorContext.ExcludedPath)
         return false;
 
-    return (_wcsnicmp(g_MonitorContext.ExcludedPath, Path, g_MonitorContext.ExcludedPathLen) == 0);
+    return IsWidePrefixNoCase(Path, Length, g_MonitorContext.ExcludedPath, g_MonitorContext.ExcludedPathLen);
 }
 
-bool CreateTemporaryBackup(const wchar_t* SourceFile)
+bool GetFileIdByHandle(HANDLE File, LONGLONG* FileId)
 {
-    FileContext fileContext;
-    wchar_t tempFile[MAX_PATH + 1];
-    wchar_t* fullSourcePath = 0;
-    void* insert;
-    bool result = false;
+    BY_HANDLE_FILE_INFORMATION info;
+
+    if (!::GetFileInformationByHandle(File, &info))
+        return false;
+
+    *FileId = ((LONGLONG)info.nFileIndexHigh << 32) | info.nFileIndexLow;
+    return true;
+}
+
+// Names are unique without probing the file system: the process epoch tells
+// runs apart, a thread number and its counter tell names of a run apart.
+// Returns a length of "xx\db_<epoch>_<thread>_<counter>.tmp" or -1 if the
+// buffer is too small.
+int GenerateTemporaryName(wchar_t* Buffer, size_t BufferLength)
+{
+    unsigned long long counter;
+    unsigned int fanout;
 
-    if (IsPathExcluded(SourceFile))
+    if (st_TempEpoch != g_MonitorContext.TempEpoch)
     {
-        PrintMsg(PrintColors::Default, L"File skipped: %s\n", SourceFile);
-        return true;
+        st_TempEpoch = g_MonitorContext.TempEpoch;
+        st_TempWorkerId = (unsigned int)::InterlockedIncrement(&g_MonitorContext.TempWorkersCount);
     }
 
-    if (::GetTempFileNameW(g_MonitorContext.DestTempDir, L"db_", 0, tempFile) == 0)
+    counter = st_TempCounter++;
+
+    // Sequential names of a thread go to different subdirectories
+    fanout = (unsigned int)(counter + st_TempWorkerId) & (TempDirFanout - 1);
+
+    return _snwprintf_s(
+        Buffer, BufferLength, _TRUNCATE, L"%02x\\db_%llx_%x_%llx.tmp",
+        fanout, g_MonitorContext.TempEpoch, st_TempWorkerId, counter
+    );
+}
+
+// Links the source to the temp directory and fills a context which isn't in
+// the tree yet, it's released by ReleaseFileContext()
+bool PrepareTemporaryBackup(const wchar_t* SourceFile, size_t KeyLength, FileContext* Context)
+{
+    wchar_t tempFile[MAX_PATH + 1];
+    size_t tempDirLength = g_MonitorContext.DestTempDirLen;
+    WideStringBuilder builder;
+    const wchar_t* tempName;
+    int tempNameLength;
+    HANDLE sourceFile = INVALID_HANDLE_VALUE;
+    bool linked = false;
+    bool result = false;
+
+    memcpy(tempFile, g_MonitorContext.DestTempDir, tempDirLength * sizeof(wchar_t));
+    tempFile[tempDirLength] = L'\\';
+
+    tempName = tempFile + tempDirLength + 1;
+
+    tempNameLength = GenerateTemporaryName(tempFile + tempDirLength + 1, _countof(tempFile) - tempDirLength - 1);
+    if (tempNameLength < 0)
     {
-        PrintMsg(PrintColors::Red, L"Error, can't generate temporary file name, code %d\n", ::GetLastError());
+        PrintMsg(PrintColors::Red, L"Error, can't generate temporary file name\n");
         return false;
     }
 
-    memset(&fileContext, 0, sizeof(fileContext));
-    
-    fullSourcePath = BuildWideString(g_MonitorContext.SourceDir, SourceFile, NULL);
-    if (!fullSourcePath)
+    memset(Context, 0, sizeof(FileContext));
+    Context->TempFile = INVALID_HANDLE_VALUE;
+    InitWideStringBuilder(&builder);
+
+    // The source is opened relative to the monitored directory and the handle is linked
+    // to the temp directory
+
+    sourceFile = OpenFileRelative(
+        g_MonitorContext.SourceDirHandle,
+        SourceFile,
+        KeyLength,
+        FILE_WRITE_ATTRIBUTES,
+        FILE_NON_DIRECTORY_FILE
+    );
+    if (sourceFile == INVALID_HANDLE_VALUE)
     {
-        PrintMsg(PrintColors::Red, L"Error, can't prepare source file name\n");
+        PrintMsg(PrintColors::Red, L"Error, can't open source file, code: %d\n", ::GetLastError());
         goto ReleaseBlock;
     }
 
-    if (!CreateHardLinkToExistingFile(tempFile, fullSourcePath))
+    // The name is relative to the temp directory handle including the subdirectory,
+    // an existing file means a broken generator so it isn't replaced
+    if (!CreateHardLinkFromHandle(sourceFile, g_MonitorContext.DestTempDirHandle, tempName, tempNameLength, false))
     {
         PrintMsg(PrintColors::Red, L"Error, can't create hard link, code: %d\n", ::GetLastError());
         goto ReleaseBlock;
     }
 
-    fileContext.TempFile = ::CreateFileW(
-        tempFile,
-        SYNCHRONIZE, 
-        FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
-        NULL, 
-        OPEN_EXISTING, 
-        0, 
-        NULL
-    );
-    if (fileContext.TempFile == INVALID_HANDLE_VALUE)
+    linked = true;
+
+    // The ID tells the tracked file from another one which takes its name later
+    if (!GetFileIdByHandle(sourceFile, &Context->FileId))
     {
-        PrintMsg(PrintColors::Red, L"Error, can't open hard link, code: %d\n", ::GetLastError());
+        PrintMsg(PrintColors::Red, L"Error, can't query file ID, code: %d\n", ::GetLastError());
         goto ReleaseBlock;
     }
 
-    fileContext.TempFileName = BuildWideString(tempFile, NULL);
-    if (!fileContext.TempFileName)
+    // The link keeps the data, the handle is only a shortcut for a restoration
+    if (!g_MonitorContext.HandleFreeTracking)
     {
-        PrintMsg(PrintColors::Red, L"Error, can't allocate temp file name\n");
-        goto ReleaseBlock;
+        // A handle opened by the source name would block renames of parent directories
+        // and keep a deleted source pending until the removal is handled, so the temp
+        // link is opened instead
+        Context->TempFile = OpenFileRelative(
+            g_MonitorContext.DestTempDirHandle,
+            tempName,
+            tempNameLength,
+            FILE_WRITE_ATTRIBUTES,
+            FILE_NON_DIRECTORY_FILE
+        );
+        if (Context->TempFile == INVALID_HANDLE_VALUE)
+        {
+            PrintMsg(PrintColors::Red, L"Error, can't open temporary file, code: %d\n", ::GetLastError());
+            goto ReleaseBlock;
+        }
     }
 
-    fileContext.Key = BuildWideString(SourceFile, NULL);
-    if (!fileContext.Key)
+    // Pack "key\0backup\0temp\0" to one allocation
+
+    AppendWideStringN(&builder, SourceFile, KeyLength + 1);
+    AppendWideStringN(&builder, SourceFile, KeyLength + 1);
+    AppendWideString(&builder, tempFile);
+
+    Context->Key = DetachWideStringBuilder(&builder);
+    if (!Context->Key)
     {
-        PrintMsg(PrintColors::Red, L"Error, can't allocate key string\n");
+        PrintMsg(PrintColors::Red, L"Error, can't allocate file context strings\n");
         goto ReleaseBlock;
     }
 
-    _wcslwr(fileContext.Key);
+    Context->BackupFileName = Context->Key + KeyLength + 1;
+    Context->TempFileName = Context->BackupFileName + KeyLength + 1;
+
+    LowerWideString(Context->Key, KeyLength);
+
+    result = true;
+    
+ReleaseBlock:
+
+    if (!result)
+    {
+        if (linked)
+            ::DeleteFileW(tempFile);
+
+        if (Context->TempFile != INVALID_HANDLE_VALUE)
+            ::CloseHandle(Context->TempFile);
+    }
+
+    if (sourceFile != INVALID_HANDLE_VALUE)
+        ::CloseHandle(sourceFile);
+
+    ReleaseWideStringBuilder(&builder);
+
+    return result;
+}
+
+bool CreateTemporaryBackup(const wchar_t* SourceFile)
+{
+    unsigned long long started = StartMetricTimer();
+    FileContext fileContext;
+    size_t keyLength = GetWideStringLength(SourceFile);
+    void* insert;
+    bool result = false;
+
+    if (IsPathExcluded(SourceFile, keyLength))
+    {
+        PRINT_LEVEL(DebugLevel, PrintColors::Default, "File skipped: {}\n", SourceFile);
+        return true;
+    }
 
-    fileContext.BackupFileName = BuildWideString(SourceFile, NULL);
-    if (!fileContext.BackupFileName)
+    if (!PrepareTemporaryBackup(SourceFile, keyLength, &fileContext))
     {
-        PrintMsg(PrintColors::Red, L"Error, can't allocate backup file name string\n");
+        RecordFlightEvent("temp_backup_failed", keyLength, ::GetLastError());
         goto ReleaseBlock;
     }
 
-    ::EnterCriticalSection(&g_MonitorContext.FilesContextCS);
+    EnterFilesContextLock();
     insert = InsertAVLElement(&g_MonitorContext.FilesContext, &fileContext, sizeof(fileContext));
     ::LeaveCriticalSection(&g_MonitorContext.FilesContextCS);
+
     if (!insert)
     {
+        // The tree fails only on an allocation, it doesn't set the last error
+        RecordFlightEvent("temp_backup_failed", keyLength, ERROR_NOT_ENOUGH_MEMORY);
         PrintMsg(PrintColors::Red, L"Error, can't save file cache\n");
+        ReleaseFileContext(&fileContext);
         goto ReleaseBlock;
     }
 
+    RecordFlightEvent("temp_backup", (unsigned long long)insert, keyLength);
+
     result = true;
     
 ReleaseBlock:
 
-    if (!result)
+    RecordMetricLatency(g_Metrics.TempBackupLatency, started);
+
+    return result;
+}
+
+// Returns the held handle of a temporary backup or opens it by the file ID,
+// the ID includes a sequence number so a reused file record isn't opened
+HANDLE OpenTemporaryBackup(FileContext* FileContext)
+{
+    FILE_ID_DESCRIPTOR id;
+
+    if (FileContext->TempFile != INVALID_HANDLE_VALUE)
+        return FileContext->TempFile;
+
+    id.dwSize = sizeof(id);
+    id.Type = FileIdType;
+    id.FileId.QuadPart = FileContext->FileId;
+
+    return ::OpenFileById(
+        g_MonitorContext.DestTempDirHandle,
+        &id,
+        FILE_WRITE_ATTRIBUTES,
+        FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+        NULL,
+        0
+    );
+}
+
+void CloseTemporaryBackup(FileContext* FileContext, HANDLE File)
+{
+    if (File != FileContext->TempFile)
+        ::CloseHandle(File);
+}
+
+// If a file with the same name exists we should try to find out a different name for a restoration
+bool LinkBackupFromTemp(HANDLE TempFile, HANDLE Directory, const wchar_t* FileName, size_t Length)
+{
+    WideStringBuilder name;
+    size_t i;
+    bool result;
+
+    result = CreateHardLinkFromHandle(TempFile, Directory, FileName, Length, false);
+    if (result || ::GetLastError() != ERROR_ALREADY_EXISTS)
+        return result;
+
+    InitWideStringBuilder(&name);
+
+    for (i = 1; i < 10000; i++)
     {
-        if (fileContext.TempFile != INVALID_HANDLE_VALUE)
-            ::CloseHandle(fileContext.TempFile);
+        TruncateWideStringBuilder(&name, 0);
+        AppendWideStringN(&name, FileName, Length);
+        AppendWideChar(&name, L'.');
+        AppendWideDecimal(&name, i);
 
-        if (fileContext.BackupFileName)
-            FreeWideString(fileContext.BackupFileName);
+        if (!GetWideStringBuilderData(&name))
+            break;
 
-        if (fileContext.TempFileName)
-            FreeWideString(fileContext.TempFileName);
+        result = CreateHardLinkFromHandle(
+            TempFile,
+            Directory,
+            GetWideStringBuilderData(&name),
+            GetWideStringBuilderLength(&name),
+            false
+        );
 
-        if (fileContext.Key)
-            FreeWideString(fileContext.Key);
+        if (result || ::GetLastError() != ERROR_ALREADY_EXISTS)
+            break;
     }
 
+    ReleaseWideStringBuilder(&name);
+
     return result;
 }
 
-bool RestoreBackupFromTemp(FileContext* FileContext, wchar_t* RestoredFilePath)
+bool RestoreBackupFromTemp(FileContext* FileContext, const wchar_t* SourceFile)
 {
-    size_t i = wcslen(RestoredFilePath);
-    bool isDirReady = false;
+    CachedDirectory directory;
+    const wchar_t* fileName;
+    HANDLE tempFile;
+    size_t i, length;
+    unsigned int attempt;
+    DWORD error = ERROR_SUCCESS;
+    bool result = false;
 
-    if (i == 0)
+    for (i = GetWideStringLength(SourceFile); i > 0; i--)
+        if (SourceFile[i - 1] == L'\\' || SourceFile[i - 1] == L'/')
+            break;
+
+    fileName = SourceFile + i;
+    length = wcslen(fileName);
+
+    // The backup is linked by the handle of the temporary link, the temp file path isn't resolved again
+
+    tempFile = OpenTemporaryBackup(FileContext);
+    if (tempFile == INVALID_HANDLE_VALUE)
         return false;
 
-    do
+    for (attempt = 0; ; attempt++)
     {
-        i--;
+        // Make sure the parent directory exists, usually it's already in the cache
 
-        if (RestoredFilePath[i] == L'\\' || RestoredFilePath[i] == L'/')
+        if (i > 0)
         {
-            wchar_t chr = RestoredFilePath[i];
-            RestoredFilePath[i] = L'\0';
-            isDirReady = CreateDirectoryByFullPath(RestoredFilePath);
-            RestoredFilePath[i] = chr;
-            break;
+            if (!OpenCachedDirectory(g_MonitorContext.BackupDirCache, SourceFile, i - 1, &directory))
+            {
+                error = ::GetLastError();
+                break;
+            }
+        }
+        else
+        {
+            directory.handle = GetDirectoryCacheRoot(g_MonitorContext.BackupDirCache);
+            directory.owned = false;
+            directory.entry = NULL;
         }
-    }
-    while (i > 0);
 
-    if (!isDirReady)
-        return false;
+        result = LinkBackupFromTemp(tempFile, directory.handle, fileName, length);
+        error = ::GetLastError();
 
-    if (::CreateHardLinkW(RestoredFilePath, FileContext->TempFileName, NULL))
-        return true;
+        CloseCachedDirectory(&directory);
 
-    if (::GetLastError() != ERROR_ALREADY_EXISTS)
-        return false;
+        // A cached directory may have been removed by a user, it's opened once again
+        if (result || attempt || i == 0 || !IsStaleDirectoryError(error))
+            break;
+
+        InvalidateCachedDirectory(g_MonitorContext.BackupDirCache, SourceFile, i - 1);
+    }
 
-    // If a file with the same name exists we should try to find out a different name for a restoration
+    CloseTemporaryBackup(FileContext, tempFile);
 
-    for (i = 1; i < 10000; i++)
-    {
-        wchar_t postfix[100];
-        wchar_t* pathWithPostfix;
-        BOOL result;
+    if (!result)
+        ::SetLastError(error);
 
-        swprintf_s(postfix, L".%d", i);
+    return result;
+}
 
-        pathWithPostfix = BuildWideString(RestoredFilePath, postfix, NULL);
-        if (!pathWithPostfix)
-            return false;
+void RestoreBackupTask(void* Parameter)
+{
+    FileContext* fileContext = (FileContext*)Parameter;
+    unsigned long long started = StartMetricTimer();
+    bool restored;
 
-        result = ::CreateHardLinkW(pathWithPostfix, FileContext->TempFileName, NULL);
-        FreeWideString(pathWithPostfix);
+    restored = RestoreBackupFromTemp(fileContext, fileContext->BackupFileName);
+    RecordMetricLatency(g_Metrics.RestoreLatency, started);
 
-        if (result || ::GetLastError() != ERROR_ALREADY_EXISTS)
-            return (result == TRUE);
-    }
+    if (restored)
+        PRINT_RATE_LIMITED(InfoLevel, 100, 1000, PrintColors::Green, "File backuped: {}\n", fileContext->BackupFileName);
+    else
+        RecordFlightEvent("restore_failed", (unsigned long long)fileContext, ::GetLastError());
 
-    return false;
+    ReleaseFileContext(fileContext);
+    ReleaseToObjectPool(g_MonitorContext.RestoreContextsPool, fileContext);
 }
 
 bool UpgradeBackupToConstant(const wchar_t* SourceFile)
 {
+    unsigned long long started = StartMetricTimer();
     FileContext lookFileContext;
     FileContext* fileContext;
-    wchar_t* restoredFilePath = 0;
+    FileContext* restoreContext = NULL;
+    WideStringBuilder key;
+    size_t keyLength = GetWideStringLength(SourceFile);
     bool result = false;
-    bool found = false;
 
-    if (IsPathExcluded(SourceFile))
+    if (IsPathExcluded(SourceFile, keyLength))
     {
-        PrintMsg(PrintColors::Default, L"File skipped: %s\n", SourceFile);
+        PRINT_LEVEL(DebugLevel, PrintColors::Default, "File skipped: {}\n", SourceFile);
         return true;
     }
 
     memset(&lookFileContext, 0, sizeof(lookFileContext));
+    InitWideStringBuilder(&key);
+
+    AppendWideStringN(&key, SourceFile, keyLength);
 
-    lookFileContext.Key = BuildWideString(SourceFile, NULL);
+    lookFileContext.Key = GetWideStringBuilderData(&key);
     if (!lookFileContext.Key)
     {
         PrintMsg(PrintColors::Red, L"Error, can't allocate key string\n");
         goto ReleaseBlock;
     }
 
-    _wcslwr(lookFileContext.Key);
+    LowerWideString(lookFileContext.Key, keyLength);
+
+    // The context is detached from the tree under the same lock, so a new
+    // backup of the same name can't be mixed up with this one
+
+    EnterFilesContextLock();
 
-    ::EnterCriticalSection(&g_MonitorContext.FilesContextCS);
     fileContext = (FileContext*)FindAVLElement(&g_MonitorContext.FilesContext, &lookFileContext);
+    if (fileContext)
+    {
+        restoreContext = (FileContext*)AllocateFromObjectPool(g_MonitorContext.RestoreContextsPool);
+        if (restoreContext)
+        {
+            *restoreContext = *fileContext;
+            fileContext->BackupFileName = NULL;
+        }
+
+        RemoveAVLElement(&g_MonitorContext.FilesContext, &lookFileContext);
+    }
+
     ::LeaveCriticalSection(&g_MonitorContext.FilesContextCS);
+
     if (!fileContext)
         goto ReleaseBlock;
 
-    restoredFilePath = BuildWideString(g_MonitorContext.DestBackupDir, SourceFile, NULL);
-    if (!restoredFilePath)
+    if (!restoreContext)
     {
-        PrintMsg(PrintColors::Red, L"Error, can't allocate restored path\n");
+        PrintMsg(PrintColors::Red, L"Error, can't allocate restore context\n");
         goto ReleaseBlock;
     }
 
-    found = true;
-
-    if (!RestoreBackupFromTemp(fileContext, restoredFilePath))
-        goto ReleaseBlock;
+    // Link creation runs on the task pool, the monitoring thread goes on with the next change
+    if (!SubmitTask(g_MonitorContext.Scheduler, RestoreBackupTask, restoreContext))
+        RestoreBackupTask(restoreContext);
 
-    PrintMsg(PrintColors::Green, L"File backuped: %s\n", SourceFile);
     result = true;
 
 ReleaseBlock:
 
-    if (found)
-    {
-        ::EnterCriticalSection(&g_MonitorContext.FilesContextCS);
-        RemoveAVLElement(&g_MonitorContext.FilesContext, &lookFileContext);
-        ::LeaveCriticalSection(&g_MonitorContext.FilesContextCS);
-    }
-
-    if (lookFileContext.Key)
-        FreeWideString(lookFileContext.Key);
+    ReleaseWideStringBuilder(&key);
 
-    if (restoredFilePath)
-        FreeWideString(restoredFilePath);
+    RecordMetricLatency(g_Metrics.UpgradeLatency, started);
 
     return result;
 }
@@ -327,6 +772,66 @@ void ReleaseBackupMonitorContext()
 {
     unsigned int i;
 
+    // Pending restorations need the backup directory cache and the tree
+    if (g_MonitorContext.Scheduler)
+        DestroyTaskScheduler(g_MonitorContext.Scheduler);
+
+    if (g_MonitorContext.RescanThread)
+        ::CloseHandle(g_MonitorContext.RescanThread);
+
+    if (g_MonitorContext.RescanRequestEvent)
+        ::CloseHandle(g_MonitorContext.RescanRequestEvent);
+
+    if (g_MonitorContext.RescanStopEvent)
+        ::CloseHandle(g_MonitorContext.RescanStopEvent);
+
+    if (g_MonitorContext.RescanDoneEvent)
+        ::CloseHandle(g_MonitorContext.RescanDoneEvent);
+
+    if (g_MonitorContext.ScanSemaphore)
+        ::CloseHandle(g_MonitorContext.ScanSemaphore);
+
+    if (g_MonitorContext.CoalesceThread)
+        ::CloseHandle(g_MonitorContext.CoalesceThread);
+
+    if (g_MonitorContext.CoalesceStopEvent)
+        ::CloseHandle(g_MonitorContext.CoalesceStopEvent);
+
+    if (g_MonitorContext.CoalesceLanesDone)
+        ::CloseHandle(g_MonitorContext.CoalesceLanesDone);
+
+    // Changes are left only if the monitor hasn't been started
+    while (g_MonitorContext.PendingHead)
+    {
+        PendingChange* change = g_MonitorContext.PendingHead;
+        g_MonitorContext.PendingHead = change->Next;
+        free(change);
+    }
+
+    if (g_MonitorContext.PendingBuckets)
+        free(g_MonitorContext.PendingBuckets);
+
+    if (g_MonitorContext.JournalThread)
+        ::CloseHandle(g_MonitorContext.JournalThread);
+
+    if (g_MonitorContext.JournalStopEvent)
+        ::CloseHandle(g_MonitorContext.JournalStopEvent);
+
+    if (g_MonitorContext.Journal)
+        CloseUsnJournal(g_MonitorContext.Journal);
+
+    if (g_MonitorContext.TreeDirectories)
+    {
+        for (i = 0; i < g_MonitorContext.TreeDirectoriesSize; i++)
+            if (g_MonitorContext.TreeDirectories[i].Name)
+                free(g_MonitorContext.TreeDirectories[i].Name);
+
+        free(g_MonitorContext.TreeDirectories);
+    }
+
+    if (g_MonitorContext.SourceDirVolumePath)
+        FreeWideString(g_MonitorContext.SourceDirVolumePath);
+
     if (g_MonitorContext.SourceDirHandle && g_MonitorContext.SourceDirHandle != INVALID_HANDLE_VALUE)
         ::CloseHandle(g_MonitorContext.SourceDirHandle);
 
@@ -339,26 +844,65 @@ void ReleaseBackupMonitorContext()
     if (g_MonitorContext.DestTempDir)
         FreeWideString(g_MonitorContext.DestTempDir);
 
+    if (g_MonitorContext.DestTempDirHandle && g_MonitorContext.DestTempDirHandle != INVALID_HANDLE_VALUE)
+        ::CloseHandle(g_MonitorContext.DestTempDirHandle);
+
     if (g_MonitorContext.DestBackupDir)
         FreeWideString(g_MonitorContext.DestBackupDir);
 
+    if (g_MonitorContext.BackupDirCache)
+        DestroyDirectoryCache(g_MonitorContext.BackupDirCache);
+
     if (g_MonitorContext.ExcludedPath)
         FreeWideString(g_MonitorContext.ExcludedPath);
 
-    if (g_MonitorContext.Operations)
+    if (g_MonitorContext.Reapers)
+    {
+        for (i = 0; i < g_MonitorContext.ReapersCount; i++)
+        {
+            if (g_MonitorContext.Reapers[i].Thread)
+                ::CloseHandle(g_MonitorContext.Reapers[i].Thread);
+
+            if (g_MonitorContext.Reapers[i].StartStopEvent)
+                ::CloseHandle(g_MonitorContext.Reapers[i].StartStopEvent);
+        }
+
+        free(g_MonitorContext.Reapers);
+    }
+
+    if (g_MonitorContext.BackupWorkers)
     {
-        for (i = 0; i < g_MonitorContext.OperationsCount; i++)
-            if (g_MonitorContext.Operations[i].Thread)
-                ::CloseHandle(g_MonitorContext.Operations[i].Thread);
+        for (i = 0; i < g_MonitorContext.BackupWorkersCount; i++)
+            if (g_MonitorContext.BackupWorkers[i])
+                ::CloseHandle(g_MonitorContext.BackupWorkers[i]);
 
-        free(g_MonitorContext.Operations);
+        free(g_MonitorContext.BackupWorkers);
     }
 
+    if (g_MonitorContext.ChangesSemaphore)
+        ::CloseHandle(g_MonitorContext.ChangesSemaphore);
+
+    // Batches left in the queue are released with the pool
+    if (g_MonitorContext.ChangesQueue)
+        DestroyLockFreeQueue(g_MonitorContext.ChangesQueue);
+
+    if (g_MonitorContext.ChangeBatchesPool)
+        DestroyObjectPool(g_MonitorContext.ChangeBatchesPool);
+
+    if (g_MonitorContext.Operations)
+        free(g_MonitorContext.Operations);
+
     if (g_MonitorContext.OperationsBuffer)
         ::VirtualFree(g_MonitorContext.OperationsBuffer, 0, MEM_RELEASE);
 
     DestroyAVLTree(&g_MonitorContext.FilesContext);
     ::DeleteCriticalSection(&g_MonitorContext.FilesContextCS);
+
+    if (g_MonitorContext.FileNodesPool)
+        DestroyObjectPool(g_MonitorContext.FileNodesPool);
+
+    if (g_MonitorContext.RestoreContextsPool)
+        DestroyObjectPool(g_MonitorContext.RestoreContextsPool);
 }
 
 bool InitMonitoredDirContext(const wchar_t* SourceDir)
@@ -398,6 +942,8 @@ bool InitMonitoredDirContext(const wchar_t* SourceDir)
 
 bool InitBackupDirContext(wchar_t* BackupDir)
 {
+    FILETIME epoch;
+
     g_MonitorContext.DestTempDir = BuildWideString(BackupDir, L"\\temp", NULL);
     if (!g_MonitorContext.DestTempDir)
     {
@@ -405,6 +951,18 @@ bool InitBackupDirContext(wchar_t* BackupDir)
         return false;
     }
 
+    g_MonitorContext.DestTempDirLen = wcslen(g_MonitorContext.DestTempDir);
+
+    // Leave room for a temporary name
+    if (g_MonitorContext.DestTempDirLen > MAX_PATH - 64)
+    {
+        PrintMsg(PrintColors::Red, L"Error, backup directory path is too long\n");
+        return false;
+    }
+
+    ::GetSystemTimeAsFileTime(&epoch);
+    g_MonitorContext.TempEpoch = ((unsigned long long)epoch.dwHighDateTime << 32) | epoch.dwLowDateTime;
+
     g_MonitorContext.DestBackupDir = BuildWideString(BackupDir, L"\\backup\\", NULL);
     if (!g_MonitorContext.DestBackupDir)
     {
@@ -417,6 +975,8 @@ bool InitBackupDirContext(wchar_t* BackupDir)
 
 bool CreateBackupDir(wchar_t* BackupDir)
 {
+    unsigned int i;
+
     if (!CreateDirectoryByFullPath(BackupDir))
         return false;
 
@@ -431,6 +991,19 @@ bool CreateBackupDir(wchar_t* BackupDir)
         return false;
     }
 
+    for (i = 0; i < TempDirFanout; i++)
+    {
+        wchar_t subdir[MAX_PATH + 1];
+
+        swprintf_s(subdir, L"%s\\%02x", g_MonitorContext.DestTempDir, i);
+
+        if (!::CreateDirectoryW(subdir, NULL) && ::GetLastError() != ERROR_ALREADY_EXISTS)
+        {
+            PrintMsg(PrintColors::Red, L"Error, can't create temporary directory '%s', code %d\n", subdir, ::GetLastError());
+            return false;
+        }
+    }
+
     if (!::CreateDirectoryW(g_MonitorContext.DestBackupDir, NULL) && ::GetLastError() != ERROR_ALREADY_EXISTS)
     {
         PrintMsg(
@@ -442,8 +1015,30 @@ bool CreateBackupDir(wchar_t* BackupDir)
         return false;
     }
 
-    return true;
-}
+    g_MonitorContext.DestTempDirHandle = ::CreateFileW(
+        g_MonitorContext.DestTempDir,
+        FILE_TRAVERSE | SYNCHRONIZE,
+        FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+        NULL,
+        OPEN_EXISTING,
+        FILE_FLAG_BACKUP_SEMANTICS,
+        NULL
+    );
+    if (g_MonitorContext.DestTempDirHandle == INVALID_HANDLE_VALUE)
+    {
+        PrintMsg(PrintColors::Red, L"Error, can't open temporary directory, code %d\n", ::GetLastError());
+        return false;
+    }
+
+    g_MonitorContext.BackupDirCache = CreateDirectoryCache(g_MonitorContext.DestBackupDir);
+    if (!g_MonitorContext.BackupDirCache)
+    {
+        PrintMsg(PrintColors::Red, L"Error, can't open backup directory, code %d\n", ::GetLastError());
+        return false;
+    }
+
+    return true;
+}
 
 void SetExcludedPath(const wchar_t* SourceDir, wchar_t* BackupDir)
 {
@@ -567,10 +1162,14 @@ ReleaseBlock:
 
 bool InitOperationsContext()
 {
-    enum { ChangeInformationBlockSize = 0x1000 };
+    enum { ChangeInformationBlockSize = 0x1000, ChangesQueueSize = 0x400 };
     unsigned int i;
 
+    // Reads are kept outstanding, two of them per logical processor, so changes
+    // are queued by the system while reapers are busy. A couple of reapers
+    // drain completions by batches.
     g_MonitorContext.OperationsCount = GetAmountOfCPUCores() * 2;
+    g_MonitorContext.ReapersCount = (g_MonitorContext.OperationsCount > 2 ? 2 : 1);
 
     g_MonitorContext.Operations = (OperationContext*)malloc(sizeof(OperationContext) * g_MonitorContext.OperationsCount);
     if (!g_MonitorContext.Operations)
@@ -579,11 +1178,46 @@ bool InitOperationsContext()
         return false;
     }
 
-    g_MonitorContext.OperationsBufferSize = ChangeInformationBlockSize;
+    g_MonitorContext.Reapers = (ReaperContext*)malloc(sizeof(ReaperContext) * g_MonitorContext.ReapersCount);
+    if (!g_MonitorContext.Reapers)
+    {
+        PrintMsg(PrintColors::Red, L"Error, can't allocate reapers context\n");
+        return false;
+    }
+
+    memset(g_MonitorContext.Reapers, 0, sizeof(ReaperContext) * g_MonitorContext.ReapersCount);
+
+    // Workers mostly wait for file system I/O, two of them per logical processor
+    // keep every processor busy while the others are blocked
+    g_MonitorContext.BackupWorkersCount = GetAmountOfCPUCores() * 2;
+    g_MonitorContext.BackupWorkers = (HANDLE*)calloc(g_MonitorContext.BackupWorkersCount, sizeof(HANDLE));
+    if (!g_MonitorContext.BackupWorkers)
+    {
+        PrintMsg(PrintColors::Red, L"Error, can't allocate backup workers context\n");
+        return false;
+    }
+
+    // A pooled batch keeps a whole read of the initial size, bigger reads are
+    // copied to the heap
+    g_MonitorContext.ChangeBatchesPool = CreateObjectPool(
+        FIELD_OFFSET(ChangeBatch, Data) + ChangeInformationBlockSize, 
+        __alignof(ChangeBatch),
+        16
+    );
+    g_MonitorContext.ChangesQueue = CreateLockFreeQueue(ChangesQueueSize);
+    g_MonitorContext.ChangesSemaphore = ::CreateSemaphore(NULL, 0, MAXLONG, NULL);
+
+    if (!g_MonitorContext.ChangeBatchesPool || !g_MonitorContext.ChangesQueue || !g_MonitorContext.ChangesSemaphore)
+    {
+        PrintMsg(PrintColors::Red, L"Error, can't create changes queue, code %d\n", ::GetLastError());
+        return false;
+    }
+
+    // The max size is reserved for every operation, a buffer grows in place
     g_MonitorContext.OperationsBuffer = ::VirtualAlloc(
         NULL, 
-        ChangeInformationBlockSize * g_MonitorContext.OperationsCount,
-        MEM_COMMIT, 
+        MaxChangeInformationBlockSize * g_MonitorContext.OperationsCount,
+        MEM_RESERVE, 
         PAGE_READWRITE
     );
     if (!g_MonitorContext.OperationsBuffer)
@@ -598,23 +1232,41 @@ bool InitOperationsContext()
 
     for (i = 0; i < g_MonitorContext.OperationsCount; i++)
     {
-        g_MonitorContext.Operations[i].StartStopEvent = ::CreateEvent(NULL, FALSE, FALSE, NULL);
-        if (!g_MonitorContext.Operations[i].StartStopEvent)
+        g_MonitorContext.Operations[i].Index = i;
+        g_MonitorContext.Operations[i].BufferSize = ChangeInformationBlockSize;
+        g_MonitorContext.Operations[i].ChangeInfo = (PFILE_NOTIFY_INFORMATION)::VirtualAlloc(
+            (char*)g_MonitorContext.OperationsBuffer + (MaxChangeInformationBlockSize * i),
+            ChangeInformationBlockSize,
+            MEM_COMMIT,
+            PAGE_READWRITE
+        );
+        if (!g_MonitorContext.Operations[i].ChangeInfo)
         {
             PrintMsg(
                 PrintColors::Red, 
-                L"Error, can't create sync event, code %d\n", 
+                L"Error, can't commit operations buffer, code %d\n", 
                 ::GetLastError()
             );
             return false;
         }
 
-        g_MonitorContext.Operations[i].Index = i;
-        g_MonitorContext.Operations[i].ChangeInfo = (PFILE_NOTIFY_INFORMATION)(
-            (char*)g_MonitorContext.OperationsBuffer + (ChangeInformationBlockSize * i)
-        );
-        g_MonitorContext.Operations[i].Thread = NULL;
         memset(&g_MonitorContext.Operations[i].Overlapped, 0, sizeof(g_MonitorContext.Operations[i].Overlapped));
+        g_MonitorContext.Operations[i].Failures = 0;
+    }
+
+    for (i = 0; i < g_MonitorContext.ReapersCount; i++)
+    {
+        g_MonitorContext.Reapers[i].Index = i;
+        g_MonitorContext.Reapers[i].StartStopEvent = ::CreateEvent(NULL, FALSE, FALSE, NULL);
+        if (!g_MonitorContext.Reapers[i].StartStopEvent)
+        {
+            PrintMsg(
+                PrintColors::Red, 
+                L"Error, can't create sync event, code %d\n", 
+                ::GetLastError()
+            );
+            return false;
+        }
     }
 
     return true;
@@ -626,9 +1278,23 @@ bool InitBackupMonitorContext(const wchar_t* SourceDir, wchar_t* BackupDir)
 
     memset(&g_MonitorContext, 0, sizeof(g_MonitorContext));
 
+    RegisterMonitorMetrics();
+
     ::InitializeCriticalSection(&g_MonitorContext.FilesContextCS);
     InitializeAVLTree(&g_MonitorContext.FilesContext, AVLTreeAllocate, AVLTreeFree, AVLTreeCompare);
 
+    // Tree nodes are allocated by monitoring threads and restore contexts are
+    // released by scheduler workers, the pools move them back by batches
+
+    g_MonitorContext.FileNodesPool = CreateObjectPool(sizeof(AVL_NODE) + sizeof(FileContext), __alignof(AVL_NODE));
+    g_MonitorContext.RestoreContextsPool = CreateObjectPool(sizeof(FileContext), __alignof(FileContext));
+
+    if (!g_MonitorContext.FileNodesPool || !g_MonitorContext.RestoreContextsPool)
+    {
+        PrintMsg(PrintColors::Red, L"Error, can't create object pools\n");
+        goto ReleaseBlock;
+    }
+
     if (!InitMonitoredDirContext(SourceDir))
         goto ReleaseBlock;
 
@@ -641,8 +1307,15 @@ bool InitBackupMonitorContext(const wchar_t* SourceDir, wchar_t* BackupDir)
     if (!InitExcludedPath(SourceDir, BackupDir))
         goto ReleaseBlock;
 
-    if (!InitOperationsContext())
+    if (!InitRescanContext())
+        goto ReleaseBlock;
+
+    g_MonitorContext.Scheduler = CreateTaskScheduler();
+    if (!g_MonitorContext.Scheduler)
+    {
+        PrintMsg(PrintColors::Red, L"Error, can't create task scheduler, code %d\n", ::GetLastError());
         goto ReleaseBlock;
+    }
 
     result = true;
 
@@ -654,223 +1327,2279 @@ ReleaseBlock:
     return result;
 }
 
-DWORD WINAPI MonitoringRoutine(LPVOID Parameter)
+// FileName is relative to the monitored directory and null-terminated
+void DispatchFileChange(DWORD Action, const wchar_t* FileName, size_t Length, unsigned int Index)
 {
-    OperationContext* context = g_MonitorContext.Operations + (uintptr_t)Parameter;
+    const char* action;
+    PrintColors color = PrintColors::Default;
 
-    ::SetEvent(context->StartStopEvent);
+    AddMetricCounter(g_Metrics.Changes);
 
-    while (true)
+    if (Action == FILE_ACTION_ADDED || Action == FILE_ACTION_RENAMED_NEW_NAME)
+        CreateTemporaryBackup(FileName);
+    else if (Action == FILE_ACTION_REMOVED || Action == FILE_ACTION_RENAMED_OLD_NAME)
+        UpgradeBackupToConstant(FileName);
+    
+    switch (Action)
     {
-        OperationContext* current;
-        PFILE_NOTIFY_INFORMATION info;
-        LPOVERLAPPED overlapped;
-        ULONG_PTR key;
-        DWORD returned;
+    case FILE_ACTION_ADDED:
+        action = "FILE_ACTION_ADDED";
+        color = PrintColors::DarkGreen;
+        break;
+    case FILE_ACTION_RENAMED_NEW_NAME:
+        action = "FILE_ACTION_RENAMED_NEW_NAME";
+        color = PrintColors::DarkYellow;
+        break;
+    case FILE_ACTION_REMOVED:
+        action = "FILE_ACTION_REMOVED";
+        color = PrintColors::DarkRed;
+        break;
+    case FILE_ACTION_RENAMED_OLD_NAME:
+        action = "FILE_ACTION_RENAMED_OLD_NAME";
+        color = PrintColors::DarkYellow;
+        break;
+    default:
+        action = "UNKNOWN";
+        color = PrintColors::Red;
+        break;
+    }
 
-        if (!::GetQueuedCompletionStatus(g_MonitorContext.SourceDirIocp, &returned, &key, &overlapped, INFINITE))
-        {
-            PrintMsg(PrintColors::Red, L"Error, can't receive iocp status, code: %d\n", ::GetLastError());
-            break;
-        }
+    PRINT_RATE_LIMITED(
+        DebugLevel, 100, 1000, color, "{} (inx:{}) {}\n", 
+        action, Index, FormatPath(FileName, Length)
+    );
+}
 
-        if (!returned)
-            break;
+// =============================================
+//  Coalescing
+//
+//  Build tools and editors create and remove temporary files within
+//  milliseconds. With a coalescing window a change waits before it's
+//  dispatched: a name which is added and removed within the window is dropped
+//  without touching the file system, so a rename chain A->B->C ends up as
+//  A->C, and a repeated change of a name is merged with the pending one.
+//  Only small files are worth it: a file over the size limit may be created
+//  and removed within the window as well, its addition is dispatched at once
+//  so the file is protected.
+//
+//  Changes of a name keep their order, expired changes are dispatched by
+//  scheduler tasks, a lane per a group of names.
+
+bool IsAddedAction(DWORD Action)
+{
+    return (Action == FILE_ACTION_ADDED || Action == FILE_ACTION_RENAMED_NEW_NAME);
+}
 
-        current = (OperationContext*)overlapped;
-        info = current->ChangeInfo;
+bool IsRemovedAction(DWORD Action)
+{
+    return (Action == FILE_ACTION_REMOVED || Action == FILE_ACTION_RENAMED_OLD_NAME);
+}
 
-        while (true)
-        {
-            wchar_t format[100];
-            PrintColors color = PrintColors::Default;
+// FNV-1a
+unsigned int HashChangeKey(const wchar_t* Key, size_t Length)
+{
+    unsigned int hash = 2166136261u;
+    size_t i;
 
-            if (info->FileNameLength + sizeof(FILE_NOTIFY_INFORMATION) + sizeof(WCHAR) > g_MonitorContext.OperationsBufferSize)
-                break;
+    for (i = 0; i < Length; i++)
+        hash = (hash ^ Key[i]) * 16777619u;
 
-            info->FileName[info->FileNameLength / sizeof(WCHAR)] = L'\0';
+    return hash;
+}
 
-            if (info->Action == FILE_ACTION_ADDED || info->Action == FILE_ACTION_RENAMED_NEW_NAME)
-                CreateTemporaryBackup(info->FileName);
-            else if (info->Action == FILE_ACTION_REMOVED || info->Action == FILE_ACTION_RENAMED_OLD_NAME)
-                UpgradeBackupToConstant(info->FileName);
-            
-            switch (info->Action)
-            {
-            case FILE_ACTION_ADDED:
-                wcscpy_s(format, L"FILE_ACTION_ADDED (inx:%d) %s\n");
-                color = PrintColors::DarkGreen;
-                break;
-            case FILE_ACTION_RENAMED_NEW_NAME:
-                wcscpy_s(format, L"FILE_ACTION_RENAMED_NEW_NAME (inx:%d) %s\n");
-                color = PrintColors::DarkYellow;
-                break;
-            case FILE_ACTION_REMOVED:
-                wcscpy_s(format, L"FILE_ACTION_REMOVED (inx:%d) %s\n");
-                color = PrintColors::DarkRed;
-                break;
-            case FILE_ACTION_RENAMED_OLD_NAME:
-                wcscpy_s(format, L"FILE_ACTION_RENAMED_OLD_NAME (inx:%d) %s\n");
-                color = PrintColors::DarkYellow;
-                break;
-            default:
-                wcscpy_s(format, L"UNKNOWN (inx:%d) %s\n");
-                color = PrintColors::Red;
-                break;
-            }
+// Returns the latest pending change of a name, the coalescing lock is held
+PendingChange* FindPendingChange(const wchar_t* Key, size_t Length, unsigned int Hash)
+{
+    PendingChange* change = g_MonitorContext.PendingBuckets[Hash & (CoalesceBuckets - 1)];
 
-            PrintMsg(color, format, context->Index, info->FileName);
+    for (; change; change = change->HashNext)
+        if (change->Hash == Hash && change->Length == Length && !memcmp(change->Key, Key, Length * sizeof(wchar_t)))
+            return change;
 
-            if (!info->NextEntryOffset)
-                break;
+    return NULL;
+}
 
-            info = (PFILE_NOTIFY_INFORMATION)((char*)info + info->NextEntryOffset);
-        }
+void LinkPendingHash(PendingChange* Change)
+{
+    PendingChange** bucket = g_MonitorContext.PendingBuckets + (Change->Hash & (CoalesceBuckets - 1));
+
+    Change->HashNext = *bucket;
+    *bucket = Change;
+}
+
+void UnlinkPendingHash(PendingChange* Change)
+{
+    PendingChange** link = g_MonitorContext.PendingBuckets + (Change->Hash & (CoalesceBuckets - 1));
+
+    while (*link != Change)
+        link = &(*link)->HashNext;
+
+    *link = Change->HashNext;
+}
+
+void UnlinkPendingChange(PendingChange* Change)
+{
+    if (Change->Prev)
+        Change->Prev->Next = Change->Next;
+    else
+        g_MonitorContext.PendingHead = Change->Next;
+
+    if (Change->Next)
+        Change->Next->Prev = Change->Prev;
+    else
+        g_MonitorContext.PendingTail = Change->Prev;
+}
+
+// Watchers report names inside of their buffers without a terminator, a name
+// is copied to a terminated buffer for DispatchFileChange()
+void DispatchUnterminatedFileChange(DWORD Action, const wchar_t* FileName, size_t Length, unsigned int Index)
+{
+    wchar_t buffer[MAX_PATH + 1];
+    wchar_t* name = buffer;
 
-        if (!::ReadDirectoryChangesW(
-            g_MonitorContext.SourceDirHandle,
-            current->ChangeInfo,
-            g_MonitorContext.OperationsBufferSize,
-            TRUE,
-            FILE_NOTIFY_CHANGE_FILE_NAME,
-            &returned,
-            overlapped,
-            NULL))
+    if (Length >= _countof(buffer))
+    {
+        name = (wchar_t*)malloc((Length + 1) * sizeof(wchar_t));
+        if (!name)
         {
-            PrintMsg(PrintColors::Red, L"Error, failed to read directory changes, code: %d\n", ::GetLastError());
-            break;
+            PrintMsg(PrintColors::Red, L"Error, can't allocate a file name, a change is lost\n");
+            return;
         }
     }
 
-    ::SetEvent(context->StartStopEvent);
+    memcpy(name, FileName, Length * sizeof(wchar_t));
+    name[Length] = L'\0';
 
-    return 0;
+    DispatchFileChange(Action, name, Length, Index);
+
+    if (name != buffer)
+        free(name);
 }
 
-bool StartBackupMonitor(wchar_t* SourceDir, wchar_t* BackupDir)
+// A file which can't be opened counts as small, it's likely gone already
+bool IsOverCoalesceSizeLimit(const wchar_t* FileName, size_t Length)
 {
-    unsigned int i;
+    HANDLE file;
+    LARGE_INTEGER size;
+    bool result = false;
 
-    if (!SetTokenPrivilege("SeCreateSymbolicLinkPrivilege", TRUE))
+    file = OpenFileRelative(g_MonitorContext.SourceDirHandle, FileName, Length, FILE_READ_ATTRIBUTES, FILE_NON_DIRECTORY_FILE);
+    if (file == INVALID_HANDLE_VALUE)
         return false;
 
-    if (!InitBackupMonitorContext(SourceDir, BackupDir))
-        return false;
+    if (::GetFileSizeEx(file, &size))
+        result = ((unsigned long long)size.QuadPart > g_MonitorContext.CoalesceSizeLimit);
 
-    for (i = 0; i < g_MonitorContext.OperationsCount; i++)
+    ::CloseHandle(file);
+    return result;
+}
+
+// Replaces DispatchFileChange() for watchers, FileName doesn't need a terminator
+void SubmitFileChange(DWORD Action, const wchar_t* FileName, size_t Length, unsigned int Index)
+{
+    PendingChange* change;
+    PendingChange* latest;
+    bool large;
+
+    if (!g_MonitorContext.CoalesceWindow || (!IsAddedAction(Action) && !IsRemovedAction(Action)))
     {
-        DWORD threadId, error;
-        OperationContext* context = g_MonitorContext.Operations + i;
-        
-        context->Thread = ::CreateThread(NULL, 0, MonitoringRoutine, (LPVOID)i, 0, &threadId);
-        if (!context->Thread)
-        {   
-            PrintMsg(
-                PrintColors::Yellow, 
-                L"Warning, can't create working thread, code %d\n", 
-                ::GetLastError()
-            );
-            continue;
-        }
+        DispatchUnterminatedFileChange(Action, FileName, Length, Index);
+        return;
+    }
 
-        error = ::WaitForSingleObject(context->StartStopEvent, 1000);
-        if (error != WAIT_OBJECT_0)
+    large = (IsAddedAction(Action) && IsOverCoalesceSizeLimit(FileName, Length));
+
+    // "name\0key\0" in one allocation
+    change = (PendingChange*)malloc(FIELD_OFFSET(PendingChange, Name) + (Length + 1) * 2 * sizeof(wchar_t));
+    if (!change)
+    {
+        DispatchUnterminatedFileChange(Action, FileName, Length, Index);
+        return;
+    }
+
+    change->Key = change->Name + Length + 1;
+
+    memcpy(change->Name, FileName, Length * sizeof(wchar_t));
+    memcpy(change->Key, FileName, Length * sizeof(wchar_t));
+    change->Name[Length] = L'\0';
+    change->Key[Length] = L'\0';
+    LowerWideString(change->Key, Length);
+
+    change->Received = ::GetTickCount64();
+    change->Action = Action;
+    change->Index = Index;
+    change->Length = Length;
+    change->Hash = HashChangeKey(change->Key, Length);
+    change->Large = large;
+    change->NewerSameName = NULL;
+    change->OlderSameName = NULL;
+
+    AcquireSpinLock(&g_MonitorContext.CoalesceLock);
+
+    latest = FindPendingChange(change->Key, Length, change->Hash);
+
+    if (large && !latest)
+    {
+        // Nothing of the name is pending, so the addition doesn't overtake a change
+        ReleaseSpinLock(&g_MonitorContext.CoalesceLock);
+
+        AddMetricCounter(g_Metrics.CoalesceBypassed);
+        DispatchFileChange(Action, change->Name, Length, Index);
+        free(change);
+        return;
+    }
+
+    if (latest && IsAddedAction(latest->Action) && !latest->Large && IsRemovedAction(Action))
+    {
+        // A transient file, neither a temporary backup nor a backup is needed
+        UnlinkPendingHash(latest);
+        UnlinkPendingChange(latest);
+
+        if (latest->OlderSameName)
         {
-            PrintMsg(
-                PrintColors::Yellow, 
-                L"Warning, working thread (tid:%d,inx:%d) didn't respond, code %d\n",
-                threadId, 
-                context->Index,
-                ::GetLastError()
-            );
+            latest->OlderSameName->NewerSameName = NULL;
+            LinkPendingHash(latest->OlderSameName);
         }
+
+        ReleaseSpinLock(&g_MonitorContext.CoalesceLock);
+
+        AddMetricCounter(g_Metrics.CoalesceCancelled);
+        free(latest);
+        free(change);
+        return;
     }
 
-    for (i = 0; i < g_MonitorContext.OperationsCount; i++)
+    if (latest && IsAddedAction(latest->Action) == IsAddedAction(Action))
     {
-        OperationContext* context = g_MonitorContext.Operations + i;
-        DWORD returned;
-
-        if (!::ReadDirectoryChangesW(
-            g_MonitorContext.SourceDirHandle,
-            context->ChangeInfo,
-            g_MonitorContext.OperationsBufferSize,
-            TRUE,
-            FILE_NOTIFY_CHANGE_FILE_NAME,
-            &returned,
-            &context->Overlapped,
-            NULL)
-        )
-            PrintMsg(
-                PrintColors::Yellow,
-                L"Warning, failed to read directory changes (inx:%d), code: %d\n", 
-                context->Index, 
-                ::GetLastError()
-            );
+        // The pending change already does the same, the file may have grown since
+        if (large)
+            latest->Large = true;
+
+        ReleaseSpinLock(&g_MonitorContext.CoalesceLock);
+
+        AddMetricCounter(g_Metrics.CoalesceDeduplicated);
+        free(change);
+        return;
     }
 
-    return true;
+    // A removal followed by an addition or a removal of a big file, both are needed
+    if (latest)
+    {
+        UnlinkPendingHash(latest);
+        latest->NewerSameName = change;
+        change->OlderSameName = latest;
+    }
+
+    LinkPendingHash(change);
+
+    change->Next = NULL;
+    change->Prev = g_MonitorContext.PendingTail;
+
+    if (g_MonitorContext.PendingTail)
+        g_MonitorContext.PendingTail->Next = change;
+    else
+        g_MonitorContext.PendingHead = change;
+
+    g_MonitorContext.PendingTail = change;
+
+    ReleaseSpinLock(&g_MonitorContext.CoalesceLock);
 }
 
-void StopBackupMonitor()
+// Returns a list of changes which have spent the window linked by Next, or
+// all of them if Everything is set
+PendingChange* DetachExpiredChanges(bool Everything)
 {
-    unsigned int i;
+    unsigned long long now = ::GetTickCount64();
+    PendingChange* expired = NULL;
+    PendingChange** tail = &expired;
+    PendingChange* change;
 
-    for (i = 0; i < g_MonitorContext.OperationsCount; i++)
+    AcquireSpinLock(&g_MonitorContext.CoalesceLock);
+
+    while ((change = g_MonitorContext.PendingHead) != NULL)
     {
-        OperationContext* context = g_MonitorContext.Operations + i;
+        if (!Everything && change->Received + g_MonitorContext.CoalesceWindow > now)
+            break;
 
-        if (!::PostQueuedCompletionStatus(g_MonitorContext.SourceDirIocp, 0, 0, &context->Overlapped))
-            PrintMsg(
-                PrintColors::Yellow,
-                L"Warning, can't post completion status (inx:%d), code: %d\n", 
-                context->Index,
-                ::GetLastError()
-            );
+        UnlinkPendingChange(change);
+
+        // Changes leave in order, so it's the oldest change of the name
+        if (change->NewerSameName)
+            change->NewerSameName->OlderSameName = NULL;
+        else
+            UnlinkPendingHash(change);
+
+        change->Next = NULL;
+        *tail = change;
+        tail = &change->Next;
     }
 
-    for (i = 0; i < g_MonitorContext.OperationsCount; i++)
+    ReleaseSpinLock(&g_MonitorContext.CoalesceLock);
+
+    return expired;
+}
+
+void DispatchChangesLaneTask(void* Parameter)
+{
+    PendingChange* change = (PendingChange*)Parameter;
+
+    while (change)
     {
-        OperationContext* context = g_MonitorContext.Operations + i;
-        ::WaitForSingleObject(context->StartStopEvent, INFINITE);
+        PendingChange* next = change->Next;
+
+        DispatchFileChange(change->Action, change->Name, change->Length, change->Index);
+        AddMetricCounter(g_Metrics.CoalesceFlushed);
+
+        free(change);
+        change = next;
     }
 
-    ReleaseBackupMonitorContext();
+    if (::InterlockedDecrement(&g_MonitorContext.CoalesceLanesPending) == 0)
+        ::SetEvent(g_MonitorContext.CoalesceLanesDone);
 }
 
-// =============================================
+// Changes of a name go to the same lane, so they are dispatched in order.
+// Returns when all lanes are done, a flush doesn't overtake the previous one.
+void DispatchExpiredChanges(PendingChange* Changes)
+{
+    PendingChange* heads[MaxCoalesceLanes];
+    PendingChange** tails[MaxCoalesceLanes];
+    TaskItem tasks[MaxCoalesceLanes];
+    unsigned int lanesCount = g_MonitorContext.CoalesceLanesCount;
+    unsigned int tasksCount = 0;
+    unsigned int submitted;
+    unsigned int i;
 
-int wmain(int argc, wchar_t* argv[])
+    for (i = 0; i < lanesCount; i++)
+    {
+        heads[i] = NULL;
+        tails[i] = heads + i;
+    }
+
+    while (Changes)
+    {
+        PendingChange* next = Changes->Next;
+        unsigned int lane = Changes->Hash % lanesCount;
+
+        Changes->Next = NULL;
+        *tails[lane] = Changes;
+        tails[lane] = &Changes->Next;
+
+        Changes = next;
+    }
+
+    for (i = 0; i < lanesCount; i++)
+    {
+        if (!heads[i])
+            continue;
+
+        tasks[tasksCount].routine = DispatchChangesLaneTask;
+        tasks[tasksCount].parameter = heads[i];
+        tasksCount++;
+    }
+
+    // The routine holds a reference itself, so the event isn't set before all lanes are submitted
+    g_MonitorContext.CoalesceLanesPending = (long)tasksCount + 1;
+    ::ResetEvent(g_MonitorContext.CoalesceLanesDone);
+
+    // All lanes are published at once, lanes which don't fit to the queues are dispatched here
+    submitted = SubmitTaskBatch(g_MonitorContext.Scheduler, tasks, tasksCount);
+    for (i = submitted; i < tasksCount; i++)
+        DispatchChangesLaneTask(tasks[i].parameter);
+
+    if (::InterlockedDecrement(&g_MonitorContext.CoalesceLanesPending) != 0)
+        ::WaitForSingleObject(g_MonitorContext.CoalesceLanesDone, INFINITE);
+}
+
+DWORD WINAPI CoalesceRoutine(LPVOID Parameter)
 {
-    g_consoleContext = CreateAsyncConsolePrinterContext(PrintColors::Default, true);
-    if (!g_consoleContext)
+    DWORD period = g_MonitorContext.CoalesceWindow / 4;
+    bool stopped = false;
+
+    if (!period)
+        period = 1;
+
+    while (!stopped)
     {
-        printf("Error, can't initialize console printer\n");
-        return 1;
+        PendingChange* expired;
+
+        // Watchers are stopped before us, everything left is dispatched
+        stopped = (::WaitForSingleObject(g_MonitorContext.CoalesceStopEvent, period) != WAIT_TIMEOUT);
+
+        expired = DetachExpiredChanges(stopped);
+        if (expired)
+            DispatchExpiredChanges(expired);
     }
 
-    PrintMsg(PrintColors::Default, L"Backup deleted files by JKornev, 2017\n");
+    return 0;
+}
+
+// Should be called before watchers are started, does nothing if coalescing is disabled
+bool StartCoalescer(unsigned int Window, unsigned long long SizeLimit)
+{
+    g_MonitorContext.CoalesceWindow = Window;
+    g_MonitorContext.CoalesceSizeLimit = SizeLimit;
+    if (!Window)
+        return true;
 
-    if (argc != 3)
+    g_MonitorContext.CoalesceLanesCount = GetTaskSchedulerWorkersCount(g_MonitorContext.Scheduler);
+    if (!g_MonitorContext.CoalesceLanesCount)
+        g_MonitorContext.CoalesceLanesCount = 1;
+    else if (g_MonitorContext.CoalesceLanesCount > MaxCoalesceLanes)
+        g_MonitorContext.CoalesceLanesCount = MaxCoalesceLanes;
+
+    g_MonitorContext.PendingBuckets = (PendingChange**)calloc(CoalesceBuckets, sizeof(PendingChange*));
+    if (!g_MonitorContext.PendingBuckets)
     {
-        PrintMsg(PrintColors::Red, L"Error, invalid arguments, usage: BackupDeleted <SourceDir> <BackupDir>\n");
-        DestroyAsyncConsolePrinterContext(g_consoleContext);
-        return 1;
+        PrintMsg(PrintColors::Red, L"Error, can't allocate coalescing table\n");
+        return false;
     }
 
-    PrintMsg(PrintColors::Gray, L"Source directory: %s\n", argv[1]);
-    PrintMsg(PrintColors::Gray, L"Backup directory: %s\n", argv[2]);
+    g_MonitorContext.CoalesceStopEvent = ::CreateEvent(NULL, TRUE, FALSE, NULL);
+    g_MonitorContext.CoalesceLanesDone = ::CreateEvent(NULL, TRUE, FALSE, NULL);
 
-    if (!StartBackupMonitor(argv[1], argv[2]))
+    if (!g_MonitorContext.CoalesceStopEvent || !g_MonitorContext.CoalesceLanesDone)
     {
-        DestroyAsyncConsolePrinterContext(g_consoleContext);
-        return 2;
+        PrintMsg(PrintColors::Red, L"Error, can't create coalescing events, code %d\n", ::GetLastError());
+        return false;
     }
 
-    PrintMsg(PrintColors::Default, L"Press ENTER to exit\n");
-    getchar();
+    g_MonitorContext.CoalesceThread = ::CreateThread(NULL, 0, CoalesceRoutine, NULL, 0, NULL);
+    if (!g_MonitorContext.CoalesceThread)
+    {
+        PrintMsg(PrintColors::Red, L"Error, can't create coalescing thread, code %d\n", ::GetLastError());
+        return false;
+    }
 
-    StopBackupMonitor();
+    return true;
+}
+
+// Dispatches all pending changes, watchers should be stopped already
+void StopCoalescer()
+{
+    if (!g_MonitorContext.CoalesceThread)
+        return;
+
+    ::SetEvent(g_MonitorContext.CoalesceStopEvent);
+    ::WaitForSingleObject(g_MonitorContext.CoalesceThread, INFINITE);
+}
+
+// =============================================
+//  Rescan
+//
+//  Changes which have been lost by a watcher are recovered by comparing the
+//  monitored tree with the files context: an untracked file gets a temporary
+//  backup and a tracked file which is gone is backed up as a removed one. The
+//  same walk protects files which exist at startup.
+//
+//  Directories are enumerated by a few dedicated workers, files of a directory
+//  are checked and inserted to the tree by batches. An optional I/O budget
+//  limits the rate of a walk, so live changes aren't starved. Requests which
+//  come during a rescan are folded into the next one.
+
+// Returns false only if the file is gone, a file which can't be opened for
+// another reason is treated as present. FileId is optional, it's 0 if the ID
+// can't be queried.
+bool IsSourceFilePresent(const wchar_t* FileName, size_t Length, LONGLONG* FileId = NULL)
+{
+    HANDLE file = OpenFileRelative(g_MonitorContext.SourceDirHandle, FileName, Length, FILE_READ_ATTRIBUTES, FILE_NON_DIRECTORY_FILE);
+    DWORD error;
+
+    if (FileId)
+        *FileId = 0;
+
+    if (file == INVALID_HANDLE_VALUE)
+    {
+        error = ::GetLastError();
+
+        if (error == ERROR_FILE_NOT_FOUND || error == ERROR_PATH_NOT_FOUND || error == ERROR_DELETE_PENDING)
+            return false;
+
+        RecordFlightEvent("source_open_failed", Length, error);
+        return true;
+    }
+
+    if (FileId && !GetFileIdByHandle(file, FileId))
+        *FileId = 0;
+
+    ::CloseHandle(file);
+    return true;
+}
+
+// FileId is optional, it receives the ID of the tracked file
+bool IsTemporaryBackupPresent(const wchar_t* FileName, size_t Length, LONGLONG* FileId = NULL)
+{
+    FileContext* fileContext;
+    FileContext lookFileContext;
+    WideStringBuilder key;
+    bool found = false;
+
+    memset(&lookFileContext, 0, sizeof(lookFileContext));
+    InitWideStringBuilder(&key);
+
+    AppendWideStringN(&key, FileName, Length);
+
+    lookFileContext.Key = GetWideStringBuilderData(&key);
+    if (lookFileContext.Key)
+    {
+        LowerWideString(lookFileContext.Key, Length);
+
+        EnterFilesContextLock();
+
+        fileContext = (FileContext*)FindAVLElement(&g_MonitorContext.FilesContext, &lookFileContext);
+        if (fileContext)
+        {
+            found = true;
+
+            if (FileId)
+                *FileId = fileContext->FileId;
+        }
+
+        ::LeaveCriticalSection(&g_MonitorContext.FilesContextCS);
+    }
+
+    ReleaseWideStringBuilder(&key);
+
+    return found;
+}
+
+RescanTask* AllocateRescanTask(const wchar_t* Path, size_t Length)
+{
+    RescanTask* task = (RescanTask*)malloc(FIELD_OFFSET(RescanTask, Path) + (Length + 1) * sizeof(wchar_t));
+
+    if (!task)
+        return NULL;
+
+    memcpy(task->Path, Path, Length * sizeof(wchar_t));
+    task->Path[Length] = L'\0';
+    task->Length = Length;
+    task->Next = NULL;
+
+    return task;
+}
+
+bool IsRescanStopped()
+{
+    return (::WaitForSingleObject(g_MonitorContext.RescanStopEvent, 0) == WAIT_OBJECT_0);
+}
+
+// The budget is counted from the start of a walk with a burst of a tenth of a
+// second, a worker which is ahead of it waits
+void ConsumeScanBudget(unsigned int Cost)
+{
+    unsigned long long consumed, allowed;
+    unsigned int budget = g_MonitorContext.ScanBudget;
+
+    if (!budget)
+        return;
+
+    consumed = (unsigned long long)::InterlockedExchangeAdd64(&g_MonitorContext.ScanConsumed, Cost) + Cost;
+
+    while (true)
+    {
+        DWORD delay;
+
+        allowed = (::GetTickCount64() - g_MonitorContext.ScanStarted) * budget / 1000 + budget / 10;
+        if (consumed <= allowed)
+            break;
+
+        delay = (DWORD)((consumed - allowed) * 1000 / budget) + 1;
+        if (delay > 100)
+            delay = 100;
+
+        if (::WaitForSingleObject(g_MonitorContext.RescanStopEvent, delay) != WAIT_TIMEOUT)
+            break;
+    }
+}
+
+// Directories are kept in a stack, a depth-first walk holds fewer of them
+void PushScanDirectory(RescanTask* Task)
+{
+    ::InterlockedIncrement(&g_MonitorContext.RescanPending);
+
+    AcquireSpinLock(&g_MonitorContext.ScanLock);
+    Task->Next = g_MonitorContext.ScanDirectories;
+    g_MonitorContext.ScanDirectories = Task;
+    ReleaseSpinLock(&g_MonitorContext.ScanLock);
+
+    ::ReleaseSemaphore(g_MonitorContext.ScanSemaphore, 1, NULL);
+}
+
+RescanTask* PopScanDirectory()
+{
+    RescanTask* task;
+
+    AcquireSpinLock(&g_MonitorContext.ScanLock);
+
+    task = g_MonitorContext.ScanDirectories;
+    if (task)
+        g_MonitorContext.ScanDirectories = task->Next;
+
+    ReleaseSpinLock(&g_MonitorContext.ScanLock);
+
+    return task;
+}
+
+// =============================================
+
+// Candidates are kept as "lowered\0original\0", the lowered copy is a tree key
+struct ScanBatch
+{
+    WideStringBuilder Names;
+    size_t            Offsets[ScanBatchSize];
+    size_t            Lengths[ScanBatchSize];
+    unsigned int      Count;
+};
+
+// Every batch takes the files lock twice: to skip tracked files and to insert
+// new backups, links are created without the lock
+void FlushScanBatch(ScanBatch* Batch)
+{
+    FileContext contexts[ScanBatchSize];
+    unsigned int sources[ScanBatchSize];
+    bool tracked[ScanBatchSize];
+    bool inserted[ScanBatchSize];
+    FileContext lookFileContext;
+    wchar_t* names = GetWideStringBuilderData(&Batch->Names);
+    unsigned int i, count = 0;
+    LONGLONG fileId;
+
+    if (!Batch->Count || !names)
+        goto ReleaseBlock;
+
+    memset(&lookFileContext, 0, sizeof(lookFileContext));
+
+    EnterFilesContextLock();
+
+    for (i = 0; i < Batch->Count; i++)
+    {
+        lookFileContext.Key = names + Batch->Offsets[i];
+        tracked[i] = (FindAVLElement(&g_MonitorContext.FilesContext, &lookFileContext) != NULL);
+    }
+
+    ::LeaveCriticalSection(&g_MonitorContext.FilesContextCS);
+
+    for (i = 0; i < Batch->Count && !IsRescanStopped(); i++)
+    {
+        const wchar_t* original = names + Batch->Offsets[i] + Batch->Lengths[i] + 1;
+
+        if (tracked[i])
+            continue;
+
+        ConsumeScanBudget(1);
+
+        if (PrepareTemporaryBackup(original, Batch->Lengths[i], contexts + count))
+            sources[count++] = i;
+    }
+
+    if (!count)
+        goto ReleaseBlock;
+
+    EnterFilesContextLock();
+
+    // A live change may have added the same file meanwhile
+    for (i = 0; i < count; i++)
+        inserted[i] = (InsertAVLElement(&g_MonitorContext.FilesContext, contexts + i, sizeof(FileContext)) != NULL);
+
+    ::LeaveCriticalSection(&g_MonitorContext.FilesContextCS);
+
+    for (i = 0; i < count; i++)
+    {
+        const wchar_t* original = names + Batch->Offsets[sources[i]] + Batch->Lengths[sources[i]] + 1;
+
+        if (!inserted[i])
+        {
+            ReleaseFileContext(contexts + i);
+            continue;
+        }
+
+        ::InterlockedIncrement(&g_MonitorContext.ScanAddedFiles);
+        AddMetricCounter(g_Metrics.RescanAddedFiles);
+        PRINT_LEVEL(DebugLevel, PrintColors::DarkGreen, "Rescan, file added: {}\n", contexts[i].BackupFileName);
+
+        // A file deleted between the tracked check and the insert has had its removal
+        // handled already, that found nothing to upgrade. The same goes for a file
+        // replaced meanwhile, the new one is tracked afterwards.
+        if (!IsSourceFilePresent(original, Batch->Lengths[sources[i]], &fileId))
+        {
+            RecordFlightEvent("scan_file_gone", Batch->Lengths[sources[i]]);
+            UpgradeBackupToConstant(original);
+        }
+        else if (fileId && fileId != contexts[i].FileId)
+        {
+            RecordFlightEvent("scan_file_replaced", (unsigned long long)contexts[i].FileId, (unsigned long long)fileId);
+            UpgradeBackupToConstant(original);
+            CreateTemporaryBackup(original);
+        }
+    }
+
+ReleaseBlock:
+
+    TruncateWideStringBuilder(&Batch->Names, 0);
+    Batch->Count = 0;
+}
+
+void AddScanCandidate(ScanBatch* Batch, const wchar_t* Path, size_t Length)
+{
+    size_t offset = GetWideStringBuilderLength(&Batch->Names);
+
+    // Both copies are null-terminated
+    if (!AppendWideStringN(&Batch->Names, Path, Length + 1) || !AppendWideStringN(&Batch->Names, Path, Length + 1))
+    {
+        TruncateWideStringBuilder(&Batch->Names, offset);
+        return;
+    }
+
+    LowerWideString(GetWideStringBuilderData(&Batch->Names) + offset, Length);
+
+    Batch->Offsets[Batch->Count] = offset;
+    Batch->Lengths[Batch->Count] = Length;
+
+    if (++Batch->Count == ScanBatchSize)
+        FlushScanBatch(Batch);
+}
+
+// =============================================
+
+void RescanDirectoryEntry(RescanTask* Task, PFILE_FULL_DIR_INFO Info, WideStringBuilder* Path, ScanBatch* Batch)
+{
+    size_t nameLength = Info->FileNameLength / sizeof(wchar_t);
+    const wchar_t* path;
+    size_t length;
+
+    if (Info->FileName[0] == L'.' && (nameLength == 1 || (nameLength == 2 && Info->FileName[1] == L'.')))
+        return;
+
+    TruncateWideStringBuilder(Path, 0);
+
+    if (Task->Length)
+    {
+        AppendWideStringN(Path, Task->Path, Task->Length);
+        AppendWideChar(Path, L'\\');
+    }
+
+    AppendWideStringN(Path, Info->FileName, nameLength);
+
+    if (Info->FileAttributes & FILE_ATTRIBUTE_DIRECTORY)
+    {
+        RescanTask* subtask;
+
+        // Links to other places aren't followed, they may lead outside of the tree or loop
+        if (Info->FileAttributes & FILE_ATTRIBUTE_REPARSE_POINT)
+            return;
+
+        // The excluded path has a trailing slash
+        AppendWideChar(Path, L'\\');
+
+        path = GetWideStringBuilderData(Path);
+        length = GetWideStringBuilderLength(Path);
+
+        if (!path || IsPathExcluded(path, length))
+            return;
+
+        subtask = AllocateRescanTask(path, length - 1);
+        if (!subtask)
+        {
+            PrintMsg(PrintColors::Red, L"Error, can't allocate rescan task\n");
+            return;
+        }
+
+        PushScanDirectory(subtask);
+        return;
+    }
+
+    ::InterlockedIncrement(&g_MonitorContext.ScannedFiles);
+
+    path = GetWideStringBuilderData(Path);
+    length = GetWideStringBuilderLength(Path);
+
+    if (!path || IsPathExcluded(path, length))
+        return;
+
+    AddScanCandidate(Batch, path, length);
+}
+
+void RescanDirectory(RescanTask* Task)
+{
+    FILE_INFO_BY_HANDLE_CLASS infoClass = FileFullDirectoryRestartInfo;
+    WideStringBuilder path;
+    ScanBatch* batch;
+    HANDLE directory = INVALID_HANDLE_VALUE;
+    char* buffer;
+
+    InitWideStringBuilder(&path);
+
+    AddMetricCounter(g_Metrics.RescanDirectories);
+    ::InterlockedIncrement(&g_MonitorContext.ScannedDirectories);
+
+    // A big buffer takes a whole directory of usual size with a single call
+    buffer = (char*)malloc(ScanDirectoryBufferSize);
+    batch = (ScanBatch*)malloc(sizeof(ScanBatch));
+    if (!buffer || !batch)
+    {
+        PrintMsg(PrintColors::Red, L"Error, can't allocate rescan buffer\n");
+        goto ReleaseBlock;
+    }
+
+    InitWideStringBuilder(&batch->Names);
+    batch->Count = 0;
+
+    directory = OpenFileRelative(g_MonitorContext.SourceDirHandle, Task->Path, Task->Length, FILE_LIST_DIRECTORY, FILE_DIRECTORY_FILE);
+    if (directory == INVALID_HANDLE_VALUE)
+    {
+        // The directory may be already removed
+        RecordFlightEvent("rescan_open_failed", Task->Length, ::GetLastError());
+        goto ReleaseBlock;
+    }
+
+    while (!IsRescanStopped())
+    {
+        PFILE_FULL_DIR_INFO info = (PFILE_FULL_DIR_INFO)buffer;
+
+        ConsumeScanBudget(1);
+
+        if (!::GetFileInformationByHandleEx(directory, infoClass, buffer, ScanDirectoryBufferSize))
+            break;
+
+        infoClass = FileFullDirectoryInfo;
+
+        while (true)
+        {
+            RescanDirectoryEntry(Task, info, &path, batch);
+
+            if (!info->NextEntryOffset)
+                break;
+
+            info = (PFILE_FULL_DIR_INFO)((char*)info + info->NextEntryOffset);
+        }
+    }
+
+    FlushScanBatch(batch);
+
+ReleaseBlock:
+
+    if (directory != INVALID_HANDLE_VALUE)
+        ::CloseHandle(directory);
+
+    if (batch)
+    {
+        ReleaseWideStringBuilder(&batch->Names);
+        free(batch);
+    }
+
+    if (buffer)
+        free(buffer);
+
+    ReleaseWideStringBuilder(&path);
+
+    free(Task);
+}
+
+// Every semaphore release stands for a pushed directory or the end of a walk
+DWORD WINAPI ScanWorkerRoutine(LPVOID Parameter)
+{
+    while (::WaitForSingleObject(g_MonitorContext.ScanSemaphore, INFINITE) == WAIT_OBJECT_0)
+    {
+        RescanTask* task = PopScanDirectory();
+
+        if (!task)
+            break;
+
+        RescanDirectory(task);
+
+        // Subdirectories are pushed before their parent is done, so zero means the walk is over
+        if (::InterlockedDecrement(&g_MonitorContext.RescanPending) == 0)
+        {
+            ::ReleaseSemaphore(g_MonitorContext.ScanSemaphore, g_MonitorContext.ScanWorkersRunning, NULL);
+            ::SetEvent(g_MonitorContext.RescanDoneEvent);
+        }
+    }
+
+    return 0;
+}
+
+// =============================================
+
+struct TrackedFiles
+{
+    wchar_t** Names;
+    size_t    Count;
+    size_t    Capacity;
+};
+
+bool CollectTrackedFile(void* Node, void* Parameter)
+{
+    FileContext* fileContext = (FileContext*)Node;
+    TrackedFiles* files = (TrackedFiles*)Parameter;
+    wchar_t* name;
+
+    if (files->Count == files->Capacity)
+    {
+        size_t capacity = (files->Capacity ? files->Capacity * 2 : 0x400);
+        wchar_t** names = (wchar_t**)realloc(files->Names, capacity * sizeof(wchar_t*));
+
+        if (!names)
+            return false;
+
+        files->Names = names;
+        files->Capacity = capacity;
+    }
+
+    name = BuildWideString(fileContext->BackupFileName, NULL);
+    if (!name)
+        return false;
+
+    files->Names[files->Count++] = name;
+    return true;
+}
+
+// Tracked names are copied under the lock and checked without it
+void RescanTrackedFiles()
+{
+    TrackedFiles files;
+    size_t i;
+
+    memset(&files, 0, sizeof(files));
+
+    EnterFilesContextLock();
+    EnumerateAVLElements(&g_MonitorContext.FilesContext, CollectTrackedFile, &files);
+    ::LeaveCriticalSection(&g_MonitorContext.FilesContextCS);
+
+    for (i = 0; i < files.Count; i++)
+    {
+        size_t length = wcslen(files.Names[i]);
+
+        if (!IsRescanStopped())
+        {
+            ConsumeScanBudget(1);
+
+            // A renamed file is backed up as well, the new name is picked up by the walk
+            if (!IsSourceFilePresent(files.Names[i], length) && UpgradeBackupToConstant(files.Names[i]))
+            {
+                AddMetricCounter(g_Metrics.RescanRemovedFiles);
+                PRINT_LEVEL(DebugLevel, PrintColors::DarkRed, "Rescan, file removed: {}\n", FormatPath(files.Names[i], length));
+            }
+        }
+
+        FreeWideString(files.Names[i]);
+    }
+
+    if (files.Names)
+        free(files.Names);
+}
+
+void PrintScanProgress(PrintColors Color)
+{
+    PrintMsg(
+        Color,
+        L"Scan: %u directories, %u files, %u protected, %u sec\n",
+        (unsigned int)g_MonitorContext.ScannedDirectories,
+        (unsigned int)g_MonitorContext.ScannedFiles,
+        (unsigned int)g_MonitorContext.ScanAddedFiles,
+        (unsigned int)((::GetTickCount64() - g_MonitorContext.ScanStarted) / 1000)
+    );
+}
+
+void RunRescan(bool Startup)
+{
+    unsigned long long started = StartMetricTimer();
+    HANDLE workers[MaxScanWorkers];
+    unsigned int i, workersCount = 0;
+    RescanTask* root;
+
+    RecordFlightEvent("rescan_started", Startup);
+
+    if (Startup)
+        PrintMsg(PrintColors::Gray, L"Scanning existing files\n");
+    else
+        PrintMsg(PrintColors::Yellow, L"Warning, changes have been lost, rescanning the directory\n");
+
+    g_MonitorContext.ScanStarted = ::GetTickCount64();
+    g_MonitorContext.ScanConsumed = 0;
+    g_MonitorContext.ScannedDirectories = 0;
+    g_MonitorContext.ScannedFiles = 0;
+    g_MonitorContext.ScanAddedFiles = 0;
+
+    // Nothing is tracked before the startup scan
+    if (!Startup)
+        RescanTrackedFiles();
+
+    root = AllocateRescanTask(L"", 0);
+    if (!root)
+    {
+        PrintMsg(PrintColors::Red, L"Error, can't allocate rescan task\n");
+        return;
+    }
+
+    // Workers are started before the walk, the last one releases all of them
+    for (i = 0; i < g_MonitorContext.ScanWorkersCount; i++)
+    {
+        workers[workersCount] = ::CreateThread(NULL, 0, ScanWorkerRoutine, NULL, 0, NULL);
+        if (workers[workersCount])
+            workersCount++;
+    }
+
+    // Without workers the walk is done by this thread
+    g_MonitorContext.ScanWorkersRunning = (workersCount ? workersCount : 1);
+    g_MonitorContext.RescanPending = 0;
+    ::ResetEvent(g_MonitorContext.RescanDoneEvent);
+
+    PushScanDirectory(root);
+
+    if (!workersCount)
+    {
+        PrintMsg(PrintColors::Yellow, L"Warning, can't create scan workers, code %d\n", ::GetLastError());
+        ScanWorkerRoutine(NULL);
+    }
+
+    while (::WaitForSingleObject(g_MonitorContext.RescanDoneEvent, ScanProgressInterval) == WAIT_TIMEOUT)
+        PrintScanProgress(PrintColors::Gray);
+
+    for (i = 0; i < workersCount; i++)
+    {
+        ::WaitForSingleObject(workers[i], INFINITE);
+        ::CloseHandle(workers[i]);
+    }
+
+    PrintScanProgress(IsRescanStopped() ? PrintColors::Yellow : PrintColors::Green);
+
+    RecordMetricLatency(g_Metrics.RescanLatency, started);
+    RecordFlightEvent("rescan_finished", g_MonitorContext.ScannedDirectories, g_MonitorContext.ScanAddedFiles);
+}
+
+DWORD WINAPI RescanRoutine(LPVOID Parameter)
+{
+    HANDLE events[2] = { g_MonitorContext.RescanStopEvent, g_MonitorContext.RescanRequestEvent };
+
+    if (g_MonitorContext.StartupScan)
+        RunRescan(true);
+
+    while (::WaitForMultipleObjects(_countof(events), events, FALSE, INFINITE) == WAIT_OBJECT_0 + 1)
+    {
+        RunRescan(false);
+
+        // A request which came during the rescan is served after a pause
+        if (::WaitForSingleObject(g_MonitorContext.RescanStopEvent, RescanInterval) != WAIT_TIMEOUT)
+            break;
+    }
+
+    return 0;
+}
+
+// Can be called by any thread, it doesn't block
+void RequestRescan()
+{
+    ::SetEvent(g_MonitorContext.RescanRequestEvent);
+}
+
+bool InitRescanContext()
+{
+    // Half of the processors are left to live changes
+    g_MonitorContext.ScanWorkersCount = GetAmountOfCPUCores() / 2;
+    if (!g_MonitorContext.ScanWorkersCount)
+        g_MonitorContext.ScanWorkersCount = 1;
+    else if (g_MonitorContext.ScanWorkersCount > MaxScanWorkers)
+        g_MonitorContext.ScanWorkersCount = MaxScanWorkers;
+
+    g_MonitorContext.RescanRequestEvent = ::CreateEvent(NULL, FALSE, FALSE, NULL);
+    g_MonitorContext.RescanStopEvent = ::CreateEvent(NULL, TRUE, FALSE, NULL);
+    g_MonitorContext.RescanDoneEvent = ::CreateEvent(NULL, TRUE, FALSE, NULL);
+    g_MonitorContext.ScanSemaphore = ::CreateSemaphore(NULL, 0, MAXLONG, NULL);
+
+    if (!g_MonitorContext.RescanRequestEvent || !g_MonitorContext.RescanStopEvent 
+        || !g_MonitorContext.RescanDoneEvent || !g_MonitorContext.ScanSemaphore)
+    {
+        PrintMsg(PrintColors::Red, L"Error, can't create rescan events, code %d\n", ::GetLastError());
+        return false;
+    }
+
+    return true;
+}
+
+bool StartRescanThread()
+{
+    g_MonitorContext.RescanThread = ::CreateThread(NULL, 0, RescanRoutine, NULL, 0, NULL);
+    if (!g_MonitorContext.RescanThread)
+    {
+        PrintMsg(PrintColors::Red, L"Error, can't create rescan thread, code %d\n", ::GetLastError());
+        return false;
+    }
+
+    return true;
+}
+
+void StopRescanThread()
+{
+    if (!g_MonitorContext.RescanThread)
+        return;
+
+    ::SetEvent(g_MonitorContext.RescanStopEvent);
+    ::WaitForSingleObject(g_MonitorContext.RescanThread, INFINITE);
+}
+
+// =============================================
+//  USN journal watcher
+//
+//  The journal reports changes of the whole volume. A record is checked by
+//  its parent reference against directories of the monitored tree first, so
+//  a path is resolved only for records inside the tree. Every tree directory
+//  is kept with its parent and name, a path is built by walking parents up to
+//  the root. That doesn't need the directory to exist anymore, records of
+//  files of a removed directory precede the record of the directory itself.
+//  The set is filled by a walk at start and follows directory records
+//  afterwards. Only the journal thread uses it.
+
+unsigned int HashDirectoryId(DWORDLONG Id, unsigned int Size)
+{
+    return (unsigned int)((Id * 0x9E3779B97F4A7C15ull) >> 32) & (Size - 1);
+}
+
+TreeDirectory* FindTreeDirectory(DWORDLONG Id)
+{
+    unsigned int index;
+
+    if (!g_MonitorContext.TreeDirectories || !Id)
+        return NULL;
+
+    index = HashDirectoryId(Id, g_MonitorContext.TreeDirectoriesSize);
+
+    while (g_MonitorContext.TreeDirectories[index].Id)
+    {
+        if (g_MonitorContext.TreeDirectories[index].Id == Id)
+            return g_MonitorContext.TreeDirectories + index;
+
+        index = (index + 1) & (g_MonitorContext.TreeDirectoriesSize - 1);
+    }
+
+    return NULL;
+}
+
+// Every directory is in the tree if the set couldn't be filled
+bool IsDirectoryIdTracked(DWORDLONG Id)
+{
+    if (g_MonitorContext.TreeDirectoriesFailed)
+        return true;
+
+    return (FindTreeDirectory(Id) != NULL);
+}
+
+void ReleaseTreeDirectories()
+{
+    unsigned int i;
+
+    if (!g_MonitorContext.TreeDirectories)
+        return;
+
+    for (i = 0; i < g_MonitorContext.TreeDirectoriesSize; i++)
+        if (g_MonitorContext.TreeDirectories[i].Name)
+            free(g_MonitorContext.TreeDirectories[i].Name);
+
+    free(g_MonitorContext.TreeDirectories);
+
+    g_MonitorContext.TreeDirectories = NULL;
+    g_MonitorContext.TreeDirectoriesSize = 0;
+    g_MonitorContext.TreeDirectoriesCount = 0;
+}
+
+// Paths can't be built anymore, every record goes to the path cache of the journal
+void FailTreeDirectories()
+{
+    PrintMsg(PrintColors::Yellow, L"Warning, can't keep tree directories, records of the volume aren't filtered\n");
+    g_MonitorContext.TreeDirectoriesFailed = true;
+    ReleaseTreeDirectories();
+}
+
+bool ResizeTreeDirectories(unsigned int Size)
+{
+    TreeDirectory* directories = (TreeDirectory*)calloc(Size, sizeof(TreeDirectory));
+    unsigned int i;
+
+    if (!directories)
+        return false;
+
+    for (i = 0; i < g_MonitorContext.TreeDirectoriesSize; i++)
+    {
+        TreeDirectory* directory = g_MonitorContext.TreeDirectories + i;
+        unsigned int index;
+
+        if (!directory->Id)
+            continue;
+
+        index = HashDirectoryId(directory->Id, Size);
+        while (directories[index].Id)
+            index = (index + 1) & (Size - 1);
+
+        directories[index] = *directory;
+    }
+
+    if (g_MonitorContext.TreeDirectories)
+        free(g_MonitorContext.TreeDirectories);
+
+    g_MonitorContext.TreeDirectories = directories;
+    g_MonitorContext.TreeDirectoriesSize = Size;
+    return true;
+}
+
+bool SetTreeDirectoryName(TreeDirectory* Directory, const wchar_t* Name, size_t NameLength)
+{
+    wchar_t* name = NULL;
+
+    if (NameLength)
+    {
+        name = (wchar_t*)malloc(NameLength * sizeof(wchar_t));
+        if (!name)
+            return false;
+
+        memcpy(name, Name, NameLength * sizeof(wchar_t));
+    }
+
+    if (Directory->Name)
+        free(Directory->Name);
+
+    Directory->Name = name;
+    Directory->NameLength = NameLength;
+    return true;
+}
+
+// Adds a directory or updates its place if it's known already, the root has no parent
+void InsertTreeDirectory(DWORDLONG Id, DWORDLONG Parent, const wchar_t* Name, size_t NameLength)
+{
+    TreeDirectory* directory;
+    unsigned int index;
+
+    if (g_MonitorContext.TreeDirectoriesFailed || !Id)
+        return;
+
+    directory = FindTreeDirectory(Id);
+    if (!directory)
+    {
+        // The load is kept under a half
+        if ((g_MonitorContext.TreeDirectoriesCount + 1) * 2 > g_MonitorContext.TreeDirectoriesSize)
+        {
+            unsigned int size = (g_MonitorContext.TreeDirectoriesSize ? g_MonitorContext.TreeDirectoriesSize * 2 : TreeDirectoriesInitialSize);
+
+            if (!ResizeTreeDirectories(size))
+            {
+                FailTreeDirectories();
+                return;
+            }
+        }
+
+        index = HashDirectoryId(Id, g_MonitorContext.TreeDirectoriesSize);
+        while (g_MonitorContext.TreeDirectories[index].Id)
+            index = (index + 1) & (g_MonitorContext.TreeDirectoriesSize - 1);
+
+        directory = g_MonitorContext.TreeDirectories + index;
+        directory->Id = Id;
+        g_MonitorContext.TreeDirectoriesCount++;
+    }
+
+    directory->Parent = Parent;
+
+    if (!SetTreeDirectoryName(directory, Name, NameLength))
+        FailTreeDirectories();
+}
+
+void RemoveTreeDirectory(DWORDLONG Id)
+{
+    unsigned int mask = g_MonitorContext.TreeDirectoriesSize - 1;
+    TreeDirectory* directories = g_MonitorContext.TreeDirectories;
+    TreeDirectory* directory;
+    unsigned int index, next;
+
+    if (g_MonitorContext.TreeDirectoriesFailed)
+        return;
+
+    directory = FindTreeDirectory(Id);
+    if (!directory)
+        return;
+
+    if (directory->Name)
+        free(directory->Name);
+
+    index = (unsigned int)(directory - directories);
+    memset(directory, 0, sizeof(TreeDirectory));
+    g_MonitorContext.TreeDirectoriesCount--;
+
+    // Following entries are shifted back, so probe sequences stay unbroken
+    for (next = (index + 1) & mask; directories[next].Id; next = (next + 1) & mask)
+    {
+        unsigned int home = HashDirectoryId(directories[next].Id, g_MonitorContext.TreeDirectoriesSize);
+
+        if (index <= next ? (home > index && home <= next) : (home > index || home <= next))
+            continue;
+
+        directories[index] = directories[next];
+        memset(directories + next, 0, sizeof(TreeDirectory));
+        index = next;
+    }
+}
+
+// Fills Chain with directories from Id up to the root (exclusive), returns
+// the depth or -1 if the chain is broken
+int GetTreeDirectoryChain(DWORDLONG Id, TreeDirectory** Chain)
+{
+    int depth = 0;
+
+    while (Id != g_MonitorContext.RootDirectoryId)
+    {
+        TreeDirectory* directory = FindTreeDirectory(Id);
+
+        // The depth limit also breaks a loop left by a missed record
+        if (!directory || depth == MaxTreeDepth)
+            return -1;
+
+        Chain[depth++] = directory;
+        Id = directory->Parent;
+    }
+
+    return depth;
+}
+
+// Subdirectories of a directory moved out of the tree are left in the set,
+// they are found by a broken chain and removed
+void PruneTreeDirectories()
+{
+    TreeDirectory* chain[MaxTreeDepth];
+    DWORDLONG* orphans;
+    unsigned int i, count = 0;
+
+    if (g_MonitorContext.TreeDirectoriesFailed || !g_MonitorContext.TreeDirectoriesCount)
+        return;
+
+    orphans = (DWORDLONG*)malloc(g_MonitorContext.TreeDirectoriesCount * sizeof(DWORDLONG));
+    if (!orphans)
+        return;
+
+    for (i = 0; i < g_MonitorContext.TreeDirectoriesSize; i++)
+    {
+        DWORDLONG id = g_MonitorContext.TreeDirectories[i].Id;
+
+        if (id && id != g_MonitorContext.RootDirectoryId && GetTreeDirectoryChain(id, chain) < 0)
+            orphans[count++] = id;
+    }
+
+    for (i = 0; i < count; i++)
+        RemoveTreeDirectory(orphans[i]);
+
+    free(orphans);
+}
+
+// Adds subdirectories of a directory of the monitored tree, the directory
+// itself should be added already. Path is relative to the monitored directory.
+void CollectDirectoryIds(const wchar_t* Path, size_t Length)
+{
+    RescanTask* stack;
+    WideStringBuilder path;
+    char* buffer;
+
+    InitWideStringBuilder(&path);
+
+    stack = AllocateRescanTask(Path, Length);
+    buffer = (char*)malloc(ScanDirectoryBufferSize);
+    if (!stack || !buffer)
+    {
+        PrintMsg(PrintColors::Red, L"Error, can't allocate directory walk buffer\n");
+        goto ReleaseBlock;
+    }
+
+    stack->Next = NULL;
+
+    while (stack && ::WaitForSingleObject(g_MonitorContext.JournalStopEvent, 0) == WAIT_TIMEOUT)
+    {
+        FILE_INFO_BY_HANDLE_CLASS infoClass = FileIdBothDirectoryRestartInfo;
+        RescanTask* task = stack;
+        HANDLE directory;
+        LONGLONG id;
+
+        stack = task->Next;
+
+        directory = OpenFileRelative(g_MonitorContext.SourceDirHandle, task->Path, task->Length, FILE_LIST_DIRECTORY, FILE_DIRECTORY_FILE);
+        if (directory == INVALID_HANDLE_VALUE)
+        {
+            // The directory may be already removed
+            free(task);
+            continue;
+        }
+
+        // Children can't be attached without the ID of their parent
+        if (!GetFileIdByHandle(directory, &id))
+        {
+            RecordFlightEvent("tree_no_id", task->Length, ::GetLastError());
+            ::CloseHandle(directory);
+            free(task);
+            continue;
+        }
+
+        while (::GetFileInformationByHandleEx(directory, infoClass, buffer, ScanDirectoryBufferSize))
+        {
+            PFILE_ID_BOTH_DIR_INFO info = (PFILE_ID_BOTH_DIR_INFO)buffer;
+
+            infoClass = FileIdBothDirectoryInfo;
+
+            while (true)
+            {
+                size_t nameLength = info->FileNameLength / sizeof(wchar_t);
+                RescanTask* subtask;
+
+                // Links to other places aren't followed, they may lead outside of the tree or loop
+                if ((info->FileAttributes & FILE_ATTRIBUTE_DIRECTORY)
+                    && !(info->FileAttributes & FILE_ATTRIBUTE_REPARSE_POINT)
+                    && !(info->FileName[0] == L'.' && (nameLength == 1 || (nameLength == 2 && info->FileName[1] == L'.'))))
+                {
+                    InsertTreeDirectory((DWORDLONG)info->FileId.QuadPart, (DWORDLONG)id, info->FileName, nameLength);
+
+                    TruncateWideStringBuilder(&path, 0);
+
+                    if (task->Length)
+                    {
+                        AppendWideStringN(&path, task->Path, task->Length);
+                        AppendWideChar(&path, L'\\');
+                    }
+
+                    AppendWideStringN(&path, info->FileName, nameLength);
+
+                    subtask = (GetWideStringBuilderData(&path) ? AllocateRescanTask(GetWideStringBuilderData(&path), GetWideStringBuilderLength(&path)) : NULL);
+                    if (subtask)
+                    {
+                        subtask->Next = stack;
+                        stack = subtask;
+                    }
+                    else
+                    {
+                        PrintMsg(PrintColors::Red, L"Error, can't allocate directory walk task\n");
+                    }
+                }
+
+                if (!info->NextEntryOffset)
+                    break;
+
+                info = (PFILE_ID_BOTH_DIR_INFO)((char*)info + info->NextEntryOffset);
+            }
+        }
+
+        ::CloseHandle(directory);
+        free(task);
+    }
+
+ReleaseBlock:
+
+    while (stack)
+    {
+        RescanTask* next = stack->Next;
+        free(stack);
+        stack = next;
+    }
+
+    if (buffer)
+        free(buffer);
+
+    ReleaseWideStringBuilder(&path);
+}
+
+// Falls back to the path cache of the journal, it opens a directory by the ID
+// therefore a removed directory isn't resolved
+bool BuildJournalRelativePath(DWORDLONG Parent, const wchar_t* Name, size_t NameLength, WideStringBuilder* Path)
+{
+    size_t rootLength = g_MonitorContext.SourceDirVolumePathLen;
+    const wchar_t* parent;
+    size_t parentLength;
+
+    if (!GetUsnDirectoryPath(g_MonitorContext.Journal, Parent, &parent, &parentLength))
+    {
+        RecordFlightEvent("usn_no_parent", Parent, ::GetLastError());
+        return false;
+    }
+
+    if (!IsWidePrefixNoCase(parent, parentLength, g_MonitorContext.SourceDirVolumePath, rootLength))
+        return false;
+
+    if (parentLength > rootLength && parent[rootLength] != L'\\')
+        return false;
+
+    if (parentLength > rootLength)
+    {
+        AppendWideStringN(Path, parent + rootLength + 1, parentLength - rootLength - 1);
+        AppendWideChar(Path, L'\\');
+    }
+
+    AppendWideStringN(Path, Name, NameLength);
+    return (GetWideStringBuilderData(Path) != NULL);
+}
+
+// Builds a path relative to the monitored directory, returns false if the
+// parent is outside of the tree
+bool BuildTreeRelativePath(DWORDLONG Parent, const wchar_t* Name, size_t NameLength, WideStringBuilder* Path)
+{
+    TreeDirectory* chain[MaxTreeDepth];
+    int depth;
+
+    if (g_MonitorContext.TreeDirectoriesFailed)
+        return BuildJournalRelativePath(Parent, Name, NameLength, Path);
+
+    if (!FindTreeDirectory(Parent))
+        return false;
+
+    depth = GetTreeDirectoryChain(Parent, chain);
+    if (depth < 0)
+    {
+        RecordFlightEvent("tree_broken_chain", Parent);
+
+        if (BuildJournalRelativePath(Parent, Name, NameLength, Path))
+            return true;
+
+        // The parent is in the tree but the name can't be placed, the rescan
+        // upgrades backups of tracked files which are gone
+        RequestRescan();
+        return false;
+    }
+
+    while (depth > 0)
+    {
+        TreeDirectory* directory = chain[--depth];
+
+        AppendWideStringN(Path, directory->Name, directory->NameLength);
+        AppendWideChar(Path, L'\\');
+    }
+
+    AppendWideStringN(Path, Name, NameLength);
+    return (GetWideStringBuilderData(Path) != NULL);
+}
+
+// Keeps the set of tree directories and the path cache up to date
+void DispatchDirectoryRecord(const USN_RECORD_V2* Record, const wchar_t* Name, size_t NameLength)
+{
+    DWORDLONG reference = Record->FileReferenceNumber;
+    DWORD reasons = Record->Reason;
+    bool tracked = IsDirectoryIdTracked(reference);
+    bool parentTracked = IsDirectoryIdTracked(Record->ParentFileReferenceNumber);
+    WideStringBuilder path;
+
+    // Cached paths of a moved directory and its children are outdated, only
+    // tree directories are cached
+    if (tracked && (reasons & (USN_REASON_RENAME_OLD_NAME | USN_REASON_FILE_DELETE)))
+        InvalidateUsnDirectoryPath(g_MonitorContext.Journal, Record->ParentFileReferenceNumber, Name, NameLength);
+
+    // A directory is removed only when it's empty, records of its files are handled already
+    if (reasons & USN_REASON_FILE_DELETE)
+    {
+        RemoveTreeDirectory(reference);
+        return;
+    }
+
+    if (!(reasons & (USN_REASON_FILE_CREATE | USN_REASON_RENAME_NEW_NAME)))
+        return;
+
+    if (!parentTracked)
+    {
+        // Moved out of the tree, its subdirectories go with it
+        if (tracked)
+        {
+            RemoveTreeDirectory(reference);
+            PruneTreeDirectories();
+        }
+        return;
+    }
+
+    // A rename inside of the tree only updates the entry, children follow
+    // their parent by the ID
+    InsertTreeDirectory(reference, Record->ParentFileReferenceNumber, Name, NameLength);
+
+    if (tracked || !(reasons & USN_REASON_RENAME_NEW_NAME))
+        return;
+
+    // Moved into the tree, files which came with it aren't tracked yet
+    InitWideStringBuilder(&path);
+
+    if (BuildTreeRelativePath(Record->ParentFileReferenceNumber, Name, NameLength, &path))
+    {
+        CollectDirectoryIds(GetWideStringBuilderData(&path), GetWideStringBuilderLength(&path));
+        RequestRescan();
+    }
+
+    ReleaseWideStringBuilder(&path);
+}
+
+// Records repeat reasons until all handles of a file are closed and we may keep
+// a handle of every backup, so reasons only tell which names to look at. A
+// change is dispatched by the actual state: a tracked name is gone, it's taken
+// by another file or an untracked one appeared. Another file is told by the
+// file ID, a replacing rename or a recreation leaves the name present.
+void DispatchJournalRecord(const USN_RECORD_V2* Record, void* Parameter)
+{
+    enum
+    {
+        RemovalReasons  = USN_REASON_FILE_DELETE | USN_REASON_RENAME_OLD_NAME | USN_REASON_HARD_LINK_CHANGE,
+        CreationReasons = USN_REASON_FILE_CREATE | USN_REASON_RENAME_NEW_NAME | USN_REASON_HARD_LINK_CHANGE,
+    };
+    DWORD reasons = Record->Reason;
+    const wchar_t* name = (const wchar_t*)((const char*)Record + Record->FileNameOffset);
+    size_t nameLength = Record->FileNameLength / sizeof(wchar_t);
+    WideStringBuilder path;
+    const wchar_t* fileName;
+
+    if (Record->FileAttributes & FILE_ATTRIBUTE_DIRECTORY)
+    {
+        DispatchDirectoryRecord(Record, name, nameLength);
+        return;
+    }
+
+    // Most records of a volume are outside of the tree, they are dropped without a path lookup
+    if (!IsDirectoryIdTracked(Record->ParentFileReferenceNumber))
+        return;
+
+    InitWideStringBuilder(&path);
+
+    if (BuildTreeRelativePath(Record->ParentFileReferenceNumber, name, nameLength, &path))
+    {
+        size_t length = GetWideStringBuilderLength(&path);
+        LONGLONG recordId = (LONGLONG)Record->FileReferenceNumber;
+        LONGLONG currentId = 0, trackedId = 0;
+        bool present, tracked;
+
+        fileName = GetWideStringBuilderData(&path);
+
+        present = IsSourceFilePresent(fileName, length, &currentId);
+        tracked = IsTemporaryBackupPresent(fileName, length, &trackedId);
+
+        if (!present)
+        {
+            // Removing a name of a file with other links is reported as a link change,
+            // an untracked name may have a coalesced addition to cancel
+            if (tracked || (reasons & RemovalReasons))
+                SubmitFileChange(
+                    (reasons & USN_REASON_RENAME_OLD_NAME) ? FILE_ACTION_RENAMED_OLD_NAME : FILE_ACTION_REMOVED,
+                    fileName, length, 0
+                );
+        }
+        else if (tracked && currentId && currentId != trackedId)
+        {
+            // The tracked file has lost the name, its backup goes first and the
+            // new file is protected after it
+            RecordFlightEvent("usn_replaced", (unsigned long long)trackedId, (unsigned long long)recordId);
+
+            SubmitFileChange(FILE_ACTION_REMOVED, fileName, length, 0);
+            SubmitFileChange(FILE_ACTION_ADDED, fileName, length, 0);
+        }
+        else if (!tracked && (reasons & CreationReasons))
+        {
+            SubmitFileChange(
+                (reasons & USN_REASON_RENAME_NEW_NAME) ? FILE_ACTION_RENAMED_NEW_NAME : FILE_ACTION_ADDED,
+                fileName, length, 0
+            );
+        }
+    }
+
+    ReleaseWideStringBuilder(&path);
+}
+
+DWORD WINAPI JournalRoutine(LPVOID Parameter)
+{
+    LONGLONG root;
+
+    // Records are kept by the journal during the walk, the reader starts from
+    // the position where the journal has been opened
+    if (GetFileIdByHandle(g_MonitorContext.SourceDirHandle, &root))
+    {
+        g_MonitorContext.RootDirectoryId = (DWORDLONG)root;
+        InsertTreeDirectory(g_MonitorContext.RootDirectoryId, 0, NULL, 0);
+        CollectDirectoryIds(L"", 0);
+    }
+    else
+    {
+        FailTreeDirectories();
+    }
+
+    // A read blocks until records arrive, so only batches are counted here
+    while (true)
+    {
+        if (!ReadUsnJournal(g_MonitorContext.Journal, g_MonitorContext.JournalStopEvent, DispatchJournalRecord, NULL))
+        {
+            if (::GetLastError() == ERROR_JOURNAL_ENTRY_DELETED)
+            {
+                AddMetricCounter(g_Metrics.Overflows);
+                RequestRescan();
+                continue;
+            }
+
+            if (::GetLastError() != ERROR_OPERATION_ABORTED)
+                PrintMsg(PrintColors::Red, L"Error, can't read USN journal, code: %d\n", ::GetLastError());
+            break;
+        }
+
+        AddMetricCounter(g_Metrics.Batches);
+    }
+
+    return 0;
+}
+
+bool StartUsnJournalWatcher()
+{
+    enum
+    {
+        ReasonMask = USN_REASON_FILE_CREATE | USN_REASON_FILE_DELETE | USN_REASON_HARD_LINK_CHANGE
+                   | USN_REASON_RENAME_OLD_NAME | USN_REASON_RENAME_NEW_NAME
+    };
+    wchar_t path[MAX_PATH + 1];
+    size_t length;
+
+    if (!GetVolumeRelativePath(g_MonitorContext.SourceDirHandle, path, _countof(path), &length))
+        return false;
+
+    g_MonitorContext.SourceDirVolumePath = BuildWideString(path, NULL);
+    if (!g_MonitorContext.SourceDirVolumePath)
+        return false;
+
+    g_MonitorContext.SourceDirVolumePathLen = length;
+
+    g_MonitorContext.Journal = OpenUsnJournal(g_MonitorContext.SourceDir, ReasonMask);
+    if (!g_MonitorContext.Journal)
+        return false;
+
+    g_MonitorContext.JournalStopEvent = ::CreateEvent(NULL, TRUE, FALSE, NULL);
+    if (!g_MonitorContext.JournalStopEvent)
+        return false;
+
+    g_MonitorContext.JournalThread = ::CreateThread(NULL, 0, JournalRoutine, NULL, 0, NULL);
+    if (!g_MonitorContext.JournalThread)
+        return false;
+
+    g_MonitorContext.Backend = UsnJournalWatcher;
+    return true;
+}
+
+// =============================================
+//  Directory changes watcher
+
+bool ReadDirectoryChanges(OperationContext* Context)
+{
+    DWORD returned;
+
+    if (!::ReadDirectoryChangesW(
+        g_MonitorContext.SourceDirHandle,
+        Context->ChangeInfo,
+        Context->BufferSize,
+        TRUE,
+        FILE_NOTIFY_CHANGE_FILE_NAME,
+        &returned,
+        &Context->Overlapped,
+        NULL))
+    {
+        PrintMsg(
+            PrintColors::Red,
+            L"Error, failed to read directory changes (inx:%d), code: %d\n", 
+            Context->Index, 
+            ::GetLastError()
+        );
+        return false;
+    }
+
+    return true;
+}
+
+// Names aren't terminated in place: entries are DWORD-aligned, a terminator
+// after a name may overwrite the beginning of the next entry
+void DispatchDirectoryChanges(PFILE_NOTIFY_INFORMATION Info, DWORD Size, unsigned int Index)
+{
+    unsigned long long started = StartMetricTimer();
+    const char* end = (const char*)Info + Size;
+
+    AddMetricCounter(g_Metrics.Batches);
+
+    while ((const char*)Info->FileName <= end)
+    {
+        if ((const char*)Info->FileName + Info->FileNameLength > end)
+            break;
+
+        SubmitFileChange(Info->Action, Info->FileName, Info->FileNameLength / sizeof(WCHAR), Index);
+
+        if (!Info->NextEntryOffset)
+            break;
+
+        Info = (PFILE_NOTIFY_INFORMATION)((char*)Info + Info->NextEntryOffset);
+    }
+
+    RecordMetricLatency(g_Metrics.BatchLatency, started);
+}
+
+void ProcessChangeBatch(ChangeBatch* Batch)
+{
+    RecordMetricLatency(g_Metrics.QueueLatency, Batch->Received);
+
+    DispatchDirectoryChanges((PFILE_NOTIFY_INFORMATION)Batch->Data, Batch->Size, Batch->Index);
+
+    if (Batch->Pooled)
+        ReleaseToObjectPool(g_MonitorContext.ChangeBatchesPool, Batch);
+    else
+        free(Batch);
+}
+
+void QueueChangeBatch(ChangeBatch* Batch)
+{
+    if (!PushToLockFreeQueue(g_MonitorContext.ChangesQueue, Batch))
+    {
+        // Workers are behind, the reaper takes its share of backup work
+        AddMetricCounter(g_Metrics.IntakeInline);
+        ProcessChangeBatch(Batch);
+        return;
+    }
+
+    RecordMetricHistogram(g_Metrics.QueueDepth, GetLockFreeQueueDepth(g_MonitorContext.ChangesQueue));
+
+    ::ReleaseSemaphore(g_MonitorContext.ChangesSemaphore, 1, NULL);
+}
+
+// Grows until it fits to the network limit, the buffer isn't moved
+void GrowChangesBuffer(OperationContext* Context)
+{
+    DWORD size = Context->BufferSize * 2;
+
+    if (size > MaxChangeInformationBlockSize)
+        return;
+
+    if (!::VirtualAlloc(Context->ChangeInfo, size, MEM_COMMIT, PAGE_READWRITE))
+    {
+        PrintMsg(PrintColors::Yellow, L"Warning, can't grow changes buffer, code %d\n", ::GetLastError());
+        return;
+    }
+
+    Context->BufferSize = size;
+}
+
+// The system drops changes which don't fit to a read buffer and completes
+// the read with no data. Notifications don't tell which directories have
+// been affected, so the whole watched tree is rescanned.
+void HandleChangesOverflow(OperationContext* Context)
+{
+    AddMetricCounter(g_Metrics.Overflows);
+    RecordFlightEvent("changes_overflow", Context->Index, Context->BufferSize);
+
+    GrowChangesBuffer(Context);
+    ReadDirectoryChanges(Context);
+
+    RequestRescan();
+}
+
+// Changes a failed read would report are lost, so the read is issued again and
+// the tree is rescanned. A read that keeps failing (the source directory has
+// been removed or has gone offline) is abandoned, the monitor is useless when
+// all of them are.
+void HandleChangesFailure(OperationContext* Context)
+{
+    NTSTATUS status = (NTSTATUS)Context->Overlapped.Internal;
+
+    RecordFlightEvent("changes_failed", Context->Index, status);
+
+    PrintMsg(
+        PrintColors::Red,
+        L"Error, directory changes read failed (inx:%d), status: 0x%08x\n",
+        Context->Index,
+        status
+    );
+
+    if (++Context->Failures < MaxChangesReadFailures && ReadDirectoryChanges(Context))
+    {
+        RequestRescan();
+        return;
+    }
+
+    PrintMsg(PrintColors::Red, L"Error, directory changes read (inx:%d) is abandoned\n", Context->Index);
+
+    if ((unsigned int)::InterlockedIncrement(&g_MonitorContext.AbandonedOperations) == g_MonitorContext.OperationsCount)
+        PrintMsg(PrintColors::Red, L"Error, source directory isn't watched anymore, deleted files aren't backed up, restart is required\n");
+}
+
+// Only copies changes and issues the read again, the system keeps a few
+// changes while no read is pending and backup work is done by workers
+void ProcessDirectoryChanges(OperationContext* Context, DWORD Returned)
+{
+    unsigned long long started;
+    ChangeBatch* batch;
+    bool pooled;
+
+    if ((LONG)Context->Overlapped.Internal < 0)
+    {
+        HandleChangesFailure(Context);
+        return;
+    }
+
+    Context->Failures = 0;
+
+    RecordFlightEvent("changes_received", Context->Index, Returned);
+
+    if (!Returned || (LONG)Context->Overlapped.Internal == STATUS_NOTIFY_ENUM_DIR)
+    {
+        HandleChangesOverflow(Context);
+        return;
+    }
+
+    started = StartMetricTimer();
+
+    if (FIELD_OFFSET(ChangeBatch, Data) + Returned <= GetObjectPoolObjectSize(g_MonitorContext.ChangeBatchesPool))
+    {
+        batch = (ChangeBatch*)AllocateFromObjectPool(g_MonitorContext.ChangeBatchesPool);
+        pooled = true;
+    }
+    else
+    {
+        batch = (ChangeBatch*)malloc(FIELD_OFFSET(ChangeBatch, Data) + Returned);
+        pooled = false;
+    }
+
+    if (!batch)
+    {
+        // No memory for a copy, changes are handled in place
+        AddMetricCounter(g_Metrics.IntakeInline);
+        DispatchDirectoryChanges(Context->ChangeInfo, Returned, Context->Index);
+        ReadDirectoryChanges(Context);
+        return;
+    }
+
+    batch->Received = started;
+    batch->Size = Returned;
+    batch->Index = Context->Index;
+    batch->Pooled = pooled;
+    memcpy(batch->Data, Context->ChangeInfo, Returned);
+
+    ReadDirectoryChanges(Context);
+
+    RecordMetricLatency(g_Metrics.IntakeLatency, started);
+
+    QueueChangeBatch(batch);
+}
+
+DWORD WINAPI BackupWorkerRoutine(LPVOID Parameter)
+{
+    void* batch;
+
+    // Every semaphore release stands for a queued batch or a stop request
+    while (::WaitForSingleObject(g_MonitorContext.ChangesSemaphore, INFINITE) == WAIT_OBJECT_0)
+    {
+        while (!PopFromLockFreeQueue(g_MonitorContext.ChangesQueue, &batch))
+        {
+            // The queue is drained before workers exit, intake is stopped at this point
+            if (g_MonitorContext.BackupWorkersStopping)
+                return 0;
+
+            // A producer has taken a cell but hasn't published it yet
+            ::SwitchToThread();
+        }
+
+        ProcessChangeBatch((ChangeBatch*)batch);
+    }
+
+    PrintMsg(PrintColors::Red, L"Error, can't wait for changes, code: %d\n", ::GetLastError());
+    return 0;
+}
+
+DWORD WINAPI CompletionReaperRoutine(LPVOID Parameter)
+{
+    enum { ReaperBatchSize = 64 };
+    ReaperContext* context = g_MonitorContext.Reapers + (uintptr_t)Parameter;
+    OVERLAPPED_ENTRY entries[ReaperBatchSize];
+    bool stopped = false;
+
+    ::SetEvent(context->StartStopEvent);
+
+    while (!stopped)
+    {
+        ULONG removed, i;
+
+        // All completed reads are taken with a single call
+        if (!::GetQueuedCompletionStatusEx(g_MonitorContext.SourceDirIocp, entries, _countof(entries), &removed, INFINITE, FALSE))
+        {
+            PrintMsg(PrintColors::Red, L"Error, can't receive iocp status, code: %d\n", ::GetLastError());
+            break;
+        }
+
+        RecordMetricHistogram(g_Metrics.ReapedCompletions, removed);
+
+        for (i = 0; i < removed; i++)
+        {
+            if (entries[i].lpCompletionKey == StopCompletionKey)
+            {
+                stopped = true;
+                continue;
+            }
+
+            ProcessDirectoryChanges((OperationContext*)entries[i].lpOverlapped, entries[i].dwNumberOfBytesTransferred);
+        }
+    }
+
+    ::SetEvent(context->StartStopEvent);
+
+    return 0;
+}
+
+bool StartDirectoryChangesWatcher()
+{
+    unsigned int i;
+
+    if (!InitOperationsContext())
+        return false;
+
+    g_MonitorContext.Backend = DirectoryChangesWatcher;
+
+    for (i = 0; i < g_MonitorContext.BackupWorkersCount; i++)
+    {
+        g_MonitorContext.BackupWorkers[i] = ::CreateThread(NULL, 0, BackupWorkerRoutine, NULL, 0, NULL);
+        if (!g_MonitorContext.BackupWorkers[i])
+            PrintMsg(
+                PrintColors::Yellow, 
+                L"Warning, can't create backup worker thread, code %d\n", 
+                ::GetLastError()
+            );
+    }
+
+    for (i = 0; i < g_MonitorContext.ReapersCount; i++)
+    {
+        DWORD threadId, error;
+        ReaperContext* context = g_MonitorContext.Reapers + i;
+        
+        context->Thread = ::CreateThread(NULL, 0, CompletionReaperRoutine, (LPVOID)i, 0, &threadId);
+        if (!context->Thread)
+        {   
+            PrintMsg(
+                PrintColors::Yellow, 
+                L"Warning, can't create reaper thread, code %d\n", 
+                ::GetLastError()
+            );
+            continue;
+        }
+
+        error = ::WaitForSingleObject(context->StartStopEvent, 1000);
+        if (error != WAIT_OBJECT_0)
+        {
+            PrintMsg(
+                PrintColors::Yellow, 
+                L"Warning, reaper thread (tid:%d,inx:%d) didn't respond, code %d\n",
+                threadId, 
+                context->Index,
+                ::GetLastError()
+            );
+        }
+    }
+
+    for (i = 0; i < g_MonitorContext.OperationsCount; i++)
+        ReadDirectoryChanges(g_MonitorContext.Operations + i);
+
+    return true;
+}
+
+void StopDirectoryChangesWatcher()
+{
+    unsigned int i;
+
+    // Every reaper takes a single stop packet and quits after its current batch
+    for (i = 0; i < g_MonitorContext.ReapersCount; i++)
+    {
+        ReaperContext* context = g_MonitorContext.Reapers + i;
+
+        if (!context->Thread)
+            continue;
+
+        if (!::PostQueuedCompletionStatus(g_MonitorContext.SourceDirIocp, 0, StopCompletionKey, NULL))
+            PrintMsg(
+                PrintColors::Yellow,
+                L"Warning, can't post completion status (inx:%d), code: %d\n", 
+                context->Index,
+                ::GetLastError()
+            );
+    }
+
+    for (i = 0; i < g_MonitorContext.ReapersCount; i++)
+    {
+        ReaperContext* context = g_MonitorContext.Reapers + i;
+
+        if (context->Thread)
+            ::WaitForSingleObject(context->Thread, INFINITE);
+    }
+
+    // Nothing is queued anymore, workers finish queued batches and quit
+    ::InterlockedExchange(&g_MonitorContext.BackupWorkersStopping, 1);
+    ::ReleaseSemaphore(g_MonitorContext.ChangesSemaphore, g_MonitorContext.BackupWorkersCount, NULL);
+
+    for (i = 0; i < g_MonitorContext.BackupWorkersCount; i++)
+        if (g_MonitorContext.BackupWorkers[i])
+            ::WaitForSingleObject(g_MonitorContext.BackupWorkers[i], INFINITE);
+}
+
+// =============================================
+
+void StopBackupMonitor()
+{
+    if (g_MonitorContext.Backend == UsnJournalWatcher)
+    {
+        ::SetEvent(g_MonitorContext.JournalStopEvent);
+        ::WaitForSingleObject(g_MonitorContext.JournalThread, INFINITE);
+    }
+    else
+    {
+        StopDirectoryChangesWatcher();
+    }
+
+    StopCoalescer();
+    StopRescanThread();
+
+    ReleaseBackupMonitorContext();
+}
+
+// The USN journal covers the whole volume with a single reader, it requires
+// administrator rights and NTFS therefore directory notifications are kept
+// as a fallback
+bool StartBackupMonitor(wchar_t* SourceDir, wchar_t* BackupDir, bool StartupScan, unsigned int ScanBudget, unsigned int CoalesceWindow, unsigned int CoalesceSizeLimit, bool HandleFree)
+{
+    if (!SetTokenPrivilege("SeCreateSymbolicLinkPrivilege", TRUE))
+        return false;
+
+    if (!InitBackupMonitorContext(SourceDir, BackupDir))
+        return false;
+
+    g_MonitorContext.StartupScan = StartupScan;
+    g_MonitorContext.ScanBudget = ScanBudget;
+    g_MonitorContext.HandleFreeTracking = HandleFree;
+
+    if (!StartCoalescer(CoalesceWindow, (unsigned long long)CoalesceSizeLimit * 1024))
+    {
+        ReleaseBackupMonitorContext();
+        return false;
+    }
+
+    if (StartUsnJournalWatcher())
+    {
+        PrintMsg(PrintColors::Gray, L"Watching USN journal of the volume\n");
+    }
+    else
+    {
+        PrintMsg(PrintColors::Yellow, L"Warning, can't watch USN journal, code %d, directory notifications are used\n", ::GetLastError());
+
+        if (!StartDirectoryChangesWatcher())
+        {
+            StopCoalescer();
+            ReleaseBackupMonitorContext();
+            return false;
+        }
+    }
+
+    // A watcher is started first, so files created during the startup scan aren't missed
+    if (!StartRescanThread())
+    {
+        StopBackupMonitor();
+        return false;
+    }
+
+    return true;
+}
+
+// =============================================
+
+int wmain(int argc, wchar_t* argv[])
+{
+    bool startupScan = false;
+    unsigned int scanBudget = 0;
+    unsigned int coalesceWindow = 0;
+    unsigned int coalesceSizeLimit = DefaultCoalesceSizeLimit;
+    bool handleFree = false;
+    bool noConsole = false;
+    bool valid = (argc >= 3);
+    int i;
+
+    for (i = 3; valid && i < argc; i++)
+    {
+        if (_wcsicmp(argv[i], L"-scan") == 0)
+        {
+            startupScan = true;
+
+            if (i + 1 < argc && iswdigit(argv[i + 1][0]))
+                scanBudget = wcstoul(argv[++i], NULL, 10);
+        }
+        else if (_wcsicmp(argv[i], L"-coalesce") == 0 && i + 1 < argc && iswdigit(argv[i + 1][0]))
+        {
+            coalesceWindow = wcstoul(argv[++i], NULL, 10);
+        }
+        else if (_wcsicmp(argv[i], L"-coalescesize") == 0 && i + 1 < argc && iswdigit(argv[i + 1][0]))
+        {
+            coalesceSizeLimit = wcstoul(argv[++i], NULL, 10);
+        }
+        else if (_wcsicmp(argv[i], L"-nohandles") == 0)
+        {
+            handleFree = true;
+        }
+        else if (_wcsicmp(argv[i], L"-noconsole") == 0)
+        {
+            noConsole = true;
+        }
+        else
+        {
+            valid = false;
+        }
+    }
+
+    // Without the console messages go to the log file and the shared log only,
+    // an invalid command line is reported to the console anyway
+    g_consoleContext = CreateAsyncConsolePrinterContext(PrintColors::Default, true, !noConsole || !valid);
+    if (!g_consoleContext)
+    {
+        printf("Error, can't initialize console printer\n");
+        return 1;
+    }
+
+    if (!valid)
+    {
+        PrintMsg(PrintColors::Red, L"Error, invalid arguments, usage: BackupDeleted <SourceDir> <BackupDir> [-scan [<IoPerSecond>]] [-coalesce <Milliseconds>] [-coalescesize <Kilobytes>] [-nohandles] [-noconsole]\n");
+        DestroyAsyncConsolePrinterContext(g_consoleContext);
+        return 1;
+    }
+
+    // Sinks are attached first, so a console-less run logs every message below
+    {
+        wchar_t* logDir = BuildWideString(argv[2], L"\\log", NULL);
+        wchar_t* dumpPath = BuildWideString(argv[2], L"\\log\\BackupDeleted.flight", LOG_SEGMENT_EXTENSION, NULL);
+
+        if (!logDir || AttachLogFileToConsolePrinterContext(g_consoleContext, logDir, L"BackupDeleted") < 0)
+            PrintMsg(PrintColors::Yellow, L"Warning, can't attach a log file, code %d\n", ::GetLastError());
+
+        if (AttachSharedLogToConsolePrinterContext(g_consoleContext, L"BackupDeleted") < 0)
+            PrintMsg(PrintColors::Yellow, L"Warning, can't attach a shared log, code %d\n", ::GetLastError());
+
+        if (!dumpPath || !InitFlightRecorder(dumpPath))
+            PrintMsg(PrintColors::Yellow, L"Warning, can't initialize flight recorder\n");
+
+        if (logDir)
+            FreeWideString(logDir);
+
+        if (dumpPath)
+            FreeWideString(dumpPath);
+    }
+
+    PrintMsg(PrintColors::Default, L"Backup deleted files by JKornev, 2017\n");
+
+    PrintMsg(PrintColors::Gray, L"Source directory: %s\n", argv[1]);
+    PrintMsg(PrintColors::Gray, L"Backup directory: %s\n", argv[2]);
+
+    if (startupScan)
+        PrintMsg(PrintColors::Gray, L"Startup scan: enabled, I/O budget %u per second (0 is unlimited)\n", scanBudget);
+
+    if (coalesceWindow)
+        PrintMsg(PrintColors::Gray, L"Coalescing window: %u ms, files over %u KB aren't delayed\n", coalesceWindow, coalesceSizeLimit);
+
+    if (handleFree)
+        PrintMsg(PrintColors::Gray, L"Handle-free tracking: enabled\n");
+
+    if (!StartBackupMonitor(argv[1], argv[2], startupScan, scanBudget, coalesceWindow, coalesceSizeLimit, handleFree))
+    {
+        DestroyAsyncConsolePrinterContext(g_consoleContext);
+        return 2;
+    }
+
+    PrintMsg(PrintColors::Default, L"Press ENTER to exit\n");
+    getchar();
+
+    StopBackupMonitor();
+
+    DumpMetrics();
+
+    ReleaseFlightRecorder();
 
     DestroyAsyncConsolePrinterContext(g_consoleContext);
 
@@ -0,0 +1,67 @@
+#include "Bench.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <CommonLib.h>
+
+// =============================================
+
+static LONGLONG s_TimerFrequency = 0;
+
+LONGLONG StartBenchTimer()
+{
+    LARGE_INTEGER counter;
+
+    if (!s_TimerFrequency)
+    {
+        LARGE_INTEGER frequency;
+        ::QueryPerformanceFrequency(&frequency);
+        s_TimerFrequency = frequency.QuadPart;
+    }
+
+    ::QueryPerformanceCounter(&counter);
+    return counter.QuadPart;
+}
+
+double GetBenchElapsedMs(LONGLONG Start)
+{
+    LARGE_INTEGER counter;
+
+    ::QueryPerformanceCounter(&counter);
+    return (double)(counter.QuadPart - Start) * 1000.0 / (double)s_TimerFrequency;
+}
+
+// =============================================
+
+static unsigned int ParseCount(int argc, wchar_t* argv[], int Index, unsigned int Default)
+{
+    long value;
+
+    if (Index >= argc)
+        return Default;
+
+    value = wcstol(argv[Index], NULL, 10);
+    return (value > 0 ? (unsigned int)value : Default);
+}
+
+int wmain(int argc, wchar_t* argv[])
+{
+    if (argc >= 2 && _wcsicmp(argv[1], L"locks") == 0)
+    {
+        unsigned int threads = ParseCount(argc, argv, 2, GetAmountOfCPUCores());
+        unsigned int iterations = ParseCount(argc, argv, 3, 1000000);
+
+        return (RunLockBench(threads, iterations) ? 0 : 2);
+    }
+
+    if (argc >= 2 && _wcsicmp(argv[1], L"paths") == 0)
+    {
+        unsigned int count = ParseCount(argc, argv, 2, 100000);
+        unsigned int rounds = ParseCount(argc, argv, 3, 20);
+
+        return (RunPathBench(count, rounds) ? 0 : 2);
+    }
+
+    printf("Usage: Bench locks [<threads> [<iterations per thread>]]\n");
+    printf("       Bench paths [<paths> [<rounds>]]\n");
+    return 1;
+}
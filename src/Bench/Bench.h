@@ -0,0 +1,15 @@
+#pragma once
+
+#include <Windows.h>
+
+// =============================================
+//  Timing
+
+LONGLONG StartBenchTimer();
+double   GetBenchElapsedMs(LONGLONG Start);
+
+// =============================================
+//  Benchmarks
+
+bool RunLockBench(unsigned int Threads, unsigned int Iterations);
+bool RunPathBench(unsigned int Count, unsigned int Rounds);
@@ -0,0 +1,188 @@
+#include "Bench.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <Sync.h>
+
+// Iterations of busy work inside and outside of the critical section,
+// without the latter the test measures only the cache line ping-pong
+#define LOCK_BENCH_INSIDE_WORK  20
+#define LOCK_BENCH_OUTSIDE_WORK 200
+
+// =============================================
+
+struct LockBenchTarget
+{
+    const char* name;
+    void (*acquire)(void* Lock);
+    void (*release)(void* Lock);
+};
+
+struct LockBenchState
+{
+    const LockBenchTarget* target;
+    void* lock;
+    HANDLE startEvent;
+    unsigned int iterations;
+    volatile unsigned long long counter;
+};
+
+// =============================================
+
+static void AcquireSpinTarget(void* Lock)    { AcquireSpinLock((SpinAtom*)Lock); }
+static void ReleaseSpinTarget(void* Lock)    { ReleaseSpinLock((SpinAtom*)Lock); }
+static void AcquireTicketTarget(void* Lock)  { AcquireTicketLock((TicketLock*)Lock); }
+static void ReleaseTicketTarget(void* Lock)  { ReleaseTicketLock((TicketLock*)Lock); }
+static void AcquireHybridTarget(void* Lock)  { AcquireHybridMutex((HybridMutex*)Lock); }
+static void ReleaseHybridTarget(void* Lock)  { ReleaseHybridMutex((HybridMutex*)Lock); }
+static void AcquireSectionTarget(void* Lock) { ::EnterCriticalSection((CRITICAL_SECTION*)Lock); }
+static void ReleaseSectionTarget(void* Lock) { ::LeaveCriticalSection((CRITICAL_SECTION*)Lock); }
+
+static const LockBenchTarget s_LockBenchTargets[] = {
+    { "CRITICAL_SECTION", AcquireSectionTarget, ReleaseSectionTarget },
+    { "TTAS spinlock",    AcquireSpinTarget,    ReleaseSpinTarget },
+    { "Ticket lock",      AcquireTicketTarget,  ReleaseTicketTarget },
+    { "Hybrid mutex",     AcquireHybridTarget,  ReleaseHybridTarget },
+};
+
+// =============================================
+
+static void DoBusyWork(unsigned int Count)
+{
+    volatile unsigned int sink = 0;
+    unsigned int i;
+
+    for (i = 0; i < Count; i++)
+        sink += i;
+}
+
+static DWORD WINAPI LockBenchRoutine(LPVOID Parameter)
+{
+    LockBenchState* state = (LockBenchState*)Parameter;
+    const LockBenchTarget* target = state->target;
+    unsigned int i;
+
+    ::WaitForSingleObject(state->startEvent, INFINITE);
+
+    for (i = 0; i < state->iterations; i++)
+    {
+        target->acquire(state->lock);
+        state->counter = state->counter + 1;
+        DoBusyWork(LOCK_BENCH_INSIDE_WORK);
+        target->release(state->lock);
+
+        DoBusyWork(LOCK_BENCH_OUTSIDE_WORK);
+    }
+
+    return 0;
+}
+
+static bool MeasureLock(const LockBenchTarget* Target, void* Lock, unsigned int Threads, unsigned int Iterations)
+{
+    LockBenchState state;
+    HANDLE* threads;
+    unsigned int i, started = 0;
+    unsigned long long expected;
+    LONGLONG start;
+    double elapsed;
+    bool result = false;
+
+    threads = (HANDLE*)malloc(sizeof(HANDLE) * Threads);
+    if (!threads)
+    {
+        printf("Error, can't allocate memory\n");
+        return false;
+    }
+
+    state.target = Target;
+    state.lock = Lock;
+    state.iterations = Iterations;
+    state.counter = 0;
+
+    state.startEvent = ::CreateEventW(NULL, TRUE, FALSE, NULL);
+    if (!state.startEvent)
+    {
+        printf("Error, can't create an event, code %d\n", ::GetLastError());
+        goto ReleaseBlock;
+    }
+
+    for (started = 0; started < Threads; started++)
+    {
+        threads[started] = ::CreateThread(NULL, 0, LockBenchRoutine, &state, 0, NULL);
+        if (!threads[started])
+        {
+            printf("Error, can't create a thread, code %d\n", ::GetLastError());
+            break;
+        }
+    }
+
+    // Started threads wait for the event, release them in any case so they can finish
+    start = StartBenchTimer();
+    ::SetEvent(state.startEvent);
+
+    for (i = 0; i < started; i++)
+        ::WaitForSingleObject(threads[i], INFINITE);
+
+    elapsed = GetBenchElapsedMs(start);
+
+    if (started < Threads)
+        goto ReleaseBlock;
+
+    expected = (unsigned long long)Threads * Iterations;
+    if (state.counter != expected)
+    {
+        printf("Error, %s lost updates: %llu of %llu\n", Target->name, state.counter, expected);
+        goto ReleaseBlock;
+    }
+
+    printf(
+        "%-18s %10.1f ms %10.1f ns/op\n",
+        Target->name,
+        elapsed,
+        elapsed * 1000000.0 / (double)expected
+    );
+
+    result = true;
+
+ReleaseBlock:
+
+    for (i = 0; i < started; i++)
+        ::CloseHandle(threads[i]);
+
+    if (state.startEvent)
+        ::CloseHandle(state.startEvent);
+
+    free(threads);
+
+    return result;
+}
+
+// =============================================
+
+bool RunLockBench(unsigned int Threads, unsigned int Iterations)
+{
+    CRITICAL_SECTION section;
+    SpinAtom spinlock = 0;
+    TicketLock ticket;
+    HybridMutex hybrid = HYBRID_MUTEX_INIT;
+    void* locks[_countof(s_LockBenchTargets)];
+    unsigned int i;
+    bool result = true;
+
+    ::InitializeCriticalSection(&section);
+    InitTicketLock(&ticket);
+
+    locks[0] = &section;
+    locks[1] = (void*)&spinlock;
+    locks[2] = &ticket;
+    locks[3] = &hybrid;
+
+    printf("Lock contention, %u threads, %u iterations per thread\n", Threads, Iterations);
+
+    for (i = 0; i < _countof(s_LockBenchTargets); i++)
+        if (!MeasureLock(&s_LockBenchTargets[i], locks[i], Threads, Iterations))
+            result = false;
+
+    ::DeleteCriticalSection(&section);
+
+    return result;
+}
@@ -0,0 +1,190 @@
+#include "Bench.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <FastString.h>
+
+// Every path event computes the key length, tests the exclusion prefix and
+// lowercases a copy of the path, exactly what CreateTemporaryBackup and
+// UpgradeBackupToConstant of BackupDeleted do
+
+#define PATH_BENCH_MAX_LENGTH 260
+#define PATH_BENCH_EXCLUDED   L"Backup\\Deleted\\"
+
+struct PathBenchResult
+{
+    unsigned int excluded;
+    unsigned long long checksum;
+};
+
+// =============================================
+
+static const wchar_t* s_PathParts[] = {
+    L"Projects", L"src", L"CommonLib", L"Include", L"Build\\Intermediate\\Release",
+    L"Users\\Public\\Documents", L"Backup", L"Deleted", L"AppData\\Local\\Temp",
+    L"\x0414\x043e\x043a\x0443\x043c\x0435\x043d\x0442\x044b", L"Caf\x00e9", L"node_modules\\@types",
+};
+
+static const wchar_t* s_FileNames[] = {
+    L"ReadMe.TXT", L"BackupDeleted.cpp", L"FastString.h", L"Report 2016.XLSX",
+    L"\x041e\x0442\x0447\x0435\x0442.docx", L"index.d.ts", L"a.b", L"CMakeCache.txt",
+};
+
+static unsigned int NextRandom(unsigned int* Seed)
+{
+    *Seed = *Seed * 1103515245 + 12345;
+    return (*Seed >> 16);
+}
+
+static bool AppendPathPart(wchar_t* Path, size_t* Length, const wchar_t* Part, bool Separator)
+{
+    size_t partLength = wcslen(Part);
+
+    if (*Length + partLength + 2 > PATH_BENCH_MAX_LENGTH)
+        return false;
+
+    if (Separator)
+        Path[(*Length)++] = L'\\';
+
+    memcpy(Path + *Length, Part, partLength * sizeof(wchar_t));
+    *Length += partLength;
+    Path[*Length] = L'\0';
+    return true;
+}
+
+// Paths are relative to the monitored directory like the ones the watcher
+// reports, about a quarter of them lays under the excluded directory
+static wchar_t* GeneratePaths(unsigned int Count)
+{
+    wchar_t* paths;
+    unsigned int i, j, depth, seed = 1;
+
+    paths = (wchar_t*)malloc(sizeof(wchar_t) * PATH_BENCH_MAX_LENGTH * Count);
+    if (!paths)
+        return NULL;
+
+    for (i = 0; i < Count; i++)
+    {
+        wchar_t* path = paths + (size_t)i * PATH_BENCH_MAX_LENGTH;
+        size_t length = 0;
+
+        path[0] = L'\0';
+
+        if (NextRandom(&seed) % 4 == 0)
+            AppendPathPart(path, &length, PATH_BENCH_EXCLUDED, false);
+
+        depth = 1 + NextRandom(&seed) % 6;
+        for (j = 0; j < depth; j++)
+            AppendPathPart(path, &length, s_PathParts[NextRandom(&seed) % _countof(s_PathParts)], length > 0 && path[length - 1] != L'\\');
+
+        AppendPathPart(path, &length, s_FileNames[NextRandom(&seed) % _countof(s_FileNames)], true);
+    }
+
+    return paths;
+}
+
+// =============================================
+
+static void RunCrtRound(const wchar_t* Paths, unsigned int Count, PathBenchResult* Result)
+{
+    size_t excludedLength = wcslen(PATH_BENCH_EXCLUDED);
+    wchar_t key[PATH_BENCH_MAX_LENGTH];
+    unsigned int i;
+
+    for (i = 0; i < Count; i++)
+    {
+        const wchar_t* path = Paths + (size_t)i * PATH_BENCH_MAX_LENGTH;
+        size_t length = wcslen(path);
+
+        if (_wcsnicmp(PATH_BENCH_EXCLUDED, path, excludedLength) == 0)
+        {
+            Result->excluded++;
+            continue;
+        }
+
+        memcpy(key, path, (length + 1) * sizeof(wchar_t));
+        _wcslwr(key);
+        Result->checksum += key[0] + key[length / 2] + key[length - 1];
+    }
+}
+
+static void RunFastRound(const wchar_t* Paths, unsigned int Count, PathBenchResult* Result)
+{
+    size_t excludedLength = GetWideStringLength(PATH_BENCH_EXCLUDED);
+    wchar_t key[PATH_BENCH_MAX_LENGTH];
+    unsigned int i;
+
+    for (i = 0; i < Count; i++)
+    {
+        const wchar_t* path = Paths + (size_t)i * PATH_BENCH_MAX_LENGTH;
+        size_t length = GetWideStringLength(path);
+
+        if (IsWidePrefixNoCase(path, length, PATH_BENCH_EXCLUDED, excludedLength))
+        {
+            Result->excluded++;
+            continue;
+        }
+
+        memcpy(key, path, (length + 1) * sizeof(wchar_t));
+        LowerWideString(key, length);
+        Result->checksum += key[0] + key[length / 2] + key[length - 1];
+    }
+}
+
+static double MeasurePathRounds(void (*Round)(const wchar_t*, unsigned int, PathBenchResult*), const wchar_t* Paths, unsigned int Count, unsigned int Rounds, PathBenchResult* Result)
+{
+    LONGLONG start;
+    unsigned int i;
+
+    Result->excluded = 0;
+    Result->checksum = 0;
+
+    // A warm-up round keeps page faults of the path table out of the result
+    Round(Paths, Count, Result);
+
+    Result->excluded = 0;
+    Result->checksum = 0;
+
+    start = StartBenchTimer();
+
+    for (i = 0; i < Rounds; i++)
+        Round(Paths, Count, Result);
+
+    return GetBenchElapsedMs(start);
+}
+
+// =============================================
+
+bool RunPathBench(unsigned int Count, unsigned int Rounds)
+{
+    PathBenchResult crt, fast;
+    double crtElapsed, fastElapsed, events;
+    wchar_t* paths;
+
+    paths = GeneratePaths(Count);
+    if (!paths)
+    {
+        printf("Error, can't allocate memory\n");
+        return false;
+    }
+
+    crtElapsed = MeasurePathRounds(RunCrtRound, paths, Count, Rounds, &crt);
+    fastElapsed = MeasurePathRounds(RunFastRound, paths, Count, Rounds, &fast);
+
+    free(paths);
+
+    // Both variants must see the same exclusions and produce the same keys
+    if (crt.excluded != fast.excluded || crt.checksum != fast.checksum)
+    {
+        printf("Error, results differ: excluded %u/%u, checksum %llu/%llu\n", crt.excluded, fast.excluded, crt.checksum, fast.checksum);
+        return false;
+    }
+
+    events = (double)Count * Rounds;
+
+    printf("Path exclusion and key lowercasing, %u paths, %u rounds, %u excluded per round\n", Count, Rounds, crt.excluded / Rounds);
+    printf("%-18s %10.1f ms %10.1f ns/event\n", "_wcsnicmp/_wcslwr", crtElapsed, crtElapsed * 1000000.0 / events);
+    printf("%-18s %10.1f ms %10.1f ns/event\n", "FastString", fastElapsed, fastElapsed * 1000000.0 / events);
+
+    return true;
+}
@@ -225,6 +225,20 @@ static AVL_NODE* FindNode(AVL_TREE* Tree, AVL_NODE* Node, void* Buffer)
     }
 }
 
+static bool EnumerateNodes(AVL_NODE* Node, AVL_ENUM_CALLBACK Callback, void* Parameter)
+{
+    if (!Node)
+        return true;
+
+    if (!EnumerateNodes(Node->Left, Callback, Parameter))
+        return false;
+
+    if (!Callback(Node->Value, Parameter))
+        return false;
+
+    return EnumerateNodes(Node->Right, Callback, Parameter);
+}
+
 // =================================================
 
 void InitializeAVLTree(AVL_TREE* Tree, AVL_ALLOCATE_CALLBACK Allocate, AVL_FREE_CALLBACK Free, AVL_COMPARE_CALLBACK Compare)
@@ -270,3 +284,8 @@ void* FindAVLElement(AVL_TREE* Tree, void* Buffer)
 
     return node->Value;
 }
+
+void EnumerateAVLElements(AVL_TREE* Tree, AVL_ENUM_CALLBACK Callback, void* Parameter)
+{
+    EnumerateNodes(Tree->Root, Callback, Parameter);
+}
@@ -3,6 +3,7 @@
 typedef void*(*AVL_ALLOCATE_CALLBACK)(size_t NodeBufSize);
 typedef void(*AVL_FREE_CALLBACK)(void* NodeBuf, void* Node);
 typedef int(*AVL_COMPARE_CALLBACK)(void* Node1, void* Node2);
+typedef bool(*AVL_ENUM_CALLBACK)(void* Node, void* Parameter); // returns false to stop
 
 struct AVL_NODE
 {
@@ -28,3 +29,6 @@ void* InsertAVLElement(AVL_TREE* Tree, void* Buffer, size_t Size);
 bool RemoveAVLElement(AVL_TREE* Tree, void* Buffer);
 
 void* FindAVLElement(AVL_TREE* Tree, void* Buffer);
+
+// Visits elements in ascending order, the tree shouldn't be changed by the callback
+void EnumerateAVLElements(AVL_TREE* Tree, AVL_ENUM_CALLBACK Callback, void* Parameter);
@@ -1,5 +1,6 @@
 #include "BufferQueue.h"
 #include "CommonLib.h"
+#include "Metrics.h"
 #include <Windows.h>
 #include <intrin.h>
 
@@ -28,6 +29,20 @@ struct BufferQueueContext
     CRITICAL_SECTION popSync;
 };
 
+static unsigned int s_PushMetric       = INVALID_METRIC_ID;
+static unsigned int s_PushFullMetric   = INVALID_METRIC_ID;
+static unsigned int s_PopMetric        = INVALID_METRIC_ID;
+static unsigned int s_LockWaitMetric   = INVALID_METRIC_ID;
+
+// Ids are the same for every queue, so registering them on each creation is fine
+static void RegisterBufferQueueMetrics()
+{
+    s_PushMetric     = RegisterMetricCounter("buffer_queue.push");
+    s_PushFullMetric = RegisterMetricCounter("buffer_queue.push_full");
+    s_PopMetric      = RegisterMetricCounter("buffer_queue.pop");
+    s_LockWaitMetric = RegisterMetricHistogram("buffer_queue.push_lock_wait");
+}
+
 void* CreateBufferQueue(size_t Size)
 {
     BufferQueueContext* context = NULL;
@@ -42,6 +57,8 @@ void* CreateBufferQueue(size_t Size)
 
     memset(&context, 0, sizeof(context));
 
+    RegisterBufferQueueMetrics();
+
     event = ::CreateEvent(NULL, FALSE, FALSE, NULL);
     if (!event)
         goto ReleaseBlock;
@@ -98,60 +115,93 @@ void DestroyBufferQueue(void* Context)
     free(context);
 }
 
+static void CopyToBufferQueue(BufferQueueContext* Context, index_t Offset, const void* Data, size_t DataSize)
+{
+    size_t firstSize = Context->bufferSize - (size_t)Offset;
+
+    if (firstSize >= DataSize)
+    {
+        memcpy(Context->buffer + Offset, Data, DataSize);
+    }
+    else // if buffer is divided
+    {
+        memcpy(Context->buffer + Offset, Data, firstSize);
+        memcpy(Context->buffer, (char*)Data + firstSize, DataSize - firstSize);
+    }
+}
+
 bool PushDataToBufferQueue(void* Context, void* Data, size_t DataSize)
+{
+    BufferQueueChunk chunk;
+
+    chunk.Data = Data;
+    chunk.Size = DataSize;
+
+    return PushChunksToBufferQueue(Context, &chunk, 1);
+}
+
+bool PushChunksToBufferQueue(void* Context, const BufferQueueChunk* Chunks, size_t ChunksCount)
 {
     BufferQueueContext* context = (BufferQueueContext*)Context;
-    size_t blockSize = DataSize + sizeof(BufferEntryHeader) - 1;
+    size_t dataSize = 0;
+    size_t blockSize;
     BufferEntryHeader* entry;
-    index_t topIndex, bottomIndex;
+    index_t topIndex, offset;
+    unsigned long long started;
+    size_t i;
 
-    if (!DataSize)
+    for (i = 0; i < ChunksCount; i++)
+        dataSize += Chunks[i].Size;
+
+    if (!dataSize)
         return false;
 
+    blockSize = dataSize + sizeof(BufferEntryHeader) - 1;
+
+    started = StartMetricTimer();
     ::EnterCriticalSection(&context->popSync);
+    RecordMetricLatency(s_LockWaitMetric, started);
 
-    bottomIndex = context->bottomIndex % context->bufferSize;
     topIndex = context->topIndex % context->bufferSize;
 
     // If buffer is full
     if (context->topIndex + blockSize > context->bottomIndex + context->bufferSize)
     {
         ::LeaveCriticalSection(&context->popSync);
+        AddMetricCounter(s_PushFullMetric);
         return false;
     }
 
     context->topIndex += blockSize;
 
-    if (context->topIndex % context->bufferSize < blockSize) // if buffer is divided
-    {
-        index_t part2Size = context->topIndex % context->bufferSize;
-        index_t part1Size = DataSize - part2Size;
+    entry = (BufferEntryHeader*)(context->buffer + topIndex);
+    entry->size = dataSize;
+    entry->alignment = 0;
 
-        entry = (BufferEntryHeader*)(context->buffer + topIndex);
-        entry->size = DataSize;
-        entry->alignment = 0;
+    offset = (topIndex + FIELD_OFFSET(BufferEntryHeader, data)) % context->bufferSize;
 
-        memcpy(entry->data, Data, (size_t)part1Size);
-        memcpy(context->buffer, (char*)Data + part1Size, (size_t)part2Size);
+    for (i = 0; i < ChunksCount; i++)
+    {
+        CopyToBufferQueue(context, offset, Chunks[i].Data, Chunks[i].Size);
+        offset = (offset + Chunks[i].Size) % context->bufferSize;
     }
-    else // if buffer isn't divided
+
+    if (context->topIndex % context->bufferSize >= blockSize) // if buffer isn't divided
     {
         index_t next = topIndex + blockSize + FIELD_OFFSET(BufferEntryHeader, data);
         size_t alignment = 0;
 
+        // The next header should be placed continuously, move it to the buffer beginning
         if ((size_t)next > context->bufferSize)
             alignment = FIELD_OFFSET(BufferEntryHeader, data) - ((size_t)next - context->bufferSize);
 
-        entry = (BufferEntryHeader*)(context->buffer + topIndex);
-        entry->size = DataSize;
         entry->alignment = alignment;
-        memcpy(entry->data, Data, DataSize);
-
         context->topIndex += alignment;
     }
 
     ::LeaveCriticalSection(&context->popSync);
 
+    AddMetricCounter(s_PushMetric);
     return true;
 }
 
@@ -196,6 +246,9 @@ bool PopDataFromBufferQueue(void* Context, void* OutputBuffer, size_t* OutputSiz
 
     ::LeaveCriticalSection(&context->popSync);
 
+    if (result)
+        AddMetricCounter(s_PopMetric);
+
     return result;
 }
 
@@ -254,6 +307,8 @@ bool PopAllDataFromBufferQueue(void* Context, PopBufferQueueRoutine Callback, vo
         context->bottomIndex += entry->size + entry->alignment + sizeof(BufferEntryHeader) - 1;
 
         ::LeaveCriticalSection(&context->popSync);
+
+        AddMetricCounter(s_PopMetric);
     }
 
     return true;
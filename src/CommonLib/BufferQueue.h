@@ -4,6 +4,16 @@ void* CreateBufferQueue(size_t Size = 0x10000);
 void DestroyBufferQueue(void* Context);
 
 bool PushDataToBufferQueue(void* Context, void* Data, size_t DataSize);
+
+// Pushes several chunks as one continuous entry, it allows a caller to put a header
+// and a variable-length payload to a queue without building them in a single buffer
+struct BufferQueueChunk
+{
+    const void* Data;
+    size_t      Size;
+};
+bool PushChunksToBufferQueue(void* Context, const BufferQueueChunk* Chunks, size_t ChunksCount);
+
 bool PopDataFromBufferQueue(void* Context, void* OutputBuffer, size_t* OutputSize);
 
 typedef void(*PopBufferQueueRoutine)(void* Data, size_t DataSize, void* Parameter);
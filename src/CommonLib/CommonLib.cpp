@@ -2,6 +2,11 @@
 #include <NTLib.h>
 #include <stdarg.h>
 #include <crtdbg.h>
+#include <intrin.h>
+
+#ifndef STATUS_DELETE_PENDING
+#define STATUS_DELETE_PENDING ((NTSTATUS)0xC0000056L)
+#endif
 
 // =============================================
 
@@ -105,15 +110,10 @@ bool CreateDirectoryByFullPath(wchar_t* DirPath)
 bool CreateHardLinkToExistingFile(const wchar_t* SourceFile, const wchar_t* DestinationFile)
 {
     UNICODE_STRING srcPath;
-    IO_STATUS_BLOCK ioStatus;
-    PFILE_LINK_INFORMATION info;
-    NTSTATUS status;
-    HANDLE file = INVALID_HANDLE_VALUE;
-    char* buffer = NULL;
-    size_t bufferSize;
-    bool result = false;
+    HANDLE file;
+    bool result;
 
-    // Create a new empty file
+    // Open a file that we want to use as the source
 
     file = ::CreateFileW(
         DestinationFile,
@@ -122,40 +122,96 @@ bool CreateHardLinkToExistingFile(const wchar_t* SourceFile, const wchar_t* Dest
         NULL, OPEN_EXISTING, 0, NULL
     );
     if (file == INVALID_HANDLE_VALUE)
-        goto ReleaseBlock;
+        return false;
 
-    // Link a new file with a file that we want to use as the source
+    // Link it with a new name
 
     if (!::RtlDosPathNameToNtPathName_U(SourceFile, &srcPath, NULL, NULL))
-        goto ReleaseBlock;
+    {
+        ::CloseHandle(file);
+        return false;
+    }
 
-    bufferSize = sizeof(FILE_LINK_INFORMATION) + srcPath.Length + sizeof(wchar_t);
-    buffer = (char*)::RtlAllocateHeap(::GetProcessHeap(), 0, bufferSize);
-    if (!buffer)
-        goto ReleaseBlock;
+    result = CreateHardLinkFromHandle(file, NULL, srcPath.Buffer, srcPath.Length / sizeof(wchar_t), true);
 
-    info = (PFILE_LINK_INFORMATION)buffer;
+    ::RtlFreeUnicodeString(&srcPath);
+    ::CloseHandle(file);
+
+    return result;
+}
+
+HANDLE OpenFileRelative(HANDLE Directory, const wchar_t* Name, size_t Length, ACCESS_MASK Access, ULONG Options)
+{
+    OBJECT_ATTRIBUTES attributes;
+    IO_STATUS_BLOCK ioStatus;
+    UNICODE_STRING name;
+    HANDLE file;
+    NTSTATUS status;
 
-    memcpy(info->FileName, srcPath.Buffer, srcPath.Length);
-    info->FileNameLength = srcPath.Length;
-    info->ReplaceIfExists = TRUE;
-    info->RootDirectory = NULL;
+    name.Buffer = (PWSTR)Name;
+    name.Length = (USHORT)(Length * sizeof(wchar_t));
+    name.MaximumLength = name.Length;
 
-    status = ::NtSetInformationFile(file, &ioStatus, info, (ULONG)bufferSize, FileLinkInformation);
+    InitializeObjectAttributes(&attributes, &name, OBJ_CASE_INSENSITIVE, Directory, NULL);
+
+    status = ::NtOpenFile(
+        &file,
+        Access | SYNCHRONIZE,
+        &attributes,
+        &ioStatus,
+        FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+        Options | FILE_SYNCHRONOUS_IO_NONALERT
+    );
     if (!NT_SUCCESS(status))
-        goto ReleaseBlock;
+    {
+        // The generic mapping turns a pending deletion to ERROR_ACCESS_DENIED
+        ::SetLastError(status == STATUS_DELETE_PENDING ? ERROR_DELETE_PENDING : ::RtlNtStatusToDosError(status));
+        return INVALID_HANDLE_VALUE;
+    }
 
-    result = true;
+    return file;
+}
 
-ReleaseBlock:
+bool CreateHardLinkFromHandle(HANDLE File, HANDLE Directory, const wchar_t* Name, size_t Length, bool ReplaceIfExists)
+{
+    char inlineBuffer[sizeof(FILE_LINK_INFORMATION) + MAX_PATH * sizeof(wchar_t)];
+    IO_STATUS_BLOCK ioStatus;
+    PFILE_LINK_INFORMATION info;
+    NTSTATUS status;
+    char* buffer = inlineBuffer;
+    size_t bufferSize;
 
-    if (file != INVALID_HANDLE_VALUE)
-        ::CloseHandle(file);
+    // Names of common length don't touch the heap
+    bufferSize = sizeof(FILE_LINK_INFORMATION) + Length * sizeof(wchar_t);
+    if (bufferSize > sizeof(inlineBuffer))
+    {
+        buffer = (char*)::RtlAllocateHeap(::GetProcessHeap(), 0, bufferSize);
+        if (!buffer)
+        {
+            ::SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+            return false;
+        }
+    }
+
+    info = (PFILE_LINK_INFORMATION)buffer;
+
+    memcpy(info->FileName, Name, Length * sizeof(wchar_t));
+    info->FileNameLength = (ULONG)(Length * sizeof(wchar_t));
+    info->ReplaceIfExists = (ReplaceIfExists ? TRUE : FALSE);
+    info->RootDirectory = Directory;
+
+    status = ::NtSetInformationFile(File, &ioStatus, info, (ULONG)bufferSize, FileLinkInformation);
 
-    if (buffer)
+    if (buffer != inlineBuffer)
         ::RtlFreeHeap(::GetProcessHeap(), 0, buffer);
 
-    return result;
+    if (!NT_SUCCESS(status))
+    {
+        ::SetLastError(status == STATUS_DELETE_PENDING ? ERROR_DELETE_PENDING : ::RtlNtStatusToDosError(status));
+        return false;
+    }
+
+    return true;
 }
 
 // =============================================
@@ -248,29 +304,75 @@ uintptr_t AlignToBottom(uintptr_t What, uintptr_t Align)
 
 // =============================================
 
-void AcquireSpinLock(SpinAtom* Spinlock)
+static struct
+{
+    volatile long      state; // 0 - not calibrated, 1 - in progress, 2 - ready
+    unsigned long long baseCounter;
+    unsigned long long baseFileTime;
+    unsigned long long frequency;
+} s_TimestampCalibration;
+
+unsigned long long ReadTimestampCounter()
+{
+    return __rdtsc();
+}
+
+void CalibrateTimestampCounter(unsigned int CalibrationMs)
 {
-    uintptr_t i;
-    bool acquired = false;
+    LARGE_INTEGER qpcFrequency, qpcStart, qpcEnd;
+    unsigned long long tscStart, tscEnd;
+    FILETIME fileTime;
+
+    if (s_TimestampCalibration.state == 2)
+        return;
 
-    for (i = 0; i < 10000; i++)
+    if (::InterlockedCompareExchange(&s_TimestampCalibration.state, 1, 0) != 0)
     {
-        if (AtomExchange(Spinlock, 1) == 1)
-            return;
+        while (s_TimestampCalibration.state != 2)
+            ::SwitchToThread();
+        return;
     }
 
-    do
-    {
-        NtYieldExecution();
-    } 
-    while (AtomExchange(Spinlock, 1) != 1);
+    ::QueryPerformanceFrequency(&qpcFrequency);
+
+    ::GetSystemTimeAsFileTime(&fileTime);
+    ::QueryPerformanceCounter(&qpcStart);
+    tscStart = __rdtsc();
+
+    ::Sleep(CalibrationMs);
+
+    ::QueryPerformanceCounter(&qpcEnd);
+    tscEnd = __rdtsc();
+
+    s_TimestampCalibration.baseCounter = tscStart;
+    s_TimestampCalibration.baseFileTime = ((unsigned long long)fileTime.dwHighDateTime << 32) | fileTime.dwLowDateTime;
+    s_TimestampCalibration.frequency = (unsigned long long)(
+        (double)(tscEnd - tscStart) * qpcFrequency.QuadPart / (qpcEnd.QuadPart - qpcStart.QuadPart)
+    );
+
+    ::InterlockedExchange(&s_TimestampCalibration.state, 2);
 }
 
-void ReleaseSpinLock(SpinAtom* Spinlock)
+unsigned long long GetTimestampCounterFrequency()
 {
-    _ASSERT(AtomExchange(Spinlock, 1) == 0);
+    CalibrateTimestampCounter();
+    return s_TimestampCalibration.frequency;
 }
 
+unsigned long long ConvertTimestampCounterToFileTime(unsigned long long Counter)
+{
+    long long delta;
+
+    CalibrateTimestampCounter();
+
+    // A counter can be read before the calibration point therefore the delta is signed
+    delta = (long long)(Counter - s_TimestampCalibration.baseCounter);
+
+    return s_TimestampCalibration.baseFileTime + (long long)((double)delta * 10000000.0 / s_TimestampCalibration.frequency);
+}
+
+// =============================================
+
 unsigned int GetAmountOfCPUCores()
 {
     SYSTEM_INFO info;
@@ -1,5 +1,7 @@
 #pragma once
 
+#include <Windows.h>
+
 // =============================================
 //  Security
 
@@ -15,6 +17,13 @@ bool CreateDirectoryByFullPath(wchar_t* DirPath);
 
 bool CreateHardLinkToExistingFile(const wchar_t* DestinationFile, const wchar_t* SourceFile);
 
+// Handle-relative operations, a name is resolved relative to Directory or it's
+// a full NT path when Directory is NULL. Errors are reported by SetLastError(),
+// a file or a directory which is being deleted fails with ERROR_DELETE_PENDING.
+
+HANDLE OpenFileRelative(HANDLE Directory, const wchar_t* Name, size_t Length, ACCESS_MASK Access, ULONG Options);
+bool CreateHardLinkFromHandle(HANDLE File, HANDLE Directory, const wchar_t* Name, size_t Length, bool ReplaceIfExists);
+
 // =============================================
 //  String
 
@@ -28,17 +37,21 @@ size_t AlignToTop(size_t What, size_t Align);
 size_t AlignToBottom(size_t What, size_t Align);
 
 // =============================================
-//  Sync
+//  Time
+
+// Raw time stamp counter, it's cheap enough to stamp every event on hot paths
+unsigned long long ReadTimestampCounter();
 
-#ifdef _WIN64
-typedef volatile long long SpinAtom;
-#define AtomExchange InterlockedExchange64
-#else
-typedef volatile long SpinAtom;
-#define AtomExchange InterlockedExchange
-#endif
+// Measures the counter frequency against QueryPerformanceCounter once per process,
+// the first call takes about CalibrationMs milliseconds
+void CalibrateTimestampCounter(unsigned int CalibrationMs = 20);
+
+unsigned long long GetTimestampCounterFrequency();
+unsigned long long ConvertTimestampCounterToFileTime(unsigned long long Counter);
+
+// =============================================
+//  Sync
 
-void AcquireSpinLock(SpinAtom* Spinlock);
-void ReleaseSpinLock(SpinAtom* Spinlock);
+#include "Sync.h"
 
 unsigned int GetAmountOfCPUCores();
@@ -1,6 +1,10 @@
 #include "ConsolePrinter.h"
 #include "BufferQueue.h"
 #include "CommonLib.h"
+#include "LogFileSink.h"
+#include "SharedLogSink.h"
+#include "FlightRecorder.h"
+#include "ObjectPool.h"
 #include <Windows.h>
 #include <stdarg.h>
 #include <wchar.h>
@@ -17,31 +21,69 @@ struct ConsoleContext
     PrinterType type;
     WORD currentColor;
     WORD defaultColor;
+    UINT codePage;
     HANDLE output;
 };
 
-struct AsyncConsoleContext
+// Each sink owns a queue and a dispatcher thread, so a slow sink drops
+// its own messages and never holds back the others
+struct PrinterSinkContext
 {
-    ConsoleContext console;
+    PrinterSinkCallback        callback;
+    PrinterSinkReleaseCallback release;
+    void*  parameter;
     HANDLE startStopEvent;
     HANDLE stopDispatcherEvent;
     HANDLE dispatcher;
     void*  bufferedQueue;
     bool   terminating;
+    volatile long dropped;
+};
+
+enum { MaxPrinterSinks = 8 };
+
+struct AsyncConsoleContext
+{
+    ConsoleContext console;
+    PrinterSinkContext* sinks[MaxPrinterSinks];
+    volatile long sinksCount;
+    SpinAtom sinksLock;
 };
 
+// A message is stored in a queue as a header followed by a UTF-8 payload without
+// a null terminator, the payload size is calculated from the size of a queue entry
+#pragma pack(push, 1)
 struct MessageBlock
 {
-    PrintColors color;
-    wchar_t message[512];
+    unsigned long long timestamp; // raw time stamp counter
+    unsigned short     thread;    // small per-process thread tag
+    unsigned char      level;
+    unsigned char      color;
+    char message[1];
 };
+#pragma pack(pop)
 
-static SpinAtom s_DefaultContextLock = 0;
+enum
+{
+    InlineWideMessageLength = 256,
+    InlineUtf8MessageSize   = 256,
+    PooledMessageSize       = 4096,
+};
+
+volatile long g_PrintLevel = TraceLevel;
+
+static HybridMutex s_DefaultContextLock = HYBRID_MUTEX_INIT;
 static volatile ConsoleContext* s_DefaultContext = NULL;
 
 static _declspec(thread) ConsoleContext* st_AssignedContext = NULL;
 
-static bool InitConsoleContext(ConsoleContext* Context, PrinterType Type, PrintColors DefaultColor)
+static volatile long s_ThreadTagsCount = 0;
+static _declspec(thread) unsigned short st_ThreadTag = 0;
+
+// Lives until the process exit, messages can be printed from static destructors
+static void* volatile s_MessagePool = NULL;
+
+static bool InitConsoleContext(ConsoleContext* Context, PrinterType Type, PrintColors DefaultColor, bool ConsoleOutput)
 {
     CONSOLE_SCREEN_BUFFER_INFO info;
 
@@ -49,6 +91,11 @@ static bool InitConsoleContext(ConsoleContext* Context, PrinterType Type, PrintC
     if (Context->type >= PrinterType::MaxPrintrerType)
         return false;
 
+    Context->codePage = 0;
+
+    if (!ConsoleOutput)
+        return true;
+
     Context->output = ::GetStdHandle(STD_OUTPUT_HANDLE);
     if (Context->output == INVALID_HANDLE_VALUE)
         return false;
@@ -59,6 +106,11 @@ static bool InitConsoleContext(ConsoleContext* Context, PrinterType Type, PrintC
     Context->defaultColor = (DefaultColor == PrintColors::Default ? info.wAttributes : DefaultColor);
     Context->currentColor = info.wAttributes;
 
+    // Messages are queued as UTF-8 therefore the dispatcher writes them to the console as is
+    Context->codePage = ::GetConsoleOutputCP();
+    if (!::SetConsoleOutputCP(CP_UTF8))
+        return false;
+
     return true;
 }
 
@@ -133,44 +185,149 @@ static void SetConsoleAttribs(ConsoleContext* Context, WORD Attribs)
     SetConsoleTextAttribute(Context->output, Attribs);
 }
 
-static void PrintFromBufferToConsole(void* Data, size_t DataSize, void* Parameter)
+static void PrintRecordToConsole(const PrinterRecord* Record, void* Parameter)
 {
     AsyncConsoleContext* context = (AsyncConsoleContext*)Parameter;
-    MessageBlock* block = (MessageBlock*)Data;
+    DWORD written;
 
-    SetConsoleColor(&context->console, block->color);
+    SetConsoleColor(&context->console, Record->color);
 
-    wprintf(block->message);
+    ::WriteFile(context->console.output, Record->message, (DWORD)Record->size, &written, NULL);
 
     SetConsoleAttribs(&context->console, context->console.defaultColor);
 }
 
-static DWORD WINAPI AsyncConsoleDispatcher(LPVOID Parameter)
+static void DispatchRecordToSink(void* Data, size_t DataSize, void* Parameter)
 {
-    AsyncConsoleContext* context = (AsyncConsoleContext*)Parameter;
+    PrinterSinkContext* sink = (PrinterSinkContext*)Parameter;
+    MessageBlock* block = (MessageBlock*)Data;
+    PrinterRecord record;
 
-    ::SetEvent(context->startStopEvent);
+    record.counter = block->timestamp;
+    record.timestamp = ConvertTimestampCounterToFileTime(block->timestamp);
+    record.thread = block->thread;
+    record.level = (PrintLevels)block->level;
+    record.color = (PrintColors)block->color;
+    record.message = block->message;
+    record.size = DataSize - FIELD_OFFSET(MessageBlock, message);
+
+    sink->callback(&record, sink->parameter);
+}
+
+static DWORD WINAPI AsyncSinkDispatcher(LPVOID Parameter)
+{
+    PrinterSinkContext* sink = (PrinterSinkContext*)Parameter;
+
+    ::SetEvent(sink->startStopEvent);
 
     while (true)
     {
-        DWORD error = ::WaitForMultipleObjects(1, &context->stopDispatcherEvent, FALSE, INFINITE);
+        DWORD error = ::WaitForMultipleObjects(1, &sink->stopDispatcherEvent, FALSE, INFINITE);
         if (error != WAIT_OBJECT_0)
             break;
 
-        PopAllDataFromBufferQueue(context->bufferedQueue, PrintFromBufferToConsole, context);
+        PopAllDataFromBufferQueue(sink->bufferedQueue, DispatchRecordToSink, sink);
 
-        if (context->terminating)
+        if (sink->terminating)
             break;
     }
 
-    ::SetEvent(context->startStopEvent);
+    ::SetEvent(sink->startStopEvent);
 
     return 0;
 }
 
+static void DestroySink(PrinterSinkContext* Sink)
+{
+    if (Sink->dispatcher)
+    {
+        Sink->terminating = true;
+
+        ::SetEvent(Sink->stopDispatcherEvent);
+
+        if (::WaitForSingleObject(Sink->startStopEvent, INFINITE) != WAIT_OBJECT_0)
+            ::TerminateThread(Sink->dispatcher, 0xC0FEC0FE);
+
+        ::CloseHandle(Sink->dispatcher);
+    }
+
+    if (Sink->startStopEvent)
+        ::CloseHandle(Sink->startStopEvent);
+
+    if (Sink->stopDispatcherEvent)
+        ::CloseHandle(Sink->stopDispatcherEvent);
+
+    if (Sink->bufferedQueue)
+        DestroyBufferQueue(Sink->bufferedQueue);
+
+    if (Sink->release)
+        Sink->release(Sink->parameter);
+
+    free(Sink);
+}
+
+static PrinterSinkContext* CreateSink(PrinterSinkCallback Callback, PrinterSinkReleaseCallback Release, void* Parameter, size_t QueueSize)
+{
+    PrinterSinkContext* sink;
+    bool result = false;
+
+    sink = (PrinterSinkContext*)malloc(sizeof(PrinterSinkContext));
+    if (!sink)
+        return NULL;
+
+    memset(sink, 0, sizeof(PrinterSinkContext));
+    sink->callback = Callback;
+    sink->parameter = Parameter;
+
+    sink->bufferedQueue = CreateBufferQueue(QueueSize);
+    if (!sink->bufferedQueue)
+        goto ReleaseBlock;
+
+    sink->startStopEvent = ::CreateEvent(NULL, FALSE, FALSE, NULL);
+    if (!sink->startStopEvent)
+        goto ReleaseBlock;
+
+    sink->stopDispatcherEvent = ::CreateEvent(NULL, FALSE, FALSE, NULL);
+    if (!sink->stopDispatcherEvent)
+        goto ReleaseBlock;
+
+    sink->dispatcher = ::CreateThread(NULL, 0, AsyncSinkDispatcher, sink, 0, NULL);
+    if (!sink->dispatcher)
+        goto ReleaseBlock;
+
+    if (::WaitForSingleObject(sink->startStopEvent, INFINITE) != WAIT_OBJECT_0)
+        goto ReleaseBlock;
+
+    // The release callback is owned by the sink only when it's successfully created
+    sink->release = Release;
+    result = true;
+
+ReleaseBlock:
+
+    if (!result)
+    {
+        DestroySink(sink);
+        sink = NULL;
+    }
+
+    return sink;
+}
+
 void SetDefaultConsoleContext(ConsoleContext* Context)
 {
+    AcquireHybridMutex(&s_DefaultContextLock);
     s_DefaultContext = Context;
+    ReleaseHybridMutex(&s_DefaultContextLock);
+}
+
+static void ResetDefaultConsoleContext(ConsoleContext* Context)
+{
+    AcquireHybridMutex(&s_DefaultContextLock);
+
+    if (s_DefaultContext == Context)
+        s_DefaultContext = NULL;
+
+    ReleaseHybridMutex(&s_DefaultContextLock);
 }
 
 ConsoleContext* GetDefaultConsoleContext()
@@ -178,7 +335,7 @@ ConsoleContext* GetDefaultConsoleContext()
     return (ConsoleContext*)s_DefaultContext;
 }
 
-ConsoleInstance CreateAsyncConsolePrinterContext(PrintColors DefaultColor, bool UseAsDefault)
+ConsoleInstance CreateAsyncConsolePrinterContext(PrintColors DefaultColor, bool UseAsDefault, bool ConsoleOutput)
 {
     bool result = false;
     AsyncConsoleContext* context = NULL;
@@ -187,30 +344,16 @@ ConsoleInstance CreateAsyncConsolePrinterContext(PrintColors DefaultColor, bool
     if (!context)
         goto ReleaseBlock;
 
-    if (!InitConsoleContext(&context->console, PrinterType::AsynchronizedPrinter, DefaultColor))
-        goto ReleaseBlock;
-
-    context->startStopEvent = ::CreateEvent(NULL, FALSE, FALSE, NULL);
-    if (!context->startStopEvent)
-        goto ReleaseBlock;
+    memset(context, 0, sizeof(AsyncConsoleContext));
 
-    context->stopDispatcherEvent = ::CreateEvent(NULL, FALSE, FALSE, NULL);
-    if (!context->stopDispatcherEvent)
+    if (!InitConsoleContext(&context->console, PrinterType::AsynchronizedPrinter, DefaultColor, ConsoleOutput))
         goto ReleaseBlock;
 
-    context->dispatcher = ::CreateThread(NULL, 0, AsyncConsoleDispatcher, context, 0, NULL);
-    if (!context->dispatcher)
-        goto ReleaseBlock;
+    CalibrateTimestampCounter();
 
-    if (::WaitForSingleObject(context->startStopEvent, INFINITE) != WAIT_OBJECT_0)
+    if (ConsoleOutput && RegisterConsolePrinterSink(context, PrintRecordToConsole, NULL, context) < 0)
         goto ReleaseBlock;
 
-    context->bufferedQueue = CreateBufferQueue();
-    if (!context->bufferedQueue)
-        goto ReleaseBlock;
-
-    context->terminating = false;
-
     if (UseAsDefault)
         SetDefaultConsoleContext((ConsoleContext*)context);
 
@@ -220,45 +363,111 @@ ReleaseBlock:
 
     if (!result && context)
     {
-        if (context->startStopEvent)
-            ::CloseHandle(context->startStopEvent);
+        free(context);
+        context = NULL;
+    }
 
-        if (context->stopDispatcherEvent)
-            ::CloseHandle(context->stopDispatcherEvent);
+    return context;
+}
 
-        if (context->dispatcher)
-        {
-            ::TerminateThread(context->dispatcher, 0x0BADBAD0);
-            ::CloseHandle(context->dispatcher);
-        }
+void DestroyAsyncConsolePrinterContext(ConsoleInstance Context)
+{
+    AsyncConsoleContext* context = (AsyncConsoleContext*)Context;
+    long i;
 
-        if (context->bufferedQueue)
-            DestroyBufferQueue(context->bufferedQueue);
+    ResetDefaultConsoleContext(&context->console);
+
+    for (i = 0; i < context->sinksCount; i++)
+        DestroySink(context->sinks[i]);
+
+    if (context->console.codePage)
+        ::SetConsoleOutputCP(context->console.codePage);
+
+    free(context);
+}
+
+int RegisterConsolePrinterSink(ConsoleInstance Context, PrinterSinkCallback Callback, PrinterSinkReleaseCallback Release, void* Parameter, size_t QueueSize)
+{
+    AsyncConsoleContext* context = (AsyncConsoleContext*)Context;
+    PrinterSinkContext* sink;
+    int index = -1;
+
+    if (context->console.type != PrinterType::AsynchronizedPrinter)
+        return -1;
+
+    sink = CreateSink(Callback, Release, Parameter, QueueSize);
+    if (!sink)
+        return -1;
+
+    AcquireSpinLock(&context->sinksLock);
+
+    // Producers read the counter without a lock, therefore a slot is filled before it's published
+    if (context->sinksCount < MaxPrinterSinks)
+    {
+        index = context->sinksCount;
+        context->sinks[index] = sink;
+        ::MemoryBarrier();
+        context->sinksCount = index + 1;
     }
 
-    return context;
+    ReleaseSpinLock(&context->sinksLock);
+
+    if (index < 0)
+        DestroySink(sink);
+
+    return index;
 }
 
-void DestroyAsyncConsolePrinterContext(ConsoleInstance Context)
+unsigned long GetConsolePrinterSinkDrops(ConsoleInstance Context, int Sink)
 {
     AsyncConsoleContext* context = (AsyncConsoleContext*)Context;
-    DWORD error;
 
-    context->terminating = true;
+    if (Sink < 0 || Sink >= context->sinksCount)
+        return 0;
 
-    ::SetEvent(context->stopDispatcherEvent);
+    return (unsigned long)context->sinks[Sink]->dropped;
+}
 
-    error = ::WaitForSingleObject(context->startStopEvent, INFINITE);
-    if (error != WAIT_OBJECT_0)
-        ::TerminateThread(context->dispatcher, 0xC0FEC0FE);
+static void FillLogRecordHeader(const PrinterRecord* Record, LogRecordHeader* Header)
+{
+    Header->size = (unsigned int)Record->size;
+    Header->thread = Record->thread;
+    Header->timestamp = Record->timestamp;
+    Header->level = (unsigned char)Record->level;
+    Header->color = (unsigned char)Record->color;
+    Header->reserved = 0;
+}
 
-    ::CloseHandle(context->dispatcher);
-    ::CloseHandle(context->startStopEvent);
-    ::CloseHandle(context->stopDispatcherEvent);
+static void WriteRecordToLogFile(const PrinterRecord* Record, void* Parameter)
+{
+    LogRecordHeader header;
 
-    DestroyBufferQueue(context->bufferedQueue);
+    FillLogRecordHeader(Record, &header);
+    WriteLogFileRecord(Parameter, &header, Record->message);
+}
 
-    free(context);
+static void WriteRecordToSharedLog(const PrinterRecord* Record, void* Parameter)
+{
+    LogRecordHeader header;
+
+    FillLogRecordHeader(Record, &header);
+    WriteSharedLogRecord(Parameter, &header, Record->message);
+}
+
+int AttachLogFileToConsolePrinterContext(ConsoleInstance Context, const wchar_t* Directory, const wchar_t* Prefix, size_t SegmentSize, unsigned int MaxSegments)
+{
+    void* fileSink;
+    int index;
+
+    fileSink = CreateLogFileSink(Directory, Prefix, SegmentSize, MaxSegments);
+    if (!fileSink)
+        return -1;
+
+    index = RegisterConsolePrinterSink(Context, WriteRecordToLogFile, DestroyLogFileSink, fileSink);
+    if (index < 0)
+        DestroyLogFileSink(fileSink);
+
+    return index;
 }
 
 void AssociateThreadWithConsolePrinterContext(ConsoleInstance Context)
@@ -266,6 +475,14 @@ void AssociateThreadWithConsolePrinterContext(ConsoleInstance Context)
     st_AssignedContext = (ConsoleContext*)Context;
 }
 
+unsigned short GetPrinterThreadTag()
+{
+    if (!st_ThreadTag)
+        st_ThreadTag = (unsigned short)::InterlockedIncrement(&s_ThreadTagsCount);
+
+    return st_ThreadTag;
+}
+
 ConsoleContext* GetCurrentConsoleContext()
 {
     ConsoleContext* context = st_AssignedContext;
@@ -282,67 +499,265 @@ ConsoleContext* GetCurrentConsoleContext()
     return context;
 }
 
+static void PushMessage(ConsoleContext* Context, PrintLevels Level, PrintColors Color, const char* Message, size_t MessageSize)
+{
+    RecordFlightMessage(Level, Color, Message, MessageSize);
+
+    if (Context->type == PrinterType::SynchronizedPrinter)
+    {
+        //TODO:
+    }
+    else
+    {
+        AsyncConsoleContext* async = (AsyncConsoleContext*)Context;
+        BufferQueueChunk chunks[2];
+        MessageBlock block;
+        long i, count;
+
+        // A dispatcher converts the counter to the wall time
+        block.timestamp = ReadTimestampCounter();
+        block.thread = GetPrinterThreadTag();
+        block.level = (unsigned char)Level;
+        block.color = (unsigned char)Color;
+
+        chunks[0].Data = &block;
+        chunks[0].Size = FIELD_OFFSET(MessageBlock, message);
+        chunks[1].Data = Message;
+        chunks[1].Size = MessageSize;
+
+        count = async->sinksCount;
+
+        for (i = 0; i < count; i++)
+        {
+            PrinterSinkContext* sink = async->sinks[i];
+
+            if (PushChunksToBufferQueue(sink->bufferedQueue, chunks, _countof(chunks)))
+                ::SetEvent(sink->stopDispatcherEvent);
+            else
+                ::InterlockedIncrement(&sink->dropped);
+        }
+    }
+}
+
+// Buffers for messages which don't fit the inline ones, only very long
+// messages go to the heap
+static void* AllocateMessageBuffer(size_t Size)
+{
+    void* pool = s_MessagePool;
+
+    if (Size > PooledMessageSize)
+        return malloc(Size);
+
+    if (!pool)
+    {
+        pool = CreateObjectPool(PooledMessageSize, sizeof(void*), 16);
+        if (!pool)
+            return NULL;
+
+        if (::InterlockedCompareExchangePointer(&s_MessagePool, pool, NULL) != NULL)
+        {
+            DestroyObjectPool(pool);
+            pool = s_MessagePool;
+        }
+    }
+
+    return AllocateFromObjectPool(pool);
+}
+
+static void ReleaseMessageBuffer(void* Buffer, size_t Size)
+{
+    if (Size > PooledMessageSize)
+        free(Buffer);
+    else
+        ReleaseToObjectPool(s_MessagePool, Buffer);
+}
+
+static void PrintMsgV(ConsoleContext* Context, PrintColors Color, const wchar_t* Format, va_list Args)
+{
+    wchar_t wideInline[InlineWideMessageLength];
+    char utf8Inline[InlineUtf8MessageSize];
+    wchar_t* wide = wideInline;
+    char* utf8 = utf8Inline;
+    size_t wideSize = 0, utf8Size = 0;
+    int len, size;
+    va_list args;
+
+    if (Context->type >= PrinterType::MaxPrintrerType)
+        return;
+
+    // Most of messages fit to the inline buffer, a long message is formatted
+    // one more time to a pooled buffer
+
+    va_copy(args, Args);
+    len = _vsnwprintf_s(wideInline, _countof(wideInline), _TRUNCATE, Format, args);
+    va_end(args);
+
+    if (len < 0)
+    {
+        va_copy(args, Args);
+        len = _vscwprintf(Format, args);
+        va_end(args);
+
+        if (len < 0)
+            return;
+
+        wideSize = (len + 1) * sizeof(wchar_t);
+        wide = (wchar_t*)AllocateMessageBuffer(wideSize);
+        if (!wide)
+            return;
+
+        va_copy(args, Args);
+        len = _vsnwprintf_s(wide, len + 1, _TRUNCATE, Format, args);
+        va_end(args);
+
+        if (len < 0)
+            goto ReleaseBlock;
+    }
+
+    if (!len)
+        goto ReleaseBlock;
+
+    size = ::WideCharToMultiByte(CP_UTF8, 0, wide, len, utf8Inline, sizeof(utf8Inline), NULL, NULL);
+    if (!size)
+    {
+        if (::GetLastError() != ERROR_INSUFFICIENT_BUFFER)
+            goto ReleaseBlock;
+
+        size = ::WideCharToMultiByte(CP_UTF8, 0, wide, len, NULL, 0, NULL, NULL);
+        if (!size)
+            goto ReleaseBlock;
+
+        utf8Size = size;
+        utf8 = (char*)AllocateMessageBuffer(utf8Size);
+        if (!utf8)
+            goto ReleaseBlock;
+
+        size = ::WideCharToMultiByte(CP_UTF8, 0, wide, len, utf8, size, NULL, NULL);
+        if (!size)
+            goto ReleaseBlock;
+    }
+
+    PushMessage(Context, InfoLevel, Color, utf8, size);
+
+ReleaseBlock:
+
+    if (utf8 != utf8Inline && utf8)
+        ReleaseMessageBuffer(utf8, utf8Size);
+
+    if (wide != wideInline && wide)
+        ReleaseMessageBuffer(wide, wideSize);
+}
+
 void PrintMsg(PrintColors Color, const wchar_t* Format ...)
 {
     ConsoleContext* context = GetCurrentConsoleContext();
-    MessageBlock block;
-    int len;
 
     if (!context)
         return;
 
-    if (context->type >= PrinterType::MaxPrintrerType)
-        return;
+    va_list args;
+    va_start(args, Format);
+    PrintMsgV(context, Color, Format, args);
+    va_end(args);
+}
+
+void PrintMsgEx(ConsoleInstance Context, PrintColors Color, const wchar_t* Format ...)
+{
+    ConsoleContext* context = (ConsoleContext*)Context;
 
     va_list args;
     va_start(args, Format);
-    len = vswprintf_s(block.message, Format, args);
+    PrintMsgV(context, Color, Format, args);
     va_end(args);
+}
 
-    if (len < 0)
+void PrintRawMsg(PrintLevels Level, PrintColors Color, const char* Message, size_t MessageSize)
+{
+    ConsoleContext* context = GetCurrentConsoleContext();
+
+    if (!context || !MessageSize)
         return;
 
-    block.color = Color;
+    if (context->type >= PrinterType::MaxPrintrerType)
+        return;
 
-    if (context->type == PrinterType::SynchronizedPrinter)
-    {
-        //TODO:
-    }
-    else
-    {
-        AsyncConsoleContext* async = (AsyncConsoleContext*)context;
-        if (PushDataToBufferQueue(async->bufferedQueue, &block, FIELD_OFFSET(MessageBlock, message) + (len + 1) * sizeof(wchar_t)))
-            ::SetEvent(async->stopDispatcherEvent);
-    }
+    PushMessage(context, Level, Color, Message, MessageSize);
 }
 
-void PrintMsgEx(ConsoleInstance Context, PrintColors Color, const wchar_t* Format ...)
+void PrintRawMsgEx(ConsoleInstance Context, PrintLevels Level, PrintColors Color, const char* Message, size_t MessageSize)
 {
     ConsoleContext* context = (ConsoleContext*)Context;
-    MessageBlock block;
-    int len;
+
+    if (!MessageSize)
+        return;
 
     if (context->type >= PrinterType::MaxPrintrerType)
         return;
 
-    va_list args;
-    va_start(args, Format);
-    len = vswprintf_s(block.message, Format, args);
-    va_end(args);
+    PushMessage(context, Level, Color, Message, MessageSize);
+}
 
-    if (len < 0)
+// =============================================
+
+void SetPrintLevel(PrintLevels Level)
+{
+    ::InterlockedExchange(&g_PrintLevel, Level);
+}
+
+static void RefillPrintRateLimit(PrintRateLimit* Limit)
+{
+    long long now = (long long)::GetTickCount64();
+    long long last = Limit->lastRefill;
+    long long refill = (now - last) * Limit->rate / 1000;
+    long tokens;
+
+    if (!refill)
         return;
 
-    block.color = Color;
+    // Only one thread moves the refill point forward and adds tokens
+    if (::InterlockedCompareExchange64(&Limit->lastRefill, last + refill * 1000 / Limit->rate, last) != last)
+        return;
 
-    if (context->type == PrinterType::SynchronizedPrinter)
+    do
     {
-        //TODO:
+        tokens = Limit->tokens;
     }
-    else
+    while (::InterlockedCompareExchange(&Limit->tokens, (long)min(tokens + refill, (long long)Limit->burst), tokens) != tokens);
+}
+
+bool AcquirePrintRateLimit(PrintRateLimit* Limit, unsigned long* Suppressed)
+{
+    long tokens;
+
+    RefillPrintRateLimit(Limit);
+
+    do
     {
-        AsyncConsoleContext* async = (AsyncConsoleContext*)context;
-        if (PushDataToBufferQueue(async->bufferedQueue, &block, FIELD_OFFSET(MessageBlock, message) + (len + 1) * sizeof(wchar_t)))
-            ::SetEvent(async->stopDispatcherEvent);
+        tokens = Limit->tokens;
+        if (tokens <= 0)
+        {
+            ::InterlockedIncrement(&Limit->suppressed);
+            return false;
+        }
     }
+    while (::InterlockedCompareExchange(&Limit->tokens, tokens - 1, tokens) != tokens);
+
+    *Suppressed = (Limit->suppressed ? (unsigned long)::InterlockedExchange(&Limit->suppressed, 0) : 0);
+    return true;
+}
+
+int AttachSharedLogToConsolePrinterContext(ConsoleInstance Context, const wchar_t* Name, unsigned int SlotsCount)
+{
+    void* sharedSink;
+    int index;
+
+    sharedSink = CreateSharedLogSink(Name, SlotsCount);
+    if (!sharedSink)
+        return -1;
+
+    index = RegisterConsolePrinterSink(Context, WriteRecordToSharedLog, DestroySharedLogSink, sharedSink);
+    if (index < 0)
+        DestroySharedLogSink(sharedSink);
+
+    return index;
 }
@@ -22,12 +22,95 @@ enum PrintColors
     MaxColor
 };
 
+enum PrintLevels
+{
+    TraceLevel,
+    DebugLevel,
+    InfoLevel,
+    WarningLevel,
+    ErrorLevel,
+    MaxLevel
+};
+
+// Messages below this level are compiled out, it can be overridden in project settings
+#ifndef PRINT_MIN_LEVEL
+#define PRINT_MIN_LEVEL TraceLevel
+#endif
+
 typedef void* ConsoleInstance;
 
-ConsoleInstance CreateAsyncConsolePrinterContext(PrintColors DefaultColor = PrintColors::Default, bool UseAsDefault = false);
+// When ConsoleOutput is false a context only feeds attached sinks and never writes to the console
+ConsoleInstance CreateAsyncConsolePrinterContext(PrintColors DefaultColor = PrintColors::Default, bool UseAsDefault = false, bool ConsoleOutput = true);
 void  DestroyAsyncConsolePrinterContext(ConsoleInstance Context);
 
 void AssociateThreadWithConsolePrinterContext(ConsoleInstance Context);
 
+// Small number which labels records of the calling thread, it's assigned on the first call
+unsigned short GetPrinterThreadTag();
+
+// =============================================
+//  Sinks
+//
+//  Every message of an async context is delivered to each registered sink. A sink
+//  has its own queue and dispatcher thread, when a sink queue is full the message
+//  is dropped only for this sink and counted. The console is sink 0 unless
+//  a context is created without console output.
+
+struct PrinterRecord
+{
+    unsigned long long timestamp; // FILETIME
+    unsigned long long counter;   // raw time stamp counter, see ReadTimestampCounter()
+    unsigned long      thread;    // small thread tag
+    PrintLevels        level;
+    PrintColors        color;
+    const char*        message;   // UTF-8, not null-terminated
+    size_t             size;
+};
+
+typedef void(*PrinterSinkCallback)(const PrinterRecord* Record, void* Parameter);
+typedef void(*PrinterSinkReleaseCallback)(void* Parameter);
+
+// Returns a sink index or -1 on failure
+int RegisterConsolePrinterSink(ConsoleInstance Context, PrinterSinkCallback Callback, PrinterSinkReleaseCallback Release, void* Parameter, size_t QueueSize = 0x10000);
+unsigned long GetConsolePrinterSinkDrops(ConsoleInstance Context, int Sink);
+
+// Duplicates messages of an async context to binary log segments, see LogFileSink.h
+int AttachLogFileToConsolePrinterContext(ConsoleInstance Context, const wchar_t* Directory, const wchar_t* Prefix, size_t SegmentSize = 0x1000000, unsigned int MaxSegments = 8);
+
+// Publishes messages to a shared memory ring for an external viewer, see SharedLogSink.h
+int AttachSharedLogToConsolePrinterContext(ConsoleInstance Context, const wchar_t* Name, unsigned int SlotsCount = 0x1000);
+
 void PrintMsg(PrintColors Color, const wchar_t* Format ...);
 void PrintMsgEx(ConsoleInstance Context, PrintColors Color, const wchar_t* Format ...);
+
+// Queues an already formatted UTF-8 message, see FormatPrinter.h
+void PrintRawMsg(PrintLevels Level, PrintColors Color, const char* Message, size_t MessageSize);
+void PrintRawMsgEx(ConsoleInstance Context, PrintLevels Level, PrintColors Color, const char* Message, size_t MessageSize);
+
+// =============================================
+//  Filtering
+
+extern volatile long g_PrintLevel;
+
+void SetPrintLevel(PrintLevels Level);
+
+inline bool IsPrintLevelEnabled(PrintLevels Level)
+{
+    return (Level >= PRINT_MIN_LEVEL && Level >= (PrintLevels)g_PrintLevel);
+}
+
+// Token bucket rate limiter, an instance is placed to each call site by PRINT_RATE_LIMITED()
+struct PrintRateLimit
+{
+    long               rate;       // tokens per second
+    long               burst;      // bucket capacity
+    volatile long      tokens;
+    volatile long      suppressed;
+    volatile long long lastRefill; // GetTickCount64() value
+};
+
+#define PRINT_RATE_LIMIT_INIT(Rate, Burst) { (Rate), (Burst), (Burst), 0, 0 }
+
+// Returns true if a message can be printed, Suppressed receives an amount of
+// messages dropped since the last successful call
+bool AcquirePrintRateLimit(PrintRateLimit* Limit, unsigned long* Suppressed);
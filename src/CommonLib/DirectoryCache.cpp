@@ -0,0 +1,485 @@
+#include "DirectoryCache.h"
+#include <NTLib.h>
+#include <stdlib.h>
+#include <string.h>
+#include <wchar.h>
+
+// =============================================
+
+#ifndef STATUS_DELETE_PENDING
+#define STATUS_DELETE_PENDING ((NTSTATUS)0xC0000056L)
+#endif
+
+#define NO_SLOT ((unsigned int)-1)
+
+// =============================================
+
+struct DirectoryCacheEntry
+{
+    unsigned int       hash;
+    size_t             length;
+    wchar_t*           path;       // follows the entry in the same allocation
+    HANDLE             handle;
+    volatile long      refs;       // the cache holds one while the entry is in the table
+    volatile long      referenced; // set by a hit, cleared by the clock hand
+    unsigned long long opened;
+};
+
+struct DirectoryCacheContext
+{
+    HANDLE                root;
+    SRWLOCK               lock;
+    unsigned int          entriesCount;
+    unsigned int          maxEntries;
+    unsigned int          mask;
+    unsigned int          hand;
+    DirectoryCacheEntry** entries;
+};
+
+static inline bool IsSeparator(wchar_t Chr)
+{
+    return (Chr == L'\\' || Chr == L'/');
+}
+
+static unsigned int HashPath(const wchar_t* Path, size_t Length)
+{
+    unsigned int hash = 2166136261u;
+    size_t i;
+
+    for (i = 0; i < Length; i++)
+    {
+        wchar_t chr = Path[i];
+
+        if (chr == L'/')
+            chr = L'\\';
+        else
+            chr = towlower(chr);
+
+        hash = (hash ^ chr) * 16777619u;
+    }
+
+    return hash;
+}
+
+static bool IsSamePath(const wchar_t* Path1, const wchar_t* Path2, size_t Length)
+{
+    size_t i;
+
+    for (i = 0; i < Length; i++)
+    {
+        wchar_t chr1 = Path1[i], chr2 = Path2[i];
+
+        if (chr1 == chr2)
+            continue;
+
+        if (IsSeparator(chr1) && IsSeparator(chr2))
+            continue;
+
+        if (towlower(chr1) != towlower(chr2))
+            return false;
+    }
+
+    return true;
+}
+
+static inline DWORD StatusToError(NTSTATUS Status)
+{
+    // The generic mapping turns a pending deletion to ERROR_ACCESS_DENIED
+    return (Status == STATUS_DELETE_PENDING ? ERROR_DELETE_PENDING : ::RtlNtStatusToDosError(Status));
+}
+
+static inline bool IsEntryFresh(DirectoryCacheEntry* Entry, unsigned long long Now)
+{
+    return (Now - Entry->opened < DIRECTORY_CACHE_REVALIDATE);
+}
+
+static void ReleaseEntry(DirectoryCacheEntry* Entry)
+{
+    if (::InterlockedDecrement(&Entry->refs) != 0)
+        return;
+
+    ::CloseHandle(Entry->handle);
+    free(Entry);
+}
+
+// The lock should be held by a caller
+static unsigned int FindSlot(DirectoryCacheContext* Cache, const wchar_t* Path, size_t Length, unsigned int Hash)
+{
+    unsigned int i = Hash & Cache->mask;
+
+    while (Cache->entries[i])
+    {
+        DirectoryCacheEntry* entry = Cache->entries[i];
+
+        if (entry->hash == Hash && entry->length == Length && IsSamePath(entry->path, Path, Length))
+            return i;
+
+        i = (i + 1) & Cache->mask;
+    }
+
+    return NO_SLOT;
+}
+
+// The exclusive lock should be held by a caller. Following entries are
+// shifted back, so probe sequences stay unbroken.
+static void RemoveSlot(DirectoryCacheContext* Cache, unsigned int Index)
+{
+    DirectoryCacheEntry* entry = Cache->entries[Index];
+    unsigned int next;
+
+    Cache->entries[Index] = NULL;
+    Cache->entriesCount--;
+
+    for (next = (Index + 1) & Cache->mask; Cache->entries[next]; next = (next + 1) & Cache->mask)
+    {
+        unsigned int home = Cache->entries[next]->hash & Cache->mask;
+
+        if (Index <= next ? (home > Index && home <= next) : (home > Index || home <= next))
+            continue;
+
+        Cache->entries[Index] = Cache->entries[next];
+        Cache->entries[next] = NULL;
+        Index = next;
+    }
+
+    ReleaseEntry(entry);
+}
+
+// Second chance: an entry which has been hit since the last pass of the hand
+// stays, so the least recently used ones go first
+static void EvictEntry(DirectoryCacheContext* Cache)
+{
+    unsigned int i, steps = (Cache->mask + 1) * 2;
+
+    for (i = 0; i < steps; i++)
+    {
+        unsigned int slot = Cache->hand;
+        DirectoryCacheEntry* entry = Cache->entries[slot];
+
+        Cache->hand = (slot + 1) & Cache->mask;
+
+        if (!entry)
+            continue;
+
+        if (entry->referenced)
+        {
+            entry->referenced = 0;
+            continue;
+        }
+
+        RemoveSlot(Cache, slot);
+        return;
+    }
+}
+
+// Returns a referenced entry or NULL if the handle isn't cached and stays
+// owned by a caller. If the directory has been cached by another thread the
+// handle is closed and the cached entry is returned.
+static DirectoryCacheEntry* InsertEntry(DirectoryCacheContext* Cache, const wchar_t* Path, size_t Length, HANDLE Handle)
+{
+    unsigned long long now = ::GetTickCount64();
+    DirectoryCacheEntry* entry;
+    unsigned int i;
+
+    entry = (DirectoryCacheEntry*)malloc(sizeof(DirectoryCacheEntry) + Length * sizeof(wchar_t));
+    if (!entry)
+        return NULL;
+
+    entry->hash = HashPath(Path, Length);
+    entry->length = Length;
+    entry->path = (wchar_t*)(entry + 1);
+    entry->handle = Handle;
+    entry->refs = 2;
+    entry->referenced = 1;
+    entry->opened = now;
+
+    memcpy(entry->path, Path, Length * sizeof(wchar_t));
+
+    ::AcquireSRWLockExclusive(&Cache->lock);
+
+    i = FindSlot(Cache, Path, Length, entry->hash);
+    if (i != NO_SLOT)
+    {
+        DirectoryCacheEntry* cached = Cache->entries[i];
+
+        if (IsEntryFresh(cached, now))
+        {
+            ::InterlockedIncrement(&cached->refs);
+            cached->referenced = 1;
+
+            ::ReleaseSRWLockExclusive(&Cache->lock);
+
+            ::CloseHandle(Handle);
+            free(entry);
+            return cached;
+        }
+
+        // An outdated handle is replaced by the new one
+        RemoveSlot(Cache, i);
+    }
+
+    if (Cache->entriesCount >= Cache->maxEntries)
+        EvictEntry(Cache);
+
+    for (i = entry->hash & Cache->mask; Cache->entries[i]; i = (i + 1) & Cache->mask);
+
+    Cache->entries[i] = entry;
+    Cache->entriesCount++;
+
+    ::ReleaseSRWLockExclusive(&Cache->lock);
+
+    return entry;
+}
+
+static NTSTATUS OpenOrCreateChildDirectory(HANDLE Parent, const wchar_t* Name, size_t Length, HANDLE* Directory)
+{
+    OBJECT_ATTRIBUTES attributes;
+    IO_STATUS_BLOCK ioStatus;
+    UNICODE_STRING name;
+
+    name.Buffer = (PWSTR)Name;
+    name.Length = (USHORT)(Length * sizeof(wchar_t));
+    name.MaximumLength = name.Length;
+
+    InitializeObjectAttributes(&attributes, &name, OBJ_CASE_INSENSITIVE, Parent, NULL);
+
+    return ::NtCreateFile(
+        Directory,
+        FILE_TRAVERSE | SYNCHRONIZE,
+        &attributes,
+        &ioStatus,
+        NULL,
+        FILE_ATTRIBUTE_NORMAL,
+        FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+        FILE_OPEN_IF,
+        FILE_DIRECTORY_FILE | FILE_SYNCHRONOUS_IO_NONALERT | FILE_OPEN_FOR_BACKUP_INTENT,
+        NULL,
+        0
+    );
+}
+
+// =============================================
+
+void* CreateDirectoryCache(const wchar_t* RootDir, unsigned int MaxEntries)
+{
+    DirectoryCacheContext* cache;
+    unsigned int capacity = 16;
+
+    cache = (DirectoryCacheContext*)malloc(sizeof(DirectoryCacheContext));
+    if (!cache)
+        return NULL;
+
+    memset(cache, 0, sizeof(DirectoryCacheContext));
+
+    if (!MaxEntries)
+        MaxEntries = 1;
+
+    // The table is kept at most half full, so probe chains stay short
+    while (capacity < MaxEntries * 2)
+        capacity <<= 1;
+
+    cache->maxEntries = MaxEntries;
+    cache->mask = capacity - 1;
+    ::InitializeSRWLock(&cache->lock);
+
+    cache->entries = (DirectoryCacheEntry**)calloc(capacity, sizeof(DirectoryCacheEntry*));
+    if (!cache->entries)
+        goto ReleaseBlock;
+
+    cache->root = ::CreateFileW(
+        RootDir,
+        FILE_TRAVERSE | SYNCHRONIZE,
+        FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+        NULL,
+        OPEN_EXISTING,
+        FILE_FLAG_BACKUP_SEMANTICS,
+        NULL
+    );
+    if (cache->root == INVALID_HANDLE_VALUE)
+        goto ReleaseBlock;
+
+    return cache;
+
+ReleaseBlock:
+
+    free(cache->entries);
+    free(cache);
+
+    return NULL;
+}
+
+// Directories which are still referenced are closed by CloseCachedDirectory()
+void DestroyDirectoryCache(void* Cache)
+{
+    DirectoryCacheContext* cache = (DirectoryCacheContext*)Cache;
+    unsigned int i;
+
+    for (i = 0; i <= cache->mask; i++)
+        if (cache->entries[i])
+            ReleaseEntry(cache->entries[i]);
+
+    ::CloseHandle(cache->root);
+
+    free(cache->entries);
+    free(cache);
+}
+
+HANDLE GetDirectoryCacheRoot(void* Cache)
+{
+    return ((DirectoryCacheContext*)Cache)->root;
+}
+
+bool IsStaleDirectoryError(DWORD Error)
+{
+    return (Error == ERROR_DELETE_PENDING || Error == ERROR_ACCESS_DENIED
+        || Error == ERROR_FILE_NOT_FOUND || Error == ERROR_PATH_NOT_FOUND);
+}
+
+// CachedLength receives a length of the cached parent the walk started from
+static bool OpenDirectory(DirectoryCacheContext* Cache, const wchar_t* Path, size_t Length, CachedDirectory* Directory, size_t* CachedLength)
+{
+    unsigned long long now = ::GetTickCount64();
+    DirectoryCacheEntry* parentEntry = NULL;
+    HANDLE parent = Cache->root;
+    bool parentOwned = false;
+    size_t prefix, start;
+    unsigned int i;
+
+    // Look for the closest cached directory, it's the whole path in most cases
+
+    prefix = Length;
+
+    ::AcquireSRWLockShared(&Cache->lock);
+
+    while (prefix)
+    {
+        i = FindSlot(Cache, Path, prefix, HashPath(Path, prefix));
+
+        // An old handle may refer to a moved directory, the path is opened again
+        if (i != NO_SLOT && IsEntryFresh(Cache->entries[i], now))
+        {
+            parentEntry = Cache->entries[i];
+            parentEntry->referenced = 1;
+            ::InterlockedIncrement(&parentEntry->refs);
+            parent = parentEntry->handle;
+            break;
+        }
+
+        while (prefix && !IsSeparator(Path[prefix - 1]))
+            prefix--;
+
+        while (prefix && IsSeparator(Path[prefix - 1]))
+            prefix--;
+    }
+
+    ::ReleaseSRWLockShared(&Cache->lock);
+
+    *CachedLength = prefix;
+
+    // Open or create the rest components one by one relative to a parent
+
+    start = prefix;
+
+    while (start < Length)
+    {
+        HANDLE child;
+        NTSTATUS status;
+        size_t end;
+
+        while (start < Length && IsSeparator(Path[start]))
+            start++;
+
+        for (end = start; end < Length && !IsSeparator(Path[end]); end++);
+
+        status = OpenOrCreateChildDirectory(parent, Path + start, end - start, &child);
+
+        if (parentEntry)
+            ReleaseEntry(parentEntry);
+        else if (parentOwned)
+            ::CloseHandle(parent);
+
+        if (!NT_SUCCESS(status))
+        {
+            ::SetLastError(StatusToError(status));
+            return false;
+        }
+
+        parentEntry = InsertEntry(Cache, Path, end, child);
+        parent = (parentEntry ? parentEntry->handle : child);
+        parentOwned = !parentEntry;
+        start = end;
+    }
+
+    Directory->handle = parent;
+    Directory->owned = parentOwned;
+    Directory->entry = parentEntry;
+    return true;
+}
+
+bool OpenCachedDirectory(void* Cache, const wchar_t* Path, size_t Length, CachedDirectory* Directory)
+{
+    DirectoryCacheContext* cache = (DirectoryCacheContext*)Cache;
+    size_t cachedLength;
+
+    Directory->handle = NULL;
+    Directory->owned = false;
+    Directory->entry = NULL;
+
+    while (Length && IsSeparator(Path[Length - 1]))
+        Length--;
+
+    if (OpenDirectory(cache, Path, Length, Directory, &cachedLength))
+        return true;
+
+    // A cached parent may have been removed by a user, it's created again
+    if (!cachedLength || !IsStaleDirectoryError(::GetLastError()))
+        return false;
+
+    InvalidateCachedDirectory(Cache, Path, cachedLength);
+
+    return OpenDirectory(cache, Path, Length, Directory, &cachedLength);
+}
+
+void CloseCachedDirectory(CachedDirectory* Directory)
+{
+    if (Directory->entry)
+        ReleaseEntry((DirectoryCacheEntry*)Directory->entry);
+    else if (Directory->owned)
+        ::CloseHandle(Directory->handle);
+
+    Directory->handle = NULL;
+    Directory->owned = false;
+    Directory->entry = NULL;
+}
+
+void InvalidateCachedDirectory(void* Cache, const wchar_t* Path, size_t Length)
+{
+    DirectoryCacheContext* cache = (DirectoryCacheContext*)Cache;
+    unsigned int i;
+
+    while (Length && IsSeparator(Path[Length - 1]))
+        Length--;
+
+    if (!Length)
+        return;
+
+    ::AcquireSRWLockExclusive(&cache->lock);
+
+    // An entry shifted back to the current slot by a removal is checked again
+    for (i = 0; i <= cache->mask; )
+    {
+        DirectoryCacheEntry* entry = cache->entries[i];
+
+        if (entry && entry->length >= Length
+            && (entry->length == Length || IsSeparator(entry->path[Length]))
+            && IsSamePath(entry->path, Path, Length))
+        {
+            RemoveSlot(cache, i);
+            continue;
+        }
+
+        i++;
+    }
+
+    ::ReleaseSRWLockExclusive(&cache->lock);
+}
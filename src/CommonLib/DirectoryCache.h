@@ -0,0 +1,46 @@
+#pragma once
+
+#include <Windows.h>
+
+// =============================================
+//  Directory cache
+//
+//  Keeps open handles of directories under a root directory that are known
+//  to exist. A missing directory is created relative to the handle of its
+//  closest cached parent, so only new path components cost a system call.
+//  Paths are relative to the root, case insensitive and use '\' or '/' as
+//  a separator.
+//
+//  A full cache evicts the least recently used entries by a clock sweep. An
+//  entry older than DIRECTORY_CACHE_REVALIDATE is opened by its path again,
+//  so a directory moved by a user isn't used for long. An evicted handle is
+//  closed when the last CachedDirectory which refers to it is closed.
+
+#define DIRECTORY_CACHE_REVALIDATE 10000 // milliseconds
+
+struct CachedDirectory
+{
+    HANDLE handle;
+    bool   owned; // the handle isn't cached, it's closed by CloseCachedDirectory()
+    void*  entry; // a reference to a cache entry
+};
+
+void* CreateDirectoryCache(const wchar_t* RootDir, unsigned int MaxEntries = 0x1000);
+void DestroyDirectoryCache(void* Cache);
+
+// Opens a directory and creates it with all missing parents if needed. A
+// cached parent which has been removed by a user is dropped and the path is
+// opened once again.
+bool OpenCachedDirectory(void* Cache, const wchar_t* Path, size_t Length, CachedDirectory* Directory);
+void CloseCachedDirectory(CachedDirectory* Directory);
+
+// Drops a directory and its children from the cache, it should be called when
+// an operation relative to a cached handle fails with an error accepted by
+// IsStaleDirectoryError()
+void InvalidateCachedDirectory(void* Cache, const wchar_t* Path, size_t Length);
+
+// A removed directory (ERROR_DELETE_PENDING, ERROR_ACCESS_DENIED for older
+// mappings) or a missing one
+bool IsStaleDirectoryError(DWORD Error);
+
+HANDLE GetDirectoryCacheRoot(void* Cache);
@@ -0,0 +1,234 @@
+#include "FastString.h"
+#include <intrin.h>
+#include <immintrin.h>
+#include <wchar.h>
+
+// =============================================
+
+static volatile long s_Avx2State = -1; // -1 - isn't detected yet
+
+static bool IsAvx2Supported()
+{
+    long state = s_Avx2State;
+    int info[4];
+
+    if (state >= 0)
+        return (state != 0);
+
+    state = 0;
+
+    __cpuid(info, 0);
+    if (info[0] >= 7)
+    {
+        // The OS should save YMM registers (OSXSAVE, AVX and XCR0 bits) in addition to the CPU support
+        __cpuid(info, 1);
+        if ((info[2] & (1 << 27)) && (info[2] & (1 << 28)) && (_xgetbv(0) & 6) == 6)
+        {
+            __cpuidex(info, 7, 0);
+            state = ((info[1] & (1 << 5)) != 0 ? 1 : 0);
+        }
+    }
+
+    s_Avx2State = state;
+    return (state != 0);
+}
+
+// =============================================
+//  Scalar fallback
+
+static void LowerScalar(wchar_t* String, size_t Length)
+{
+    size_t i;
+
+    for (i = 0; i < Length; i++)
+        String[i] = towlower(String[i]);
+}
+
+static int CompareScalar(const wchar_t* String1, const wchar_t* String2, size_t Length)
+{
+    size_t i;
+
+    for (i = 0; i < Length; i++)
+    {
+        wint_t chr1 = towlower(String1[i]);
+        wint_t chr2 = towlower(String2[i]);
+
+        if (chr1 != chr2)
+            return (int)chr1 - (int)chr2;
+    }
+
+    return 0;
+}
+
+// =============================================
+//  SSE2, 8 characters per block
+
+static inline bool IsAsciiBlock128(__m128i Block)
+{
+    __m128i high = _mm_and_si128(Block, _mm_set1_epi16((short)0xFF80));
+    return (_mm_movemask_epi8(_mm_cmpeq_epi16(high, _mm_setzero_si128())) == 0xFFFF);
+}
+
+static inline __m128i LowerAsciiBlock128(__m128i Block)
+{
+    __m128i upper = _mm_and_si128(
+        _mm_cmpgt_epi16(Block, _mm_set1_epi16('A' - 1)),
+        _mm_cmplt_epi16(Block, _mm_set1_epi16('Z' + 1))
+    );
+    return _mm_add_epi16(Block, _mm_and_si128(upper, _mm_set1_epi16(0x20)));
+}
+
+// =============================================
+//  AVX2, 16 characters per block
+
+static inline bool IsAsciiBlock256(__m256i Block)
+{
+    __m256i high = _mm256_and_si256(Block, _mm256_set1_epi16((short)0xFF80));
+    return (_mm256_movemask_epi8(_mm256_cmpeq_epi16(high, _mm256_setzero_si256())) == -1);
+}
+
+static inline __m256i LowerAsciiBlock256(__m256i Block)
+{
+    __m256i upper = _mm256_and_si256(
+        _mm256_cmpgt_epi16(Block, _mm256_set1_epi16('A' - 1)),
+        _mm256_cmpgt_epi16(_mm256_set1_epi16('Z' + 1), Block)
+    );
+    return _mm256_add_epi16(Block, _mm256_and_si256(upper, _mm256_set1_epi16(0x20)));
+}
+
+static size_t LowerAvx2(wchar_t* String, size_t Length)
+{
+    size_t i;
+
+    for (i = 0; i + 16 <= Length; i += 16)
+    {
+        __m256i block = _mm256_loadu_si256((const __m256i*)(String + i));
+
+        if (IsAsciiBlock256(block))
+            _mm256_storeu_si256((__m256i*)(String + i), LowerAsciiBlock256(block));
+        else
+            LowerScalar(String + i, 16);
+    }
+
+    _mm256_zeroupper();
+    return i;
+}
+
+static int CompareAvx2(const wchar_t* String1, const wchar_t* String2, size_t Length, size_t* Processed)
+{
+    int result = 0;
+    size_t i;
+
+    for (i = 0; i + 16 <= Length; i += 16)
+    {
+        __m256i block1 = _mm256_loadu_si256((const __m256i*)(String1 + i));
+        __m256i block2 = _mm256_loadu_si256((const __m256i*)(String2 + i));
+
+        if (IsAsciiBlock256(_mm256_or_si256(block1, block2)))
+        {
+            __m256i equal = _mm256_cmpeq_epi16(LowerAsciiBlock256(block1), LowerAsciiBlock256(block2));
+            if (_mm256_movemask_epi8(equal) == -1)
+                continue;
+        }
+
+        // A mismatched or non-ASCII block is resolved per character
+        result = CompareScalar(String1 + i, String2 + i, 16);
+        if (result)
+            break;
+    }
+
+    _mm256_zeroupper();
+
+    *Processed = i;
+    return result;
+}
+
+// =============================================
+
+size_t GetWideStringLength(const wchar_t* String)
+{
+    const char* start = (const char*)String;
+    const __m128i* block;
+    unsigned int mask;
+    unsigned long index;
+
+    // Lanes of an aligned block match characters only for an even address
+    if ((uintptr_t)String & 1)
+        return wcslen(String);
+
+    // An aligned block never crosses a page boundary, therefore reading the
+    // bytes around the string is safe
+    block = (const __m128i*)((uintptr_t)String & ~(uintptr_t)15);
+
+    mask = _mm_movemask_epi8(_mm_cmpeq_epi16(_mm_load_si128(block), _mm_setzero_si128()));
+    mask &= ~0u << (unsigned int)(start - (const char*)block);
+
+    while (!mask)
+    {
+        block++;
+        mask = _mm_movemask_epi8(_mm_cmpeq_epi16(_mm_load_si128(block), _mm_setzero_si128()));
+    }
+
+    _BitScanForward(&index, mask);
+    return ((const char*)block + index - start) / sizeof(wchar_t);
+}
+
+void LowerWideString(wchar_t* String, size_t Length)
+{
+    size_t i = 0;
+
+    if (Length >= 16 && IsAvx2Supported())
+        i = LowerAvx2(String, Length);
+
+    for (; i + 8 <= Length; i += 8)
+    {
+        __m128i block = _mm_loadu_si128((const __m128i*)(String + i));
+
+        if (IsAsciiBlock128(block))
+            _mm_storeu_si128((__m128i*)(String + i), LowerAsciiBlock128(block));
+        else
+            LowerScalar(String + i, 8);
+    }
+
+    LowerScalar(String + i, Length - i);
+}
+
+int CompareWideStringsNoCase(const wchar_t* String1, const wchar_t* String2, size_t Length)
+{
+    size_t i = 0;
+    int result;
+
+    if (Length >= 16 && IsAvx2Supported())
+    {
+        result = CompareAvx2(String1, String2, Length, &i);
+        if (result)
+            return result;
+    }
+
+    for (; i + 8 <= Length; i += 8)
+    {
+        __m128i block1 = _mm_loadu_si128((const __m128i*)(String1 + i));
+        __m128i block2 = _mm_loadu_si128((const __m128i*)(String2 + i));
+
+        if (IsAsciiBlock128(_mm_or_si128(block1, block2)))
+        {
+            __m128i equal = _mm_cmpeq_epi16(LowerAsciiBlock128(block1), LowerAsciiBlock128(block2));
+            if (_mm_movemask_epi8(equal) == 0xFFFF)
+                continue;
+        }
+
+        result = CompareScalar(String1 + i, String2 + i, 8);
+        if (result)
+            return result;
+    }
+
+    return CompareScalar(String1 + i, String2 + i, Length - i);
+}
+
+bool IsWidePrefixNoCase(const wchar_t* String, size_t Length, const wchar_t* Prefix, size_t PrefixLength)
+{
+    if (Length < PrefixLength)
+        return false;
+
+    return (CompareWideStringsNoCase(String, Prefix, PrefixLength) == 0);
+}
@@ -0,0 +1,20 @@
+#pragma once
+
+// =============================================
+//  Vectorized wide string routines
+//
+//  ASCII blocks are handled by SSE2 or AVX2 kernels (selected once at runtime),
+//  a block with any non-ASCII character falls back to towlower() per character.
+//  The results are identical to wcslen(), _wcslwr() and _wcsnicmp() in the "C"
+//  locale. Routines taking a length never read beyond it and don't stop at a
+//  null character.
+
+size_t GetWideStringLength(const wchar_t* String);
+
+void LowerWideString(wchar_t* String, size_t Length);
+
+// Returns zero if strings are equal ignoring case, otherwise the difference of
+// the first mismatched lowercase characters like _wcsnicmp()
+int CompareWideStringsNoCase(const wchar_t* String1, const wchar_t* String2, size_t Length);
+
+bool IsWidePrefixNoCase(const wchar_t* String, size_t Length, const wchar_t* Prefix, size_t PrefixLength);
@@ -0,0 +1,478 @@
+#include "FlightRecorder.h"
+#include "CommonLib.h"
+#include "LogFormat.h"
+#include <Windows.h>
+#include <signal.h>
+#include <string.h>
+
+enum FlightEntryTypes
+{
+    FlightMessageEntry,
+    FlightEventEntry
+};
+
+enum
+{
+    MaxFlightSegments       = 64,
+    FlightEntrySize         = 128,
+    FlightSegmentRetryDelay = 1000, // ms a thread waits before it asks for a segment again
+};
+
+#pragma pack(push, 1)
+struct FlightEntryHeader
+{
+    unsigned long long counter;
+    unsigned short     thread;
+    unsigned char      type;
+    unsigned char      level;
+    unsigned char      color;
+    unsigned char      reserved;
+    unsigned short     size;
+};
+#pragma pack(pop)
+
+struct FlightEvent
+{
+    const char*        name;
+    unsigned long long arg1;
+    unsigned long long arg2;
+};
+
+struct FlightEntry
+{
+    FlightEntryHeader header;
+    char              data[FlightEntrySize - sizeof(FlightEntryHeader)];
+};
+
+struct FlightSegment
+{
+    volatile unsigned long long head; // amount of written entries, only an owner changes it
+    volatile long               owned;
+    unsigned short              thread; // printer tag of the owner, see GetPrinterThreadTag()
+    FlightEntry*                entries;
+};
+
+static struct
+{
+    volatile bool   enabled;
+    wchar_t*        dumpPath;
+    unsigned int    entriesPerThread;
+    FlightEntry*    entries;
+    char*           dumpBuffer;
+    size_t          dumpBufferSize;
+    volatile long   segmentsCount; // segments that have ever been owned
+    volatile long   dumping;       // 1 while a dump is written, 2 after the release
+    DWORD           flsIndex;
+    FlightSegment   segments[MaxFlightSegments];
+    LPTOP_LEVEL_EXCEPTION_FILTER previousFilter;
+} s_FlightRecorder;
+
+static _declspec(thread) FlightSegment* st_FlightSegment = NULL;
+static _declspec(thread) bool st_FlightSegmentDenied = false;
+static _declspec(thread) DWORD st_FlightSegmentDeniedTick = 0;
+
+// =============================================
+
+// Called on a thread exit. The entries stay in the segment, so a dump still
+// shows the history of the exited thread until the next owner overwrites it.
+static void WINAPI ReleaseFlightSegment(PVOID Data)
+{
+    FlightSegment* segment = (FlightSegment*)Data;
+
+    if (!segment)
+        return;
+
+    if (st_FlightSegment == segment)
+        st_FlightSegment = NULL;
+
+    ::InterlockedExchange(&segment->owned, 0);
+}
+
+static FlightSegment* GetThreadFlightSegment()
+{
+    FlightSegment* segment = st_FlightSegment;
+    long index, count;
+
+    if (segment)
+        return segment;
+
+    // All segments were busy, another thread may have exited since then
+    if (st_FlightSegmentDenied && ::GetTickCount() - st_FlightSegmentDeniedTick < FlightSegmentRetryDelay)
+        return NULL;
+
+    for (index = 0; index < MaxFlightSegments; index++)
+        if (::InterlockedCompareExchange(&s_FlightRecorder.segments[index].owned, 1, 0) == 0)
+            break;
+
+    if (index >= MaxFlightSegments)
+        goto DeniedBlock;
+
+    segment = &s_FlightRecorder.segments[index];
+
+    // Entries are labeled like log records of the thread, so they can be matched in a viewer
+    segment->thread = GetPrinterThreadTag();
+
+    if (!::FlsSetValue(s_FlightRecorder.flsIndex, segment))
+    {
+        ::InterlockedExchange(&segment->owned, 0);
+        goto DeniedBlock;
+    }
+
+    do
+    {
+        count = s_FlightRecorder.segmentsCount;
+        if (count > index)
+            break;
+    }
+    while (::InterlockedCompareExchange(&s_FlightRecorder.segmentsCount, index + 1, count) != count);
+
+    st_FlightSegment = segment;
+    st_FlightSegmentDenied = false;
+
+    return segment;
+
+DeniedBlock:
+
+    st_FlightSegmentDenied = true;
+    st_FlightSegmentDeniedTick = ::GetTickCount();
+    return NULL;
+}
+
+static FlightEntry* AllocateFlightEntry(FlightEntryTypes Type)
+{
+    FlightSegment* segment = GetThreadFlightSegment();
+    FlightEntry* entry;
+
+    if (!segment)
+        return NULL;
+
+    entry = &segment->entries[segment->head % s_FlightRecorder.entriesPerThread];
+    entry->header.counter = ReadTimestampCounter();
+    entry->header.thread = segment->thread;
+    entry->header.type = (unsigned char)Type;
+
+    return entry;
+}
+
+static void CommitFlightEntry()
+{
+    // Only the owner thread writes to a segment, a plain increment is enough
+    st_FlightSegment->head++;
+}
+
+bool IsFlightRecorderEnabled()
+{
+    return s_FlightRecorder.enabled;
+}
+
+void RecordFlightMessage(PrintLevels Level, PrintColors Color, const char* Message, size_t MessageSize)
+{
+    FlightEntry* entry;
+
+    if (!s_FlightRecorder.enabled)
+        return;
+
+    entry = AllocateFlightEntry(FlightMessageEntry);
+    if (!entry)
+        return;
+
+    if (MessageSize > sizeof(entry->data))
+        MessageSize = sizeof(entry->data);
+
+    memcpy(entry->data, Message, MessageSize);
+
+    entry->header.level = (unsigned char)Level;
+    entry->header.color = (unsigned char)Color;
+    entry->header.size = (unsigned short)MessageSize;
+
+    CommitFlightEntry();
+}
+
+void RecordFlightEvent(const char* Name, unsigned long long Arg1, unsigned long long Arg2)
+{
+    FlightEntry* entry;
+    FlightEvent* event;
+
+    if (!s_FlightRecorder.enabled)
+        return;
+
+    entry = AllocateFlightEntry(FlightEventEntry);
+    if (!entry)
+        return;
+
+    event = (FlightEvent*)entry->data;
+    event->name = Name;
+    event->arg1 = Arg1;
+    event->arg2 = Arg2;
+
+    entry->header.level = TraceLevel;
+    entry->header.color = PrintColors::Default;
+    entry->header.size = sizeof(FlightEvent);
+
+    CommitFlightEntry();
+}
+
+// =============================================
+
+// A dump can be produced in an exception handler, therefore the formatting
+// doesn't allocate memory and doesn't use the CRT
+
+static size_t AppendText(char* Output, size_t Offset, size_t Limit, const char* Text, size_t Length)
+{
+    if (Offset + Length > Limit)
+        Length = Limit - Offset;
+
+    memcpy(Output + Offset, Text, Length);
+    return Offset + Length;
+}
+
+static size_t AppendHex(char* Output, size_t Offset, size_t Limit, unsigned long long Value)
+{
+    static const char s_digits[] = "0123456789abcdef";
+    char buffer[18];
+    size_t i = sizeof(buffer);
+
+    do
+    {
+        buffer[--i] = s_digits[Value & 0xF];
+        Value >>= 4;
+    }
+    while (Value);
+
+    buffer[--i] = 'x';
+    buffer[--i] = '0';
+
+    return AppendText(Output, Offset, Limit, buffer + i, sizeof(buffer) - i);
+}
+
+static size_t FormatFlightEvent(const FlightEvent* Event, char* Output, size_t Limit)
+{
+    size_t offset = 0;
+
+    offset = AppendText(Output, offset, Limit, "event ", 6);
+    offset = AppendText(Output, offset, Limit, Event->name, strlen(Event->name));
+    offset = AppendText(Output, offset, Limit, " ", 1);
+    offset = AppendHex(Output, offset, Limit, Event->arg1);
+    offset = AppendText(Output, offset, Limit, " ", 1);
+    offset = AppendHex(Output, offset, Limit, Event->arg2);
+    offset = AppendText(Output, offset, Limit, "\n", 1);
+
+    return offset;
+}
+
+static size_t BuildFlightDump(char* Output, size_t OutputSize)
+{
+    LogSegmentHeader* header = (LogSegmentHeader*)Output;
+    size_t offset = sizeof(LogSegmentHeader);
+    long segmentsCount = min(s_FlightRecorder.segmentsCount, (long)MaxFlightSegments);
+    long i;
+
+    header->signature = LOG_SEGMENT_SIGNATURE;
+    header->version = LOG_SEGMENT_VERSION;
+    header->sequence = 0;
+    header->headerSize = sizeof(LogSegmentHeader);
+    header->reserved = 0;
+    ::GetSystemTimeAsFileTime((LPFILETIME)&header->createTime);
+
+    for (i = 0; i < segmentsCount; i++)
+    {
+        FlightSegment* segment = &s_FlightRecorder.segments[i];
+        unsigned long long head = segment->head;
+        unsigned long long first = (head > s_FlightRecorder.entriesPerThread ? head - s_FlightRecorder.entriesPerThread : 0);
+        unsigned long long j;
+
+        for (j = first; j < head; j++)
+        {
+            FlightEntry* entry = &segment->entries[j % s_FlightRecorder.entriesPerThread];
+            LogRecordHeader* record = (LogRecordHeader*)(Output + offset);
+            char* payload = (char*)(record + 1);
+            size_t size;
+
+            if (offset + GetLogRecordSize(sizeof(entry->data) * 2) > OutputSize)
+                return offset;
+
+            if (entry->header.type == FlightEventEntry)
+            {
+                size = FormatFlightEvent((FlightEvent*)entry->data, payload, sizeof(entry->data) * 2);
+            }
+            else
+            {
+                size = min((size_t)entry->header.size, sizeof(entry->data));
+                memcpy(payload, entry->data, size);
+            }
+
+            if (!size)
+                continue;
+
+            record->size = (unsigned int)size;
+            record->thread = entry->header.thread;
+            record->timestamp = ConvertTimestampCounterToFileTime(entry->header.counter);
+            record->level = entry->header.level;
+            record->color = entry->header.color;
+            record->reserved = 0;
+
+            offset += GetLogRecordSize(size);
+        }
+    }
+
+    return offset;
+}
+
+bool DumpFlightRecorder()
+{
+    HANDLE file;
+    size_t size;
+    DWORD written;
+    bool result;
+
+    if (!s_FlightRecorder.enabled)
+        return false;
+
+    // A crash can happen while another thread is dumping, the second dump is skipped.
+    // After the release the flag stays taken, buffers of the dump are freed.
+    if (::InterlockedCompareExchange(&s_FlightRecorder.dumping, 1, 0) != 0)
+        return false;
+
+    memset(s_FlightRecorder.dumpBuffer, 0, s_FlightRecorder.dumpBufferSize);
+    size = BuildFlightDump(s_FlightRecorder.dumpBuffer, s_FlightRecorder.dumpBufferSize);
+
+    file = ::CreateFileW(s_FlightRecorder.dumpPath, GENERIC_WRITE, FILE_SHARE_READ, NULL, CREATE_ALWAYS, 0, NULL);
+    result = (file != INVALID_HANDLE_VALUE);
+    if (result)
+    {
+        result = (::WriteFile(file, s_FlightRecorder.dumpBuffer, (DWORD)size, &written, NULL) && written == size);
+        ::CloseHandle(file);
+    }
+
+    ::InterlockedExchange(&s_FlightRecorder.dumping, 0);
+
+    return result;
+}
+
+// =============================================
+
+static LONG WINAPI FlightRecorderExceptionFilter(PEXCEPTION_POINTERS Exception)
+{
+    RecordFlightEvent("unhandled_exception", Exception->ExceptionRecord->ExceptionCode, (unsigned long long)Exception->ExceptionRecord->ExceptionAddress);
+    DumpFlightRecorder();
+
+    if (s_FlightRecorder.previousFilter)
+        return s_FlightRecorder.previousFilter(Exception);
+
+    return EXCEPTION_CONTINUE_SEARCH;
+}
+
+static void __cdecl FlightRecorderAbortHandler(int Signal)
+{
+    RecordFlightEvent("abort", Signal);
+    DumpFlightRecorder();
+}
+
+static BOOL WINAPI FlightRecorderCtrlHandler(DWORD CtrlType)
+{
+    if (CtrlType != CTRL_BREAK_EVENT)
+        return FALSE;
+
+    DumpFlightRecorder();
+    return TRUE;
+}
+
+bool InitFlightRecorder(const wchar_t* DumpPath, unsigned int EntriesPerThread)
+{
+    FlightEntry* entries;
+    size_t entriesSize;
+    DWORD flsIndex;
+    long i;
+
+    if (s_FlightRecorder.enabled || !EntriesPerThread)
+        return false;
+
+    // Segments of a previous initialization are kept, see ReleaseFlightRecorder()
+    if (s_FlightRecorder.entries && s_FlightRecorder.entriesPerThread != EntriesPerThread)
+        return false;
+
+    s_FlightRecorder.dumpPath = BuildWideString(DumpPath, NULL);
+    if (!s_FlightRecorder.dumpPath)
+        goto ReleaseBlock;
+
+    if (!s_FlightRecorder.entries)
+    {
+        // Segments of exited threads return to the recorder and are reused
+        flsIndex = ::FlsAlloc(ReleaseFlightSegment);
+        if (flsIndex == FLS_OUT_OF_INDEXES)
+            goto ReleaseBlock;
+
+        // All memory is committed at once, so recording never allocates. Committed pages
+        // are still demand-zero and fault on the first touch, the entries are touched
+        // here to take these faults out of the hot path. A page trimmed from the working
+        // set later can fault again, it's a soft fault though.
+
+        entriesSize = (size_t)EntriesPerThread * MaxFlightSegments * sizeof(FlightEntry);
+
+        entries = (FlightEntry*)::VirtualAlloc(NULL, entriesSize, MEM_COMMIT, PAGE_READWRITE);
+        if (!entries)
+        {
+            ::FlsFree(flsIndex);
+            goto ReleaseBlock;
+        }
+
+        memset(entries, 0, entriesSize);
+
+        for (i = 0; i < MaxFlightSegments; i++)
+            s_FlightRecorder.segments[i].entries = entries + (size_t)EntriesPerThread * i;
+
+        s_FlightRecorder.flsIndex = flsIndex;
+        s_FlightRecorder.entriesPerThread = EntriesPerThread;
+        s_FlightRecorder.entries = entries;
+    }
+
+    // An event is rendered as text and can take up to two entries of data in a dump
+    s_FlightRecorder.dumpBufferSize = sizeof(LogSegmentHeader) +
+        (size_t)EntriesPerThread * MaxFlightSegments * GetLogRecordSize(sizeof(((FlightEntry*)0)->data) * 2);
+
+    s_FlightRecorder.dumpBuffer = (char*)::VirtualAlloc(NULL, s_FlightRecorder.dumpBufferSize, MEM_COMMIT, PAGE_READWRITE);
+    if (!s_FlightRecorder.dumpBuffer)
+        goto ReleaseBlock;
+
+    CalibrateTimestampCounter();
+
+    s_FlightRecorder.previousFilter = ::SetUnhandledExceptionFilter(FlightRecorderExceptionFilter);
+    signal(SIGABRT, FlightRecorderAbortHandler);
+    ::SetConsoleCtrlHandler(FlightRecorderCtrlHandler, TRUE);
+
+    ::InterlockedExchange(&s_FlightRecorder.dumping, 0);
+    s_FlightRecorder.enabled = true;
+    return true;
+
+ReleaseBlock:
+
+    ReleaseFlightRecorder();
+    return false;
+}
+
+void ReleaseFlightRecorder()
+{
+    if (s_FlightRecorder.enabled)
+    {
+        s_FlightRecorder.enabled = false;
+
+        ::SetUnhandledExceptionFilter(s_FlightRecorder.previousFilter);
+        signal(SIGABRT, SIG_DFL);
+        ::SetConsoleCtrlHandler(FlightRecorderCtrlHandler, FALSE);
+    }
+
+    // A writer checks the flag without a lock and can still be writing to its
+    // segment, therefore the entries and the FLS index live until the process
+    // exit. A dump in progress is waited for instead, no dump starts after that.
+    while (::InterlockedCompareExchange(&s_FlightRecorder.dumping, 2, 0) == 1)
+        ::Sleep(1);
+
+    if (s_FlightRecorder.dumpBuffer)
+        ::VirtualFree(s_FlightRecorder.dumpBuffer, 0, MEM_RELEASE);
+
+    if (s_FlightRecorder.dumpPath)
+        FreeWideString(s_FlightRecorder.dumpPath);
+
+    s_FlightRecorder.dumpBuffer = NULL;
+    s_FlightRecorder.dumpPath = NULL;
+}
@@ -0,0 +1,28 @@
+#pragma once
+
+#include "ConsolePrinter.h"
+
+// =============================================
+//  Flight recorder
+//
+//  Always-on in-memory history of recent messages and hot-path events. Every
+//  thread writes to its own fixed-size segment without locks, the oldest
+//  entries are overwritten. There are 64 segments, a segment of an exited
+//  thread is handed to the next new thread. The history is dumped to a file in the binary log
+//  format (see LogFormat.h, LogViewer can decode it) on an unhandled exception,
+//  on abort() and on Ctrl+Break.
+
+bool InitFlightRecorder(const wchar_t* DumpPath, unsigned int EntriesPerThread = 512);
+
+// Stops recording and dumps. Segments live until the process exit, a later
+// initialization continues them and should use the same EntriesPerThread.
+void ReleaseFlightRecorder();
+
+bool IsFlightRecorderEnabled();
+
+void RecordFlightMessage(PrintLevels Level, PrintColors Color, const char* Message, size_t MessageSize);
+
+// Name should be a string literal, only a pointer to it is stored
+void RecordFlightEvent(const char* Name, unsigned long long Arg1 = 0, unsigned long long Arg2 = 0);
+
+bool DumpFlightRecorder();
@@ -0,0 +1,232 @@
+#include "FormatPrinter.h"
+#include <stdlib.h>
+#include <string.h>
+#include <wchar.h>
+
+// =============================================
+
+FormatBuffer::FormatBuffer() :
+    m_buffer(m_inline),
+    m_size(0),
+    m_capacity(sizeof(m_inline)),
+    m_failed(false)
+{
+}
+
+FormatBuffer::~FormatBuffer()
+{
+    if (m_buffer != m_inline)
+        free(m_buffer);
+}
+
+bool FormatBuffer::Grow(size_t Size)
+{
+    size_t capacity = m_capacity * 2;
+    char* buffer;
+
+    if (m_failed)
+        return false;
+
+    while (capacity < m_size + Size)
+        capacity *= 2;
+
+    if (m_buffer == m_inline)
+    {
+        buffer = (char*)malloc(capacity);
+        if (buffer)
+            memcpy(buffer, m_inline, m_size);
+    }
+    else
+    {
+        buffer = (char*)realloc(m_buffer, capacity);
+    }
+
+    if (!buffer)
+    {
+        m_failed = true;
+        return false;
+    }
+
+    m_buffer = buffer;
+    m_capacity = capacity;
+    return true;
+}
+
+char* FormatBuffer::Reserve(size_t Size)
+{
+    if (m_size + Size > m_capacity && !Grow(Size))
+        return NULL;
+
+    return m_buffer + m_size;
+}
+
+void FormatBuffer::Commit(size_t Size)
+{
+    m_size += Size;
+}
+
+void FormatBuffer::Append(const char* Data, size_t Size)
+{
+    char* output = Reserve(Size);
+    if (!output)
+        return;
+
+    memcpy(output, Data, Size);
+    Commit(Size);
+}
+
+// =============================================
+
+static void FormatUnsigned(FormatBuffer& Buffer, unsigned long long Value, bool Negative)
+{
+    char digits[24];
+    size_t i = sizeof(digits);
+
+    do
+    {
+        digits[--i] = (char)('0' + (Value % 10));
+        Value /= 10;
+    }
+    while (Value);
+
+    if (Negative)
+        digits[--i] = '-';
+
+    Buffer.Append(digits + i, sizeof(digits) - i);
+}
+
+static void FormatSigned(FormatBuffer& Buffer, long long Value)
+{
+    if (Value < 0)
+        FormatUnsigned(Buffer, 0ull - (unsigned long long)Value, true);
+    else
+        FormatUnsigned(Buffer, (unsigned long long)Value, false);
+}
+
+static void FormatWide(FormatBuffer& Buffer, const wchar_t* Value, size_t Length)
+{
+    // The worst case for UTF-16 to UTF-8 conversion is 3 bytes per code unit
+    char* output = Buffer.Reserve(Length * 3);
+    size_t size = 0;
+    size_t i;
+
+    if (!output)
+        return;
+
+    for (i = 0; i < Length; i++)
+    {
+        unsigned int chr = Value[i];
+
+        if (chr < 0x80)
+        {
+            output[size++] = (char)chr;
+        }
+        else if (chr < 0x800)
+        {
+            output[size++] = (char)(0xC0 | (chr >> 6));
+            output[size++] = (char)(0x80 | (chr & 0x3F));
+        }
+        else if (chr >= 0xD800 && chr < 0xDC00 && i + 1 < Length && Value[i + 1] >= 0xDC00 && Value[i + 1] < 0xE000)
+        {
+            // A surrogate pair takes 4 bytes in UTF-8, it fits to the space reserved for two code units
+            chr = 0x10000 + ((chr - 0xD800) << 10) + (Value[++i] - 0xDC00);
+            output[size++] = (char)(0xF0 | (chr >> 18));
+            output[size++] = (char)(0x80 | ((chr >> 12) & 0x3F));
+            output[size++] = (char)(0x80 | ((chr >> 6) & 0x3F));
+            output[size++] = (char)(0x80 | (chr & 0x3F));
+        }
+        else
+        {
+            if (chr >= 0xD800 && chr < 0xE000)
+                chr = 0xFFFD; // Unpaired surrogate
+
+            output[size++] = (char)(0xE0 | (chr >> 12));
+            output[size++] = (char)(0x80 | ((chr >> 6) & 0x3F));
+            output[size++] = (char)(0x80 | (chr & 0x3F));
+        }
+    }
+
+    Buffer.Commit(size);
+}
+
+void FormatArg(FormatBuffer& Buffer, int Value)
+{
+    FormatSigned(Buffer, Value);
+}
+
+void FormatArg(FormatBuffer& Buffer, unsigned int Value)
+{
+    FormatUnsigned(Buffer, Value, false);
+}
+
+void FormatArg(FormatBuffer& Buffer, long Value)
+{
+    FormatSigned(Buffer, Value);
+}
+
+void FormatArg(FormatBuffer& Buffer, unsigned long Value)
+{
+    FormatUnsigned(Buffer, Value, false);
+}
+
+void FormatArg(FormatBuffer& Buffer, long long Value)
+{
+    FormatSigned(Buffer, Value);
+}
+
+void FormatArg(FormatBuffer& Buffer, unsigned long long Value)
+{
+    FormatUnsigned(Buffer, Value, false);
+}
+
+void FormatArg(FormatBuffer& Buffer, const char* Value)
+{
+    if (!Value)
+        Value = "(null)";
+
+    Buffer.Append(Value, strlen(Value));
+}
+
+void FormatArg(FormatBuffer& Buffer, char* Value)
+{
+    FormatArg(Buffer, (const char*)Value);
+}
+
+void FormatArg(FormatBuffer& Buffer, const wchar_t* Value)
+{
+    if (!Value)
+        Value = L"(null)";
+
+    FormatWide(Buffer, Value, wcslen(Value));
+}
+
+void FormatArg(FormatBuffer& Buffer, wchar_t* Value)
+{
+    FormatArg(Buffer, (const wchar_t*)Value);
+}
+
+void FormatArg(FormatBuffer& Buffer, const FormatPath& Value)
+{
+    FormatWide(Buffer, Value.path, Value.length);
+}
+
+// =============================================
+
+const char* FormatDetail::EmitLiteral(FormatBuffer& Buffer, const char* Format)
+{
+    const char* literal = Format;
+
+    while (*Format)
+    {
+        if (Format[0] == '{' && Format[1] == '}')
+        {
+            Buffer.Append(literal, Format - literal);
+            return Format + 2;
+        }
+
+        Format++;
+    }
+
+    Buffer.Append(literal, Format - literal);
+    return NULL;
+}
@@ -0,0 +1,154 @@
+#pragma once
+
+#include "ConsolePrinter.h"
+#include <crtdbg.h>
+
+// =============================================
+//  Type-safe message formatting
+//
+//  PrintFmt(PrintColors::Green, "File backuped: {}\n", path);
+//
+//  Every "{}" in a format string is replaced by the next argument. Arguments
+//  are dispatched to FormatArg() overloads at compile time, a call with an
+//  unsupported argument type doesn't compile. A message is rendered directly
+//  to UTF-8 without vswprintf and a format string is never copied.
+
+class FormatBuffer
+{
+public:
+
+    FormatBuffer();
+    ~FormatBuffer();
+
+    void Append(const char* Data, size_t Size);
+    char* Reserve(size_t Size);
+    void Commit(size_t Size);
+
+    const char* GetData() const { return m_buffer; }
+    size_t GetSize() const { return m_size; }
+    bool IsFailed() const { return m_failed; }
+
+private:
+
+    FormatBuffer(const FormatBuffer&);
+    FormatBuffer& operator=(const FormatBuffer&);
+
+    bool Grow(size_t Size);
+
+    char*  m_buffer;
+    size_t m_size;
+    size_t m_capacity;
+    bool   m_failed;
+    char   m_inline[256];
+};
+
+// Path or string with a known length, it doesn't require a null terminator
+struct FormatPath
+{
+    FormatPath(const wchar_t* Path, size_t Length) : path(Path), length(Length) {}
+
+    const wchar_t* path;
+    size_t length;
+};
+
+void FormatArg(FormatBuffer& Buffer, int Value);
+void FormatArg(FormatBuffer& Buffer, unsigned int Value);
+void FormatArg(FormatBuffer& Buffer, long Value);
+void FormatArg(FormatBuffer& Buffer, unsigned long Value);
+void FormatArg(FormatBuffer& Buffer, long long Value);
+void FormatArg(FormatBuffer& Buffer, unsigned long long Value);
+void FormatArg(FormatBuffer& Buffer, const char* Value);
+void FormatArg(FormatBuffer& Buffer, char* Value);
+void FormatArg(FormatBuffer& Buffer, const wchar_t* Value);
+void FormatArg(FormatBuffer& Buffer, wchar_t* Value);
+void FormatArg(FormatBuffer& Buffer, const FormatPath& Value);
+
+// Any other type isn't supported by the formatter
+template<typename T>
+void FormatArg(FormatBuffer& Buffer, T Value) = delete;
+
+namespace FormatDetail
+{
+    // Copies a literal part of a format string and returns a pointer after
+    // the next placeholder or NULL if the format string is over
+    const char* EmitLiteral(FormatBuffer& Buffer, const char* Format);
+
+    inline void FormatArgs(FormatBuffer& Buffer, const char* Format)
+    {
+        Format = EmitLiteral(Buffer, Format);
+        _ASSERT(!Format); // Too few arguments
+    }
+
+    template<typename T, typename... Rest>
+    void FormatArgs(FormatBuffer& Buffer, const char* Format, T Value, Rest... Others)
+    {
+        Format = EmitLiteral(Buffer, Format);
+        _ASSERT(Format); // Too many arguments
+        if (!Format)
+            return;
+
+        FormatArg(Buffer, Value);
+        FormatArgs(Buffer, Format, Others...);
+    }
+}
+
+template<typename... Args>
+void FormatMsg(FormatBuffer& Buffer, const char* Format, Args... Arguments)
+{
+    FormatDetail::FormatArgs(Buffer, Format, Arguments...);
+}
+
+template<typename... Args>
+void PrintLevelFmt(PrintLevels Level, PrintColors Color, const char* Format, Args... Arguments)
+{
+    FormatBuffer buffer;
+
+    FormatDetail::FormatArgs(buffer, Format, Arguments...);
+
+    if (!buffer.IsFailed())
+        PrintRawMsg(Level, Color, buffer.GetData(), buffer.GetSize());
+}
+
+template<typename... Args>
+void PrintFmt(PrintColors Color, const char* Format, Args... Arguments)
+{
+    PrintLevelFmt(InfoLevel, Color, Format, Arguments...);
+}
+
+template<typename... Args>
+void PrintFmtEx(ConsoleInstance Context, PrintColors Color, const char* Format, Args... Arguments)
+{
+    FormatBuffer buffer;
+
+    FormatDetail::FormatArgs(buffer, Format, Arguments...);
+
+    if (!buffer.IsFailed())
+        PrintRawMsgEx(Context, InfoLevel, Color, buffer.GetData(), buffer.GetSize());
+}
+
+// =============================================
+//  Filtered printing
+
+#define PRINT_LEVEL(Level, Color, Format, ...) \
+    do \
+    { \
+        if (IsPrintLevelEnabled(Level)) \
+            PrintLevelFmt(Level, Color, Format, __VA_ARGS__); \
+    } \
+    while (0)
+
+// Prints not more than Rate messages per second from a call site (with a burst
+// of Burst messages), dropped messages are reported with the next printed one
+#define PRINT_RATE_LIMITED(Level, Rate, Burst, Color, Format, ...) \
+    do \
+    { \
+        static PrintRateLimit rateLimit_ = PRINT_RATE_LIMIT_INIT(Rate, Burst); \
+        unsigned long suppressed_; \
+        if (IsPrintLevelEnabled(Level) && AcquirePrintRateLimit(&rateLimit_, &suppressed_)) \
+        { \
+            if (suppressed_) \
+                PrintLevelFmt(Level, PrintColors::Gray, "{} messages suppressed\n", suppressed_); \
+            PrintLevelFmt(Level, Color, Format, __VA_ARGS__); \
+        } \
+    } \
+    while (0)
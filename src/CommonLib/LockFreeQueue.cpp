@@ -0,0 +1,152 @@
+#include "LockFreeQueue.h"
+#include <stdlib.h>
+#include <string.h>
+#include <malloc.h>
+
+// =============================================
+
+struct LockFreeQueueCell
+{
+    volatile long sequence;
+    void*         item;
+};
+
+// The head and the tail are placed on separate cache lines, producers and
+// consumers don't disturb each other
+struct LockFreeQueueContext
+{
+    __declspec(align(64)) volatile long head; // next cell to push
+    __declspec(align(64)) volatile long tail; // next cell to pop
+    __declspec(align(64)) LockFreeQueueCell* cells;
+    unsigned long mask;
+};
+
+// =============================================
+
+void* CreateLockFreeQueue(unsigned int Capacity)
+{
+    LockFreeQueueContext* queue;
+    unsigned long capacity = 2;
+    unsigned long i;
+
+    while (capacity < Capacity)
+        capacity <<= 1;
+
+    queue = (LockFreeQueueContext*)_aligned_malloc(sizeof(LockFreeQueueContext), __alignof(LockFreeQueueContext));
+    if (!queue)
+        return NULL;
+
+    memset(queue, 0, sizeof(LockFreeQueueContext));
+
+    queue->cells = (LockFreeQueueCell*)malloc(sizeof(LockFreeQueueCell) * capacity);
+    if (!queue->cells)
+    {
+        _aligned_free(queue);
+        return NULL;
+    }
+
+    for (i = 0; i < capacity; i++)
+    {
+        queue->cells[i].sequence = (long)i;
+        queue->cells[i].item = NULL;
+    }
+
+    queue->mask = capacity - 1;
+
+    return queue;
+}
+
+void DestroyLockFreeQueue(void* Queue)
+{
+    LockFreeQueueContext* queue = (LockFreeQueueContext*)Queue;
+
+    free(queue->cells);
+    _aligned_free(queue);
+}
+
+// Positions only grow, a difference of a sequence and a position is computed
+// in signed arithmetic therefore a wrap-around doesn't break comparisons
+
+bool PushToLockFreeQueue(void* Queue, void* Item)
+{
+    LockFreeQueueContext* queue = (LockFreeQueueContext*)Queue;
+    LockFreeQueueCell* cell;
+    long position = queue->head;
+
+    while (true)
+    {
+        long difference;
+
+        cell = queue->cells + (position & queue->mask);
+        difference = cell->sequence - position;
+
+        if (difference == 0)
+        {
+            long current = ::InterlockedCompareExchange(&queue->head, position + 1, position);
+            if (current == position)
+                break;
+
+            position = current;
+        }
+        else if (difference < 0)
+        {
+            // The cell still keeps an item of the previous lap
+            return false;
+        }
+        else
+        {
+            position = queue->head;
+        }
+    }
+
+    cell->item = Item;
+    ::InterlockedExchange(&cell->sequence, position + 1);
+
+    return true;
+}
+
+bool PopFromLockFreeQueue(void* Queue, void** Item)
+{
+    LockFreeQueueContext* queue = (LockFreeQueueContext*)Queue;
+    LockFreeQueueCell* cell;
+    long position = queue->tail;
+
+    while (true)
+    {
+        long difference;
+
+        cell = queue->cells + (position & queue->mask);
+        difference = cell->sequence - (position + 1);
+
+        if (difference == 0)
+        {
+            long current = ::InterlockedCompareExchange(&queue->tail, position + 1, position);
+            if (current == position)
+                break;
+
+            position = current;
+        }
+        else if (difference < 0)
+        {
+            // Empty or the producer hasn't published the cell yet
+            return false;
+        }
+        else
+        {
+            position = queue->tail;
+        }
+    }
+
+    *Item = cell->item;
+    ::InterlockedExchange(&cell->sequence, position + (long)queue->mask + 1);
+
+    return true;
+}
+
+unsigned int GetLockFreeQueueDepth(void* Queue)
+{
+    LockFreeQueueContext* queue = (LockFreeQueueContext*)Queue;
+    long depth = queue->head - queue->tail;
+
+    return (depth > 0 ? (unsigned int)depth : 0);
+}
@@ -0,0 +1,27 @@
+#pragma once
+
+#include <Windows.h>
+
+// =============================================
+//  Bounded lock-free queue
+//
+//  Multi-producer multi-consumer ring of pointers. Every cell keeps a
+//  sequence number which tells whether the cell is free for the producer of
+//  the current lap or published for its consumer, so a push and a pop take a
+//  single interlocked operation on the head or the tail and never wait for
+//  each other. The queue doesn't block: a push to a full queue and a pop from
+//  an empty one fail immediately.
+//
+//  A pop may fail while another producer has claimed a cell but hasn't
+//  published it yet, a consumer which knows that an item is coming should
+//  retry.
+
+// Capacity is rounded up to a power of two
+void* CreateLockFreeQueue(unsigned int Capacity);
+void DestroyLockFreeQueue(void* Queue);
+
+bool PushToLockFreeQueue(void* Queue, void* Item);
+bool PopFromLockFreeQueue(void* Queue, void** Item);
+
+// Approximate amount of items, it's stale as soon as it's returned
+unsigned int GetLockFreeQueueDepth(void* Queue);
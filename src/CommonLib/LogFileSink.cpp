@@ -0,0 +1,243 @@
+#include "LogFileSink.h"
+#include "CommonLib.h"
+#include <Windows.h>
+#include <stdio.h>
+#include <wchar.h>
+
+struct LogFileSinkContext
+{
+    wchar_t*           directory;
+    wchar_t*           prefix;
+    size_t             segmentSize;
+    unsigned int       maxSegments;
+    unsigned long long sequence;
+    HANDLE             file;
+    HANDLE             mapping;
+    char*              view;
+    size_t             offset;
+};
+
+// =============================================
+
+static wchar_t* BuildSegmentPath(LogFileSinkContext* Context, unsigned long long Sequence)
+{
+    wchar_t postfix[32];
+
+    swprintf_s(postfix, L"_%06llu", Sequence);
+
+    return BuildWideString(Context->directory, L"\\", Context->prefix, postfix, LOG_SEGMENT_EXTENSION, NULL);
+}
+
+static unsigned long long FindNextSegmentSequence(LogFileSinkContext* Context)
+{
+    WIN32_FIND_DATAW data;
+    unsigned long long next = 0;
+    size_t prefixLength = wcslen(Context->prefix);
+    wchar_t* mask;
+    HANDLE find;
+
+    mask = BuildWideString(Context->directory, L"\\", Context->prefix, L"_*", LOG_SEGMENT_EXTENSION, NULL);
+    if (!mask)
+        return 0;
+
+    find = ::FindFirstFileW(mask, &data);
+    if (find != INVALID_HANDLE_VALUE)
+    {
+        do
+        {
+            unsigned long long sequence = _wcstoui64(data.cFileName + prefixLength + 1, NULL, 10);
+            if (sequence >= next)
+                next = sequence + 1;
+        }
+        while (::FindNextFileW(find, &data));
+
+        ::FindClose(find);
+    }
+
+    FreeWideString(mask);
+
+    return next;
+}
+
+static void CloseSegment(LogFileSinkContext* Context)
+{
+    if (Context->view)
+        ::UnmapViewOfFile(Context->view);
+
+    if (Context->mapping)
+        ::CloseHandle(Context->mapping);
+
+    if (Context->file != INVALID_HANDLE_VALUE)
+        ::CloseHandle(Context->file);
+
+    Context->view = NULL;
+    Context->mapping = NULL;
+    Context->file = INVALID_HANDLE_VALUE;
+    Context->offset = 0;
+}
+
+static void RemoveOutdatedSegment(LogFileSinkContext* Context)
+{
+    wchar_t* path;
+
+    if (Context->sequence < Context->maxSegments)
+        return;
+
+    path = BuildSegmentPath(Context, Context->sequence - Context->maxSegments);
+    if (!path)
+        return;
+
+    ::DeleteFileW(path);
+    FreeWideString(path);
+}
+
+static bool OpenSegment(LogFileSinkContext* Context)
+{
+    LogSegmentHeader* header;
+    ULARGE_INTEGER size;
+    wchar_t* path;
+    bool result = false;
+
+    path = BuildSegmentPath(Context, Context->sequence);
+    if (!path)
+        return false;
+
+    Context->file = ::CreateFileW(path, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, NULL, CREATE_ALWAYS, 0, NULL);
+    if (Context->file == INVALID_HANDLE_VALUE)
+        goto ReleaseBlock;
+
+    // A mapping extends the file to the full segment size, the tail is filled with zeros
+
+    size.QuadPart = Context->segmentSize;
+
+    Context->mapping = ::CreateFileMappingW(Context->file, NULL, PAGE_READWRITE, size.HighPart, size.LowPart, NULL);
+    if (!Context->mapping)
+        goto ReleaseBlock;
+
+    Context->view = (char*)::MapViewOfFile(Context->mapping, FILE_MAP_WRITE, 0, 0, Context->segmentSize);
+    if (!Context->view)
+        goto ReleaseBlock;
+
+    header = (LogSegmentHeader*)Context->view;
+    header->signature = LOG_SEGMENT_SIGNATURE;
+    header->version = LOG_SEGMENT_VERSION;
+    header->sequence = Context->sequence;
+    header->headerSize = sizeof(LogSegmentHeader);
+    header->reserved = 0;
+    ::GetSystemTimeAsFileTime((LPFILETIME)&header->createTime);
+
+    Context->offset = sizeof(LogSegmentHeader);
+
+    RemoveOutdatedSegment(Context);
+
+    Context->sequence++;
+    result = true;
+
+ReleaseBlock:
+
+    if (!result)
+        CloseSegment(Context);
+
+    FreeWideString(path);
+
+    return result;
+}
+
+// =============================================
+
+void* CreateLogFileSink(const wchar_t* Directory, const wchar_t* Prefix, size_t SegmentSize, unsigned int MaxSegments)
+{
+    LogFileSinkContext* context;
+    bool result = false;
+
+    if (SegmentSize <= sizeof(LogSegmentHeader) || !MaxSegments)
+        return NULL;
+
+    context = (LogFileSinkContext*)malloc(sizeof(LogFileSinkContext));
+    if (!context)
+        return NULL;
+
+    memset(context, 0, sizeof(LogFileSinkContext));
+    context->file = INVALID_HANDLE_VALUE;
+    context->segmentSize = AlignToTop(SegmentSize, 0x10000);
+    context->maxSegments = MaxSegments;
+
+    context->directory = BuildWideString(Directory, NULL);
+    if (!context->directory)
+        goto ReleaseBlock;
+
+    context->prefix = BuildWideString(Prefix, NULL);
+    if (!context->prefix)
+        goto ReleaseBlock;
+
+    if (!CreateDirectoryByFullPath(context->directory))
+        goto ReleaseBlock;
+
+    context->sequence = FindNextSegmentSequence(context);
+
+    if (!OpenSegment(context))
+        goto ReleaseBlock;
+
+    result = true;
+
+ReleaseBlock:
+
+    if (!result)
+    {
+        DestroyLogFileSink(context);
+        context = NULL;
+    }
+
+    return context;
+}
+
+void DestroyLogFileSink(void* Sink)
+{
+    LogFileSinkContext* context = (LogFileSinkContext*)Sink;
+
+    CloseSegment(context);
+
+    if (context->directory)
+        FreeWideString(context->directory);
+
+    if (context->prefix)
+        FreeWideString(context->prefix);
+
+    free(context);
+}
+
+bool WriteLogFileRecord(void* Sink, const LogRecordHeader* Header, const void* Payload)
+{
+    LogFileSinkContext* context = (LogFileSinkContext*)Sink;
+    size_t recordSize = GetLogRecordSize(Header->size);
+    LogRecordHeader* record;
+
+    if (recordSize > context->segmentSize - sizeof(LogSegmentHeader))
+        return false;
+
+    // Rotate a segment if the record doesn't fit, a zeroed tail marks the end of data
+    if (!context->view || context->offset + recordSize > context->segmentSize)
+    {
+        CloseSegment(context);
+
+        if (!OpenSegment(context))
+            return false;
+    }
+
+    record = (LogRecordHeader*)(context->view + context->offset);
+
+    memcpy(record + 1, Payload, Header->size);
+
+    // The size is published last, so a reader of a live segment never sees a partial record
+    record->thread = Header->thread;
+    record->timestamp = Header->timestamp;
+    record->level = Header->level;
+    record->color = Header->color;
+    record->reserved = 0;
+    ::MemoryBarrier();
+    record->size = Header->size;
+
+    context->offset += recordSize;
+
+    return true;
+}
@@ -0,0 +1,12 @@
+#pragma once
+
+#include "LogFormat.h"
+
+// Writes log records to preallocated memory-mapped segment files
+// <Directory>\<Prefix>_<sequence>.blog, a new segment is started when the current
+// one is full and the oldest segment is removed when MaxSegments is exceeded
+
+void* CreateLogFileSink(const wchar_t* Directory, const wchar_t* Prefix, size_t SegmentSize = 0x1000000, unsigned int MaxSegments = 8);
+void DestroyLogFileSink(void* Sink);
+
+bool WriteLogFileRecord(void* Sink, const LogRecordHeader* Header, const void* Payload);
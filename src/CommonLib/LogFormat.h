@@ -0,0 +1,44 @@
+#pragma once
+
+// =============================================
+//  Binary log segment format
+//
+//  A segment file starts with LogSegmentHeader followed by records. Each record
+//  is LogRecordHeader and a UTF-8 payload (without a null terminator) aligned to
+//  LOG_RECORD_ALIGNMENT. A segment is preallocated with zeros therefore a record
+//  with a zero size marks the end of data.
+
+#define LOG_SEGMENT_SIGNATURE  0x474F4C42 // 'BLOG'
+#define LOG_SEGMENT_VERSION    1
+#define LOG_SEGMENT_EXTENSION  L".blog"
+#define LOG_RECORD_ALIGNMENT   8
+
+#pragma pack(push, 1)
+
+struct LogSegmentHeader
+{
+    unsigned int       signature;
+    unsigned int       version;
+    unsigned long long sequence;
+    unsigned long long createTime; // FILETIME
+    unsigned int       headerSize;
+    unsigned int       reserved;
+};
+
+struct LogRecordHeader
+{
+    unsigned int       size;      // payload size
+    unsigned int       thread;
+    unsigned long long timestamp; // FILETIME
+    unsigned char      level;
+    unsigned char      color;
+    unsigned short     reserved;
+};
+
+#pragma pack(pop)
+
+inline size_t GetLogRecordSize(size_t PayloadSize)
+{
+    size_t size = sizeof(LogRecordHeader) + PayloadSize;
+    return (size + LOG_RECORD_ALIGNMENT - 1) & ~(size_t)(LOG_RECORD_ALIGNMENT - 1);
+}
@@ -0,0 +1,410 @@
+#include "Metrics.h"
+#include "FormatPrinter.h"
+#include <stdlib.h>
+#include <string.h>
+#include <malloc.h>
+#include <intrin.h>
+
+// Values below 2^40 are bucketed precisely, bigger ones go to the last bucket
+#define METRICS_MAX_EXPONENT  40
+#define METRICS_BUCKETS       (16 + (METRICS_MAX_EXPONENT - 4) * 16)
+
+// =============================================
+
+struct MetricHistogramData
+{
+    unsigned int*      buckets; // allocated on the first record of a thread
+    unsigned long long count;
+    unsigned long long sum;
+    unsigned long long max;
+};
+
+struct __declspec(align(64)) MetricsThreadBlock
+{
+    unsigned long long  counters[METRICS_MAX_COUNTERS];
+    MetricHistogramData histograms[METRICS_MAX_HISTOGRAMS];
+    MetricsThreadBlock* nextFree;
+};
+
+struct MetricDescriptor
+{
+    const char* name;
+    MetricUnits units;
+};
+
+static SpinAtom s_RegistryLock = 0;
+static MetricDescriptor s_Counters[METRICS_MAX_COUNTERS];
+static volatile long s_CountersCount = 0;
+static MetricDescriptor s_Histograms[METRICS_MAX_HISTOGRAMS];
+static volatile long s_HistogramsCount = 0;
+
+static MetricsThreadBlock* volatile s_Blocks[METRICS_MAX_THREADS];
+static volatile long s_BlocksCount = 0;
+static MetricsThreadBlock* s_FreeBlocks = NULL;
+static SpinAtom s_FreeBlocksLock = 0;
+static volatile DWORD s_BlockFlsIndex = FLS_OUT_OF_INDEXES;
+
+static _declspec(thread) MetricsThreadBlock* st_Block = NULL;
+static _declspec(thread) bool st_BlockFailed = false;
+
+// =============================================
+
+static unsigned int RegisterMetric(MetricDescriptor* Metrics, volatile long* Count, long MaxCount, const char* Name, MetricUnits Units)
+{
+    unsigned int id = INVALID_METRIC_ID;
+    long i;
+
+    AcquireSpinLock(&s_RegistryLock);
+
+    for (i = 0; i < *Count; i++)
+    {
+        if (strcmp(Metrics[i].name, Name) == 0)
+        {
+            id = (unsigned int)i;
+            break;
+        }
+    }
+
+    if (id == INVALID_METRIC_ID && *Count < MaxCount)
+    {
+        id = (unsigned int)*Count;
+        Metrics[id].name = Name;
+        Metrics[id].units = Units;
+        *Count = id + 1;
+    }
+
+    ReleaseSpinLock(&s_RegistryLock);
+
+    return id;
+}
+
+unsigned int RegisterMetricCounter(const char* Name)
+{
+    return RegisterMetric(s_Counters, &s_CountersCount, METRICS_MAX_COUNTERS, Name, MetricValue);
+}
+
+unsigned int RegisterMetricHistogram(const char* Name, MetricUnits Units)
+{
+    return RegisterMetric(s_Histograms, &s_HistogramsCount, METRICS_MAX_HISTOGRAMS, Name, Units);
+}
+
+// =============================================
+
+// Called on a thread exit, the block keeps its values and goes to the free
+// list, so totals don't drop and the next new thread continues the block
+static void WINAPI ReleaseThreadBlock(PVOID Data)
+{
+    MetricsThreadBlock* block = (MetricsThreadBlock*)Data;
+
+    if (!block)
+        return;
+
+    if (st_Block == block)
+        st_Block = NULL;
+
+    AcquireSpinLock(&s_FreeBlocksLock);
+    block->nextFree = s_FreeBlocks;
+    s_FreeBlocks = block;
+    ReleaseSpinLock(&s_FreeBlocksLock);
+}
+
+static DWORD GetThreadBlockFlsIndex()
+{
+    DWORD index = s_BlockFlsIndex;
+
+    if (index != FLS_OUT_OF_INDEXES)
+        return index;
+
+    // Metrics have no initialization, the first thread that needs a block allocates
+    // the index and a thread that lost the race frees its own one
+    index = ::FlsAlloc(ReleaseThreadBlock);
+    if (index == FLS_OUT_OF_INDEXES)
+        return index;
+
+    if (::InterlockedCompareExchange((volatile long*)&s_BlockFlsIndex, (long)index, (long)FLS_OUT_OF_INDEXES) != (long)FLS_OUT_OF_INDEXES)
+    {
+        ::FlsFree(index);
+        index = s_BlockFlsIndex;
+    }
+
+    return index;
+}
+
+static MetricsThreadBlock* AllocateThreadBlock()
+{
+    MetricsThreadBlock* block;
+    DWORD flsIndex;
+    long index;
+
+    if (st_BlockFailed)
+        return NULL;
+
+    AcquireSpinLock(&s_FreeBlocksLock);
+    block = s_FreeBlocks;
+    if (block)
+        s_FreeBlocks = block->nextFree;
+    ReleaseSpinLock(&s_FreeBlocksLock);
+
+    if (!block)
+    {
+        block = (MetricsThreadBlock*)_aligned_malloc(sizeof(MetricsThreadBlock), __alignof(MetricsThreadBlock));
+        if (!block)
+        {
+            st_BlockFailed = true;
+            return NULL;
+        }
+
+        memset(block, 0, sizeof(MetricsThreadBlock));
+
+        // Blocks are never freed, readers walk them without a lock
+        index = ::InterlockedIncrement(&s_BlocksCount) - 1;
+        if (index >= METRICS_MAX_THREADS)
+        {
+            _aligned_free(block);
+            st_BlockFailed = true;
+            return NULL;
+        }
+
+        s_Blocks[index] = block;
+    }
+
+    // Without the callback the block stays with the thread after it exits,
+    // it's still counted but never reused
+    flsIndex = GetThreadBlockFlsIndex();
+    if (flsIndex != FLS_OUT_OF_INDEXES)
+        ::FlsSetValue(flsIndex, block);
+
+    st_Block = block;
+    return block;
+}
+
+static inline MetricsThreadBlock* GetThreadBlock()
+{
+    MetricsThreadBlock* block = st_Block;
+
+    if (block)
+        return block;
+
+    return AllocateThreadBlock();
+}
+
+static inline unsigned int GetBucketIndex(unsigned long long Value)
+{
+    unsigned long exponent;
+
+    if (Value < 16)
+        return (unsigned int)Value;
+
+    if (Value >> METRICS_MAX_EXPONENT)
+        return METRICS_BUCKETS - 1;
+
+    // _BitScanReverse64 isn't available for x86
+    if (Value >> 32)
+    {
+        _BitScanReverse(&exponent, (unsigned long)(Value >> 32));
+        exponent += 32;
+    }
+    else
+    {
+        _BitScanReverse(&exponent, (unsigned long)Value);
+    }
+
+    return 16 + (exponent - 4) * 16 + (unsigned int)((Value >> (exponent - 4)) & 15);
+}
+
+// Returns the middle of a bucket range
+static unsigned long long GetBucketValue(unsigned int Index)
+{
+    unsigned int shift;
+
+    if (Index < 16)
+        return Index;
+
+    shift = (Index - 16) / 16;
+    return ((unsigned long long)(16 + (Index - 16) % 16) << shift) + ((1ull << shift) >> 1);
+}
+
+void AddMetricCounter(unsigned int Counter, unsigned long long Value)
+{
+    MetricsThreadBlock* block;
+
+    if (Counter >= METRICS_MAX_COUNTERS)
+        return;
+
+    block = GetThreadBlock();
+    if (!block)
+        return;
+
+    block->counters[Counter] += Value;
+}
+
+void RecordMetricHistogram(unsigned int Histogram, unsigned long long Value)
+{
+    MetricsThreadBlock* block;
+    MetricHistogramData* data;
+    unsigned int* buckets;
+
+    if (Histogram >= METRICS_MAX_HISTOGRAMS)
+        return;
+
+    block = GetThreadBlock();
+    if (!block)
+        return;
+
+    data = block->histograms + Histogram;
+
+    buckets = data->buckets;
+    if (!buckets)
+    {
+        buckets = (unsigned int*)calloc(METRICS_BUCKETS, sizeof(unsigned int));
+        if (!buckets)
+            return;
+
+        // Readers may see the buckets before the rest of data, it only makes a snapshot a bit stale
+        ::MemoryBarrier();
+        data->buckets = buckets;
+    }
+
+    buckets[GetBucketIndex(Value)]++;
+
+    data->count++;
+    data->sum += Value;
+
+    if (Value > data->max)
+        data->max = Value;
+}
+
+// =============================================
+
+static long GetBlocksCount()
+{
+    long count = s_BlocksCount;
+    return (count > METRICS_MAX_THREADS ? METRICS_MAX_THREADS : count);
+}
+
+unsigned long long GetMetricCounter(unsigned int Counter)
+{
+    unsigned long long total = 0;
+    long i, count = GetBlocksCount();
+
+    if (Counter >= (unsigned int)s_CountersCount)
+        return 0;
+
+    for (i = 0; i < count; i++)
+    {
+        MetricsThreadBlock* block = s_Blocks[i];
+        if (block)
+            total += block->counters[Counter];
+    }
+
+    return total;
+}
+
+static unsigned long long GetPercentile(const unsigned long long* Buckets, unsigned long long Count, unsigned int Permille)
+{
+    unsigned long long target = (Count * Permille + 999) / 1000;
+    unsigned long long accumulated = 0;
+    unsigned int i;
+
+    for (i = 0; i < METRICS_BUCKETS; i++)
+    {
+        accumulated += Buckets[i];
+        if (accumulated >= target && accumulated)
+            return GetBucketValue(i);
+    }
+
+    return 0;
+}
+
+static unsigned long long ConvertTicksToNanoseconds(unsigned long long Ticks)
+{
+    return (unsigned long long)((double)Ticks * 1000000000.0 / GetTimestampCounterFrequency());
+}
+
+bool GetMetricHistogram(unsigned int Histogram, MetricHistogramSnapshot* Snapshot)
+{
+    unsigned long long buckets[METRICS_BUCKETS];
+    long i, count = GetBlocksCount();
+    unsigned int j;
+
+    if (Histogram >= (unsigned int)s_HistogramsCount)
+        return false;
+
+    memset(buckets, 0, sizeof(buckets));
+    memset(Snapshot, 0, sizeof(MetricHistogramSnapshot));
+
+    Snapshot->name = s_Histograms[Histogram].name;
+    Snapshot->units = s_Histograms[Histogram].units;
+
+    for (i = 0; i < count; i++)
+    {
+        MetricsThreadBlock* block = s_Blocks[i];
+        MetricHistogramData* data;
+
+        if (!block)
+            continue;
+
+        data = block->histograms + Histogram;
+        if (!data->buckets)
+            continue;
+
+        for (j = 0; j < METRICS_BUCKETS; j++)
+            buckets[j] += data->buckets[j];
+
+        Snapshot->sum += data->sum;
+
+        if (data->max > Snapshot->max)
+            Snapshot->max = data->max;
+    }
+
+    for (j = 0; j < METRICS_BUCKETS; j++)
+        Snapshot->count += buckets[j];
+
+    Snapshot->p50 = GetPercentile(buckets, Snapshot->count, 500);
+    Snapshot->p90 = GetPercentile(buckets, Snapshot->count, 900);
+    Snapshot->p99 = GetPercentile(buckets, Snapshot->count, 990);
+    Snapshot->p999 = GetPercentile(buckets, Snapshot->count, 999);
+
+    if (Snapshot->units == MetricLatency)
+    {
+        Snapshot->sum = ConvertTicksToNanoseconds(Snapshot->sum);
+        Snapshot->max = ConvertTicksToNanoseconds(Snapshot->max);
+        Snapshot->p50 = ConvertTicksToNanoseconds(Snapshot->p50);
+        Snapshot->p90 = ConvertTicksToNanoseconds(Snapshot->p90);
+        Snapshot->p99 = ConvertTicksToNanoseconds(Snapshot->p99);
+        Snapshot->p999 = ConvertTicksToNanoseconds(Snapshot->p999);
+    }
+
+    return true;
+}
+
+void DumpMetrics(PrintLevels Level)
+{
+    MetricHistogramSnapshot snapshot;
+    unsigned int i;
+
+    if (!IsPrintLevelEnabled(Level))
+        return;
+
+    for (i = 0; i < (unsigned int)s_CountersCount; i++)
+        PrintLevelFmt(Level, PrintColors::Default, "{}: {}\n", s_Counters[i].name, GetMetricCounter(i));
+
+    for (i = 0; i < (unsigned int)s_HistogramsCount; i++)
+    {
+        const char* units;
+
+        if (!GetMetricHistogram(i, &snapshot) || !snapshot.count)
+            continue;
+
+        units = (snapshot.units == MetricLatency ? "ns" : "");
+
+        PrintLevelFmt(
+            Level, PrintColors::Default,
+            "{}: count {}, avg {}{}, p50 {}{}, p90 {}{}, p99 {}{}, p99.9 {}{}, max {}{}\n",
+            snapshot.name, snapshot.count,
+            snapshot.sum / snapshot.count, units,
+            snapshot.p50, units, snapshot.p90, units, snapshot.p99, units, snapshot.p999, units,
+            snapshot.max, units
+        );
+    }
+}
@@ -0,0 +1,70 @@
+#pragma once
+
+#include "CommonLib.h"
+#include "ConsolePrinter.h"
+
+// =============================================
+//  Hot-path metrics
+//
+//  Counters and histograms are registered once by name and recorded by an id.
+//  Every thread writes to its own cache-line aligned block without interlocked
+//  operations, a reader merges all blocks on a snapshot. A block of an exited
+//  thread keeps its values and is handed to the next new thread, so the limit
+//  applies to threads living at once. Histograms are log-linear: 16 linear
+//  sub-buckets for every power of two, that's about 6% of precision for any
+//  value.
+//
+//  Latency histograms record time stamp counter ticks, a snapshot reports them
+//  in nanoseconds. Names should be static strings, they aren't copied.
+
+#define METRICS_MAX_COUNTERS     64
+#define METRICS_MAX_HISTOGRAMS   32
+#define METRICS_MAX_THREADS      256
+
+#define INVALID_METRIC_ID        ((unsigned int)-1)
+
+enum MetricUnits
+{
+    MetricValue,
+    MetricLatency,
+};
+
+// Registering an existing name returns the same id, INVALID_METRIC_ID is
+// returned if there is no more space. Recording with INVALID_METRIC_ID is ignored.
+unsigned int RegisterMetricCounter(const char* Name);
+unsigned int RegisterMetricHistogram(const char* Name, MetricUnits Units = MetricLatency);
+
+void AddMetricCounter(unsigned int Counter, unsigned long long Value = 1);
+void RecordMetricHistogram(unsigned int Histogram, unsigned long long Value);
+
+inline unsigned long long StartMetricTimer()
+{
+    return ReadTimestampCounter();
+}
+
+inline void RecordMetricLatency(unsigned int Histogram, unsigned long long StartCounter)
+{
+    RecordMetricHistogram(Histogram, ReadTimestampCounter() - StartCounter);
+}
+
+// =============================================
+//  Snapshot
+
+struct MetricHistogramSnapshot
+{
+    const char*        name;
+    MetricUnits        units;
+    unsigned long long count;
+    unsigned long long sum;
+    unsigned long long max;
+    unsigned long long p50;
+    unsigned long long p90;
+    unsigned long long p99;
+    unsigned long long p999;
+};
+
+unsigned long long GetMetricCounter(unsigned int Counter);
+bool GetMetricHistogram(unsigned int Histogram, MetricHistogramSnapshot* Snapshot);
+
+// Prints all registered metrics through the console printer
+void DumpMetrics(PrintLevels Level = InfoLevel);
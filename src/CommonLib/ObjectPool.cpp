@@ -0,0 +1,370 @@
+#include "ObjectPool.h"
+#include "CommonLib.h"
+#include <stdlib.h>
+#include <string.h>
+#include <malloc.h>
+#include <intrin.h>
+
+#define POOL_ALLOCATED_PATTERN 0xCD
+#define POOL_RELEASED_PATTERN  0xDD
+
+// A free object keeps a link to the next object in the first word, the first
+// object of a batch keeps a link to the next batch in the second word
+#define POOL_LINK_WORDS 2
+
+// =============================================
+
+struct ObjectPoolContext;
+
+struct ObjectPoolCache
+{
+    ObjectPoolContext* pool;
+    void*              head;
+    unsigned int       count;
+    ObjectPoolCache*   next;
+    ObjectPoolCache*   prev;
+};
+
+struct ObjectPoolContext
+{
+    size_t           objectSize;
+    size_t           alignment;
+    size_t           slabHeaderSize;
+    unsigned int     batchSize;
+    unsigned int     flags;
+    DWORD            flsIndex;
+    SpinAtom         lock;
+    void*            batches;      // full batches released by threads
+    void*            partial;      // objects left by exited threads
+    unsigned int     partialCount;
+    void*            slabs;
+    ObjectPoolCache* caches;
+};
+
+// =============================================
+
+static inline void*& NextObject(void* Object)
+{
+    return ((void**)Object)[0];
+}
+
+static inline void*& NextBatch(void* Object)
+{
+    return ((void**)Object)[1];
+}
+
+static void CheckPoisonedObject(ObjectPoolContext* Pool, void* Object)
+{
+    const unsigned char* data = (const unsigned char*)Object;
+    size_t i;
+
+    for (i = POOL_LINK_WORDS * sizeof(void*); i < Pool->objectSize; i++)
+    {
+        // Somebody has written to the object after it has been released
+        if (data[i] != POOL_RELEASED_PATTERN)
+        {
+            __debugbreak();
+            break;
+        }
+    }
+}
+
+// =============================================
+
+static void LinkCache(ObjectPoolContext* Pool, ObjectPoolCache* Cache)
+{
+    Cache->prev = NULL;
+    Cache->next = Pool->caches;
+
+    if (Pool->caches)
+        Pool->caches->prev = Cache;
+
+    Pool->caches = Cache;
+}
+
+static void UnlinkCache(ObjectPoolContext* Pool, ObjectPoolCache* Cache)
+{
+    if (Cache->prev)
+        Cache->prev->next = Cache->next;
+    else
+        Pool->caches = Cache->next;
+
+    if (Cache->next)
+        Cache->next->prev = Cache->prev;
+}
+
+// Called on a thread exit and for every thread when the pool is destroyed
+static void WINAPI ReleaseObjectPoolCache(PVOID Data)
+{
+    ObjectPoolCache* cache = (ObjectPoolCache*)Data;
+    ObjectPoolContext* pool;
+    void* tail;
+
+    if (!cache)
+        return;
+
+    pool = cache->pool;
+
+    AcquireSpinLock(&pool->lock);
+
+    UnlinkCache(pool, cache);
+
+    if (cache->head)
+    {
+        for (tail = cache->head; NextObject(tail); tail = NextObject(tail));
+
+        NextObject(tail) = pool->partial;
+        pool->partial = cache->head;
+        pool->partialCount += cache->count;
+    }
+
+    ReleaseSpinLock(&pool->lock);
+
+    free(cache);
+}
+
+static ObjectPoolCache* GetObjectPoolCache(ObjectPoolContext* Pool)
+{
+    ObjectPoolCache* cache = (ObjectPoolCache*)::FlsGetValue(Pool->flsIndex);
+
+    if (cache)
+        return cache;
+
+    cache = (ObjectPoolCache*)malloc(sizeof(ObjectPoolCache));
+    if (!cache)
+        return NULL;
+
+    cache->pool = Pool;
+    cache->head = NULL;
+    cache->count = 0;
+
+    AcquireSpinLock(&Pool->lock);
+    LinkCache(Pool, cache);
+    ReleaseSpinLock(&Pool->lock);
+
+    if (!::FlsSetValue(Pool->flsIndex, cache))
+    {
+        AcquireSpinLock(&Pool->lock);
+        UnlinkCache(Pool, cache);
+        ReleaseSpinLock(&Pool->lock);
+
+        free(cache);
+        return NULL;
+    }
+
+    return cache;
+}
+
+// =============================================
+
+// Every slab holds a single batch of objects
+static void* AllocateSlab(ObjectPoolContext* Pool)
+{
+    char* slab;
+    char* object;
+    unsigned int i;
+
+    slab = (char*)_aligned_malloc(Pool->slabHeaderSize + Pool->objectSize * Pool->batchSize, Pool->alignment);
+    if (!slab)
+        return NULL;
+
+    object = slab + Pool->slabHeaderSize;
+
+    if (Pool->flags & ObjectPoolPoison)
+        memset(object, POOL_RELEASED_PATTERN, Pool->objectSize * Pool->batchSize);
+
+    for (i = 0; i + 1 < Pool->batchSize; i++)
+        NextObject(object + Pool->objectSize * i) = object + Pool->objectSize * (i + 1);
+
+    NextObject(object + Pool->objectSize * i) = NULL;
+
+    AcquireSpinLock(&Pool->lock);
+    *(void**)slab = Pool->slabs;
+    Pool->slabs = slab;
+    ReleaseSpinLock(&Pool->lock);
+
+    return object;
+}
+
+static bool RefillObjectPoolCache(ObjectPoolContext* Pool, ObjectPoolCache* Cache)
+{
+    void* batch = NULL;
+    unsigned int count = 0;
+
+    AcquireSpinLock(&Pool->lock);
+
+    if (Pool->batches)
+    {
+        batch = Pool->batches;
+        Pool->batches = NextBatch(batch);
+        count = Pool->batchSize;
+    }
+    else if (Pool->partial)
+    {
+        batch = Pool->partial;
+        count = Pool->partialCount;
+        Pool->partial = NULL;
+        Pool->partialCount = 0;
+    }
+
+    ReleaseSpinLock(&Pool->lock);
+
+    if (!batch)
+    {
+        batch = AllocateSlab(Pool);
+        if (!batch)
+            return false;
+
+        count = Pool->batchSize;
+    }
+
+    Cache->head = batch;
+    Cache->count = count;
+    return true;
+}
+
+static void FlushObjectPoolCache(ObjectPoolContext* Pool, ObjectPoolCache* Cache)
+{
+    void* batch = Cache->head;
+    void* tail = batch;
+    unsigned int i;
+
+    for (i = 1; i < Pool->batchSize; i++)
+        tail = NextObject(tail);
+
+    Cache->head = NextObject(tail);
+    Cache->count -= Pool->batchSize;
+
+    NextObject(tail) = NULL;
+
+    AcquireSpinLock(&Pool->lock);
+    NextBatch(batch) = Pool->batches;
+    Pool->batches = batch;
+    ReleaseSpinLock(&Pool->lock);
+}
+
+// =============================================
+
+void* CreateObjectPool(size_t ObjectSize, size_t Alignment, unsigned int BatchSize, unsigned int Flags)
+{
+    ObjectPoolContext* pool;
+
+    if (!ObjectSize || !BatchSize || (Alignment & (Alignment - 1)))
+        return NULL;
+
+    pool = (ObjectPoolContext*)malloc(sizeof(ObjectPoolContext));
+    if (!pool)
+        return NULL;
+
+    memset(pool, 0, sizeof(ObjectPoolContext));
+
+    if (Alignment < sizeof(void*))
+        Alignment = sizeof(void*);
+
+    if (ObjectSize < POOL_LINK_WORDS * sizeof(void*))
+        ObjectSize = POOL_LINK_WORDS * sizeof(void*);
+
+    pool->objectSize = AlignToTop(ObjectSize, Alignment);
+    pool->alignment = Alignment;
+    pool->slabHeaderSize = AlignToTop(sizeof(void*), Alignment);
+    pool->batchSize = BatchSize;
+    pool->flags = Flags;
+
+    pool->flsIndex = ::FlsAlloc(ReleaseObjectPoolCache);
+    if (pool->flsIndex == FLS_OUT_OF_INDEXES)
+    {
+        free(pool);
+        return NULL;
+    }
+
+    return pool;
+}
+
+void DestroyObjectPool(void* Pool)
+{
+    ObjectPoolContext* pool = (ObjectPoolContext*)Pool;
+    void* slab;
+
+    // Caches of living threads are returned by the callback
+    ::FlsFree(pool->flsIndex);
+
+    while (pool->caches)
+    {
+        ObjectPoolCache* cache = pool->caches;
+        pool->caches = cache->next;
+        free(cache);
+    }
+
+    slab = pool->slabs;
+    while (slab)
+    {
+        void* next = *(void**)slab;
+        _aligned_free(slab);
+        slab = next;
+    }
+
+    free(pool);
+}
+
+void* AllocateFromObjectPool(void* Pool)
+{
+    ObjectPoolContext* pool = (ObjectPoolContext*)Pool;
+    ObjectPoolCache* cache;
+    void* object;
+
+    cache = GetObjectPoolCache(pool);
+    if (!cache)
+        return NULL;
+
+    if (!cache->head && !RefillObjectPoolCache(pool, cache))
+        return NULL;
+
+    object = cache->head;
+    cache->head = NextObject(object);
+    cache->count--;
+
+    if (pool->flags & ObjectPoolPoison)
+    {
+        CheckPoisonedObject(pool, object);
+        memset(object, POOL_ALLOCATED_PATTERN, pool->objectSize);
+    }
+
+    return object;
+}
+
+void ReleaseToObjectPool(void* Pool, void* Object)
+{
+    ObjectPoolContext* pool = (ObjectPoolContext*)Pool;
+    ObjectPoolCache* cache;
+
+    if (!Object)
+        return;
+
+    if (pool->flags & ObjectPoolPoison)
+        memset(Object, POOL_RELEASED_PATTERN, pool->objectSize);
+
+    cache = GetObjectPoolCache(pool);
+    if (!cache)
+    {
+        // No memory for a cache, the object goes to the depot directly
+        AcquireSpinLock(&pool->lock);
+        NextObject(Object) = pool->partial;
+        pool->partial = Object;
+        pool->partialCount++;
+        ReleaseSpinLock(&pool->lock);
+        return;
+    }
+
+    NextObject(Object) = cache->head;
+    cache->head = Object;
+    cache->count++;
+
+    // Keep a batch for the next allocations and give the rest to other threads
+    if (cache->count >= pool->batchSize * 2)
+        FlushObjectPoolCache(pool, cache);
+}
+
+size_t GetObjectPoolObjectSize(void* Pool)
+{
+    return ((ObjectPoolContext*)Pool)->objectSize;
+}
@@ -0,0 +1,204 @@
+#pragma once
+
+#include <Windows.h>
+#include <new>
+#include <utility>
+
+// =============================================
+//  Fixed-size object pool
+//
+//  Every thread keeps a private free list of objects, allocation and release
+//  don't take any lock while the list has objects and isn't overfilled. Lists
+//  are exchanged with a global depot by batches, so a thread which releases
+//  objects allocated by another thread returns them to the producer a batch
+//  at a time. Memory is taken from the heap by slabs and isn't returned until
+//  the pool is destroyed.
+//
+//  The poisoning mode fills released objects with a pattern and checks it on
+//  the next allocation, a write to a released object breaks into a debugger.
+
+enum ObjectPoolFlags
+{
+    ObjectPoolPoison = 1,
+};
+
+#ifdef _DEBUG
+#define OBJECT_POOL_DEFAULT_FLAGS ObjectPoolPoison
+#else
+#define OBJECT_POOL_DEFAULT_FLAGS 0
+#endif
+
+#define OBJECT_POOL_DEFAULT_BATCH 64
+
+void* CreateObjectPool(size_t ObjectSize, size_t Alignment, unsigned int BatchSize = OBJECT_POOL_DEFAULT_BATCH, unsigned int Flags = OBJECT_POOL_DEFAULT_FLAGS);
+
+// All objects are released with the pool, allocated ones aren't tracked
+void DestroyObjectPool(void* Pool);
+
+void* AllocateFromObjectPool(void* Pool);
+void ReleaseToObjectPool(void* Pool, void* Object);
+
+size_t GetObjectPoolObjectSize(void* Pool);
+
+// =============================================
+//  Typed pool
+
+template<typename T>
+class ObjectPool
+{
+public:
+
+    ObjectPool(unsigned int BatchSize = OBJECT_POOL_DEFAULT_BATCH, unsigned int Flags = OBJECT_POOL_DEFAULT_FLAGS) :
+        m_pool(CreateObjectPool(sizeof(T), __alignof(T), BatchSize, Flags))
+    {
+    }
+
+    ~ObjectPool()
+    {
+        if (m_pool)
+            DestroyObjectPool(m_pool);
+    }
+
+    bool IsValid() const { return m_pool != NULL; }
+
+    // Raw storage without construction
+    T* Allocate()
+    {
+        return (m_pool ? (T*)AllocateFromObjectPool(m_pool) : NULL);
+    }
+
+    void Release(T* Object)
+    {
+        ReleaseToObjectPool(m_pool, Object);
+    }
+
+    template<typename... Args>
+    T* New(Args... Arguments)
+    {
+        T* object = Allocate();
+        if (!object)
+            return NULL;
+
+        return new (object) T(Arguments...);
+    }
+
+    void Delete(T* Object)
+    {
+        Object->~T();
+        Release(Object);
+    }
+
+private:
+
+    ObjectPool(const ObjectPool&);
+    ObjectPool& operator=(const ObjectPool&);
+
+    void* m_pool;
+};
+
+// =============================================
+//  STL allocator
+//
+//  Single element allocations of every rebound type go to a process-wide pool
+//  of that type, it suits node-based containers like std::list and std::map.
+//  Array allocations go to the heap.
+
+template<typename T>
+class PoolAllocator
+{
+public:
+
+    typedef T value_type;
+    typedef T* pointer;
+    typedef const T* const_pointer;
+    typedef T& reference;
+    typedef const T& const_reference;
+    typedef size_t size_type;
+    typedef ptrdiff_t difference_type;
+
+    template<typename Other>
+    struct rebind
+    {
+        typedef PoolAllocator<Other> other;
+    };
+
+    PoolAllocator() {}
+
+    template<typename Other>
+    PoolAllocator(const PoolAllocator<Other>&) {}
+
+    pointer allocate(size_type Count, const void* = NULL)
+    {
+        void* pool;
+        void* object;
+
+        if (Count != 1)
+            return (pointer)::operator new(Count * sizeof(T));
+
+        pool = GetPool();
+        if (!pool)
+            throw std::bad_alloc();
+
+        object = AllocateFromObjectPool(pool);
+        if (!object)
+            throw std::bad_alloc();
+
+        return (pointer)object;
+    }
+
+    void deallocate(pointer Object, size_type Count)
+    {
+        if (Count == 1)
+            ReleaseToObjectPool(s_pool, Object);
+        else
+            ::operator delete(Object);
+    }
+
+    template<typename Other, typename... Args>
+    void construct(Other* Object, Args&&... Arguments)
+    {
+        new ((void*)Object) Other(std::forward<Args>(Arguments)...);
+    }
+
+    template<typename Other>
+    void destroy(Other* Object)
+    {
+        Object->~Other();
+    }
+
+    size_type max_size() const { return ((size_t)-1) / sizeof(T); }
+
+private:
+
+    // The pool lives until the process exit, containers may be destroyed by static destructors
+    static void* GetPool()
+    {
+        void* pool = s_pool;
+
+        if (!pool)
+        {
+            pool = CreateObjectPool(sizeof(T), __alignof(T));
+            if (!pool)
+                return NULL;
+
+            if (InterlockedCompareExchangePointer(&s_pool, pool, NULL) != NULL)
+            {
+                DestroyObjectPool(pool);
+                pool = s_pool;
+            }
+        }
+
+        return pool;
+    }
+
+    static void* volatile s_pool;
+};
+
+template<typename T>
+void* volatile PoolAllocator<T>::s_pool = NULL;
+
+template<typename T, typename Other>
+inline bool operator==(const PoolAllocator<T>&, const PoolAllocator<Other>&) { return true; }
+
+template<typename T, typename Other>
+inline bool operator!=(const PoolAllocator<T>&, const PoolAllocator<Other>&) { return false; }
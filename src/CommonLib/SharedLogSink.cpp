@@ -0,0 +1,107 @@
+#include "SharedLogSink.h"
+#include "CommonLib.h"
+#include <Windows.h>
+#include <string.h>
+
+struct SharedLogSinkContext
+{
+    HANDLE           section;
+    SharedLogHeader* header;
+    SharedLogSlot*   slots;
+};
+
+// =============================================
+
+void* CreateSharedLogSink(const wchar_t* Name, unsigned int SlotsCount)
+{
+    SharedLogSinkContext* context;
+    wchar_t* sectionName = NULL;
+    ULARGE_INTEGER size;
+    bool result = false;
+
+    if (!SlotsCount)
+        return NULL;
+
+    context = (SharedLogSinkContext*)malloc(sizeof(SharedLogSinkContext));
+    if (!context)
+        return NULL;
+
+    memset(context, 0, sizeof(SharedLogSinkContext));
+
+    sectionName = BuildWideString(SHARED_LOG_NAME_PREFIX, Name, NULL);
+    if (!sectionName)
+        goto ReleaseBlock;
+
+    size.QuadPart = sizeof(SharedLogHeader) + (unsigned long long)SlotsCount * sizeof(SharedLogSlot);
+
+    context->section = ::CreateFileMappingW(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE, size.HighPart, size.LowPart, sectionName);
+    if (!context->section)
+        goto ReleaseBlock;
+
+    if (::GetLastError() == ERROR_ALREADY_EXISTS)
+        goto ReleaseBlock;
+
+    context->header = (SharedLogHeader*)::MapViewOfFile(context->section, FILE_MAP_WRITE, 0, 0, 0);
+    if (!context->header)
+        goto ReleaseBlock;
+
+    context->slots = (SharedLogSlot*)(context->header + 1);
+
+    context->header->slotSize = sizeof(SharedLogSlot);
+    context->header->slotsCount = SlotsCount;
+    context->header->version = SHARED_LOG_VERSION;
+    context->header->head = 0;
+    ::MemoryBarrier();
+    context->header->signature = SHARED_LOG_SIGNATURE;
+
+    result = true;
+
+ReleaseBlock:
+
+    if (sectionName)
+        FreeWideString(sectionName);
+
+    if (!result)
+    {
+        DestroySharedLogSink(context);
+        context = NULL;
+    }
+
+    return context;
+}
+
+void DestroySharedLogSink(void* Sink)
+{
+    SharedLogSinkContext* context = (SharedLogSinkContext*)Sink;
+
+    if (context->header)
+        ::UnmapViewOfFile(context->header);
+
+    if (context->section)
+        ::CloseHandle(context->section);
+
+    free(context);
+}
+
+void WriteSharedLogRecord(void* Sink, const LogRecordHeader* Header, const void* Payload)
+{
+    SharedLogSinkContext* context = (SharedLogSinkContext*)Sink;
+    unsigned long long index = context->header->head;
+    SharedLogSlot* slot = &context->slots[index % context->header->slotsCount];
+    size_t size = Header->size;
+
+    // A long message is truncated to a slot
+    if (size > sizeof(slot->payload))
+        size = sizeof(slot->payload);
+
+    slot->sequence = 0;
+    ::MemoryBarrier();
+
+    slot->record = *Header;
+    slot->record.size = (unsigned int)size;
+    memcpy(slot->payload, Payload, size);
+
+    ::MemoryBarrier();
+    slot->sequence = index + 1;
+    context->header->head = index + 1;
+}
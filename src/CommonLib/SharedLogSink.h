@@ -0,0 +1,41 @@
+#pragma once
+
+#include "LogFormat.h"
+
+// =============================================
+//  Shared memory log ring
+//
+//  A sink publishes records to a named section that an external viewer maps
+//  read-only (LogViewer tail <name>). The ring consists of fixed-size slots, a
+//  slot sequence is updated after the data therefore a reader detects both torn
+//  and overwritten slots without any synchronization with the writer.
+
+#define SHARED_LOG_SIGNATURE    0x474F4C53 // 'SLOG'
+#define SHARED_LOG_VERSION      1
+#define SHARED_LOG_NAME_PREFIX  L"Local\\NTSamples.Log."
+#define SHARED_LOG_SLOT_SIZE    512
+
+#pragma pack(push, 1)
+
+struct SharedLogHeader
+{
+    unsigned int                signature;
+    unsigned int                version;
+    unsigned int                slotSize;
+    unsigned int                slotsCount;
+    volatile unsigned long long head; // amount of published slots
+};
+
+struct SharedLogSlot
+{
+    volatile unsigned long long sequence; // slot index + 1, 0 while the slot is being written
+    LogRecordHeader             record;
+    char                        payload[SHARED_LOG_SLOT_SIZE - sizeof(unsigned long long) - sizeof(LogRecordHeader)];
+};
+
+#pragma pack(pop)
+
+void* CreateSharedLogSink(const wchar_t* Name, unsigned int SlotsCount = 0x1000);
+void DestroySharedLogSink(void* Sink);
+
+void WriteSharedLogRecord(void* Sink, const LogRecordHeader* Header, const void* Payload);
@@ -0,0 +1,164 @@
+#include "StringBuilder.h"
+#include "CommonLib.h"
+#include <NTLib.h>
+#include <string.h>
+#include <wchar.h>
+
+// =============================================
+
+void InitStringArena(StringArena* Arena, void* Buffer, size_t Size)
+{
+    Arena->buffer = (char*)Buffer;
+    Arena->size = Size;
+    Arena->used = 0;
+}
+
+void ResetStringArena(StringArena* Arena)
+{
+    Arena->used = 0;
+}
+
+void* AllocateFromStringArena(StringArena* Arena, size_t Size)
+{
+    size_t offset = AlignToTop(Arena->used, sizeof(void*));
+    
+    if (offset + Size > Arena->size)
+        return NULL;
+
+    Arena->used = offset + Size;
+    return Arena->buffer + offset;
+}
+
+// =============================================
+
+void InitWideStringBuilder(WideStringBuilder* Builder, StringArena* Arena)
+{
+    Builder->buffer = Builder->inlineBuffer;
+    Builder->length = 0;
+    Builder->capacity = WIDE_BUILDER_INLINE_LENGTH;
+    Builder->arena = Arena;
+    Builder->heap = false;
+    Builder->failed = false;
+    Builder->inlineBuffer[0] = L'\0';
+}
+
+void ReleaseWideStringBuilder(WideStringBuilder* Builder)
+{
+    if (Builder->heap)
+        ::RtlFreeHeap(::GetProcessHeap(), 0, Builder->buffer);
+
+    InitWideStringBuilder(Builder, Builder->arena);
+}
+
+static bool GrowWideStringBuilder(WideStringBuilder* Builder, size_t Length)
+{
+    size_t capacity = Builder->capacity * 2;
+    wchar_t* buffer = NULL;
+
+    if (Builder->failed)
+        return false;
+
+    while (capacity < Builder->length + Length + 1)
+        capacity *= 2;
+
+    // An arena allocation isn't released on growth, the arena is reset as a whole
+    if (Builder->arena && !Builder->heap)
+        buffer = (wchar_t*)AllocateFromStringArena(Builder->arena, capacity * sizeof(wchar_t));
+
+    if (buffer)
+    {
+        memcpy(buffer, Builder->buffer, (Builder->length + 1) * sizeof(wchar_t));
+    }
+    else
+    {
+        buffer = (wchar_t*)::RtlAllocateHeap(::GetProcessHeap(), 0, capacity * sizeof(wchar_t));
+        if (!buffer)
+        {
+            Builder->failed = true;
+            return false;
+        }
+
+        memcpy(buffer, Builder->buffer, (Builder->length + 1) * sizeof(wchar_t));
+
+        if (Builder->heap)
+            ::RtlFreeHeap(::GetProcessHeap(), 0, Builder->buffer);
+
+        Builder->heap = true;
+    }
+
+    Builder->buffer = buffer;
+    Builder->capacity = capacity;
+    return true;
+}
+
+bool AppendWideStringN(WideStringBuilder* Builder, const wchar_t* String, size_t Length)
+{
+    if (Builder->length + Length + 1 > Builder->capacity)
+        if (!GrowWideStringBuilder(Builder, Length))
+            return false;
+
+    memcpy(Builder->buffer + Builder->length, String, Length * sizeof(wchar_t));
+    Builder->length += Length;
+    Builder->buffer[Builder->length] = L'\0';
+
+    return true;
+}
+
+bool AppendWideString(WideStringBuilder* Builder, const wchar_t* String)
+{
+    return AppendWideStringN(Builder, String, wcslen(String));
+}
+
+bool AppendWideChar(WideStringBuilder* Builder, wchar_t Char)
+{
+    return AppendWideStringN(Builder, &Char, 1);
+}
+
+bool AppendWideDecimal(WideStringBuilder* Builder, unsigned long long Value)
+{
+    wchar_t digits[24];
+    size_t i = _countof(digits);
+
+    do
+    {
+        digits[--i] = (wchar_t)(L'0' + (Value % 10));
+        Value /= 10;
+    }
+    while (Value);
+
+    return AppendWideStringN(Builder, digits + i, _countof(digits) - i);
+}
+
+void TruncateWideStringBuilder(WideStringBuilder* Builder, size_t Length)
+{
+    if (Length >= Builder->length)
+        return;
+
+    Builder->length = Length;
+    Builder->buffer[Length] = L'\0';
+}
+
+wchar_t* DetachWideStringBuilder(WideStringBuilder* Builder)
+{
+    wchar_t* result;
+
+    if (Builder->failed)
+        return NULL;
+
+    if (Builder->heap)
+    {
+        result = Builder->buffer;
+        Builder->heap = false;
+    }
+    else
+    {
+        result = (wchar_t*)::RtlAllocateHeap(::GetProcessHeap(), 0, (Builder->length + 1) * sizeof(wchar_t));
+        if (!result)
+            return NULL;
+
+        memcpy(result, Builder->buffer, (Builder->length + 1) * sizeof(wchar_t));
+    }
+
+    InitWideStringBuilder(Builder, Builder->arena);
+    return result;
+}
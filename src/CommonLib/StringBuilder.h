@@ -0,0 +1,62 @@
+#pragma once
+
+// =============================================
+//  String arena
+//
+//  Bump allocator over a caller-provided buffer, a whole arena is released
+//  at once by ResetStringArena()
+
+struct StringArena
+{
+    char*  buffer;
+    size_t size;
+    size_t used;
+};
+
+void InitStringArena(StringArena* Arena, void* Buffer, size_t Size);
+void ResetStringArena(StringArena* Arena);
+void* AllocateFromStringArena(StringArena* Arena, size_t Size);
+
+// =============================================
+//  Wide string builder
+//
+//  A builder keeps a string in the inline buffer while it fits, then moves it
+//  to an arena (if any) and only after that to the process heap. A builder
+//  placed on a stack builds common paths without touching the heap.
+
+#define WIDE_BUILDER_INLINE_LENGTH 264
+
+struct WideStringBuilder
+{
+    wchar_t*     buffer;
+    size_t       length;
+    size_t       capacity; // in characters, including a null terminator
+    StringArena* arena;
+    bool         heap;
+    bool         failed;
+    wchar_t      inlineBuffer[WIDE_BUILDER_INLINE_LENGTH];
+};
+
+void InitWideStringBuilder(WideStringBuilder* Builder, StringArena* Arena = 0);
+void ReleaseWideStringBuilder(WideStringBuilder* Builder);
+
+bool AppendWideString(WideStringBuilder* Builder, const wchar_t* String);
+bool AppendWideStringN(WideStringBuilder* Builder, const wchar_t* String, size_t Length);
+bool AppendWideChar(WideStringBuilder* Builder, wchar_t Char);
+bool AppendWideDecimal(WideStringBuilder* Builder, unsigned long long Value);
+
+void TruncateWideStringBuilder(WideStringBuilder* Builder, size_t Length);
+
+// Returns a null-terminated string or NULL if any append failed
+inline wchar_t* GetWideStringBuilderData(WideStringBuilder* Builder)
+{
+    return (Builder->failed ? 0 : Builder->buffer);
+}
+
+inline size_t GetWideStringBuilderLength(WideStringBuilder* Builder)
+{
+    return Builder->length;
+}
+
+// Returns a heap copy that should be released by FreeWideString()
+wchar_t* DetachWideStringBuilder(WideStringBuilder* Builder);
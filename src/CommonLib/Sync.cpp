@@ -0,0 +1,261 @@
+#include "Sync.h"
+#include "CommonLib.h"
+#include <NTLib.h>
+#include <crtdbg.h>
+#include <intrin.h>
+
+// Upper bound of pause instructions between two reads of a lock word
+#define MAX_SPIN_BACKOFF   1024
+// Rounds with the maximal backoff after that a waiter yields the processor
+#define MAX_BACKOFF_ROUNDS 16
+
+// =============================================
+
+static unsigned int s_ProcessorsCount = 0;
+
+static bool IsSpinningUseful()
+{
+    // Spinning on a single processor only burns the owner's quantum
+    if (!s_ProcessorsCount)
+        s_ProcessorsCount = GetAmountOfCPUCores();
+
+    return (s_ProcessorsCount > 1);
+}
+
+static void SpinPause(unsigned int Count)
+{
+    unsigned int i;
+
+    for (i = 0; i < Count; i++)
+        _mm_pause();
+}
+
+// =============================================
+
+bool TryAcquireSpinLock(SpinAtom* Spinlock)
+{
+    return (*Spinlock == 0 && AtomExchange(Spinlock, 1) == 0);
+}
+
+void AcquireSpinLock(SpinAtom* Spinlock)
+{
+    unsigned int backoff = 1;
+    unsigned int rounds = 0;
+    bool spin = IsSpinningUseful();
+
+    while (!TryAcquireSpinLock(Spinlock))
+    {
+        if (!spin || rounds >= MAX_BACKOFF_ROUNDS)
+        {
+            NtYieldExecution();
+            continue;
+        }
+
+        SpinPause(backoff);
+
+        if (backoff < MAX_SPIN_BACKOFF)
+            backoff <<= 1;
+        else
+            rounds++;
+    }
+}
+
+void ReleaseSpinLock(SpinAtom* Spinlock)
+{
+    _ASSERT(*Spinlock == 1);
+
+    // A volatile store has release semantics on x86/x64, the barrier keeps
+    // the compiler from sinking protected accesses below it
+    _ReadWriteBarrier();
+    *Spinlock = 0;
+}
+
+// =============================================
+
+void InitTicketLock(TicketLock* Lock)
+{
+    Lock->next = 0;
+    Lock->serving = 0;
+}
+
+void AcquireTicketLock(TicketLock* Lock)
+{
+    long ticket = ::InterlockedExchangeAdd(&Lock->next, 1);
+    bool spin = IsSpinningUseful();
+
+    while (true)
+    {
+        long distance = ticket - Lock->serving;
+
+        if (distance == 0)
+            break;
+
+        // Waiters wait proportionally to their place in the line, so a lock
+        // handover doesn't make all of them hammer the cache line at once
+        if (spin && distance < MAX_BACKOFF_ROUNDS)
+            SpinPause(64 * (unsigned int)distance);
+        else
+            NtYieldExecution();
+    }
+
+    _ReadWriteBarrier();
+}
+
+void ReleaseTicketLock(TicketLock* Lock)
+{
+    _ReadWriteBarrier();
+    // Only the owner modifies the counter, a plain increment is enough
+    Lock->serving = Lock->serving + 1;
+}
+
+// =============================================
+//  Address wait
+//
+//  WaitOnAddress and WakeByAddressSingle exist since Windows 8 only, they are
+//  resolved at runtime so the library still loads on Windows 7. There the
+//  waiters sleep on one of the condition variables picked by the address hash.
+
+typedef BOOL (WINAPI* WaitOnAddressRoutine)(volatile VOID*, PVOID, SIZE_T, DWORD);
+typedef VOID (WINAPI* WakeByAddressRoutine)(PVOID);
+
+#define ADDRESS_WAIT_BUCKETS 64
+
+struct AddressWaitBucket
+{
+    SRWLOCK lock;
+    CONDITION_VARIABLE waiters;
+};
+
+static volatile long         s_AddressWaitResolved = 0;
+static WaitOnAddressRoutine  s_WaitOnAddress = NULL;
+static WakeByAddressRoutine  s_WakeByAddressSingle = NULL;
+static AddressWaitBucket     s_AddressWaitBuckets[ADDRESS_WAIT_BUCKETS] = {};
+
+static void ResolveAddressWait()
+{
+    HMODULE module;
+
+    if (s_AddressWaitResolved)
+        return;
+
+    // Both routines live in the same module, a racing resolution stores the same values
+    module = ::GetModuleHandleW(L"kernelbase.dll");
+    if (module)
+    {
+        s_WaitOnAddress = (WaitOnAddressRoutine)::GetProcAddress(module, "WaitOnAddress");
+        s_WakeByAddressSingle = (WakeByAddressRoutine)::GetProcAddress(module, "WakeByAddressSingle");
+    }
+
+    if (!s_WaitOnAddress || !s_WakeByAddressSingle)
+    {
+        s_WaitOnAddress = NULL;
+        s_WakeByAddressSingle = NULL;
+    }
+
+    ::InterlockedExchange(&s_AddressWaitResolved, 1);
+}
+
+static AddressWaitBucket* GetAddressWaitBucket(volatile long* Address)
+{
+    // SRWLOCK_INIT and CONDITION_VARIABLE_INIT are zeroes, the buckets need no initialization
+    return &s_AddressWaitBuckets[((ULONG_PTR)Address >> 2) % ADDRESS_WAIT_BUCKETS];
+}
+
+static void WaitOnLockWord(volatile long* Address, long Value)
+{
+    AddressWaitBucket* bucket;
+
+    ResolveAddressWait();
+
+    if (s_WaitOnAddress)
+    {
+        s_WaitOnAddress(Address, &Value, sizeof(*Address), INFINITE);
+        return;
+    }
+
+    // The word is compared under the bucket lock and the waker takes the same lock
+    // after changing the word, therefore a wake can't slip in between the check
+    // and the sleep
+    bucket = GetAddressWaitBucket(Address);
+
+    ::AcquireSRWLockExclusive(&bucket->lock);
+
+    if (*Address == Value)
+        ::SleepConditionVariableSRW(&bucket->waiters, &bucket->lock, INFINITE, 0);
+
+    ::ReleaseSRWLockExclusive(&bucket->lock);
+}
+
+static void WakeLockWordWaiter(volatile long* Address)
+{
+    AddressWaitBucket* bucket;
+
+    ResolveAddressWait();
+
+    if (s_WakeByAddressSingle)
+    {
+        s_WakeByAddressSingle((void*)Address);
+        return;
+    }
+
+    bucket = GetAddressWaitBucket(Address);
+
+    // A bucket is shared by unrelated words, waking a single waiter could pick
+    // a sleeper of another word and lose the wake
+    ::AcquireSRWLockExclusive(&bucket->lock);
+    ::WakeAllConditionVariable(&bucket->waiters);
+    ::ReleaseSRWLockExclusive(&bucket->lock);
+}
+
+// =============================================
+
+bool TryAcquireHybridMutex(HybridMutex* Mutex)
+{
+    return (::InterlockedCompareExchange(&Mutex->state, 1, 0) == 0);
+}
+
+void AcquireHybridMutex(HybridMutex* Mutex)
+{
+    long state;
+    unsigned int i;
+
+    if (TryAcquireHybridMutex(Mutex))
+        return;
+
+    if (IsSpinningUseful())
+    {
+        for (i = 0; i < HYBRID_MUTEX_SPIN_COUNT; i++)
+        {
+            _mm_pause();
+
+            // Stop spinning if somebody is sleeping already, we would only delay it
+            state = Mutex->state;
+            if (state == 2)
+                break;
+
+            if (state == 0 && TryAcquireHybridMutex(Mutex))
+                return;
+        }
+    }
+
+    // Mark the lock as contended, so the owner wakes us on release. A waiter that
+    // acquired the lock this way keeps the contended state because other waiters
+    // may still sleep.
+    state = ::InterlockedExchange(&Mutex->state, 2);
+
+    while (state != 0)
+    {
+        WaitOnLockWord(&Mutex->state, 2);
+        state = ::InterlockedExchange(&Mutex->state, 2);
+    }
+}
+
+void ReleaseHybridMutex(HybridMutex* Mutex)
+{
+    long state = ::InterlockedExchange(&Mutex->state, 0);
+
+    _ASSERT(state != 0);
+
+    if (state == 2)
+        WakeLockWordWaiter(&Mutex->state);
+}
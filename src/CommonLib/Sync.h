@@ -0,0 +1,57 @@
+#pragma once
+
+// =============================================
+//  Spinlock
+//
+//  Test-and-test-and-set lock: a waiter spins on a plain read and issues an
+//  interlocked exchange only when the lock looks free, the pause between reads
+//  grows exponentially. It suits very short critical sections only.
+
+#ifdef _WIN64
+typedef volatile long long SpinAtom;
+#define AtomExchange InterlockedExchange64
+#else
+typedef volatile long SpinAtom;
+#define AtomExchange InterlockedExchange
+#endif
+
+void AcquireSpinLock(SpinAtom* Spinlock);
+bool TryAcquireSpinLock(SpinAtom* Spinlock);
+void ReleaseSpinLock(SpinAtom* Spinlock);
+
+// =============================================
+//  Ticket lock
+//
+//  FIFO spinlock, waiters are served in the arrival order therefore none of
+//  them starves. The counters are placed on separate cache lines so taking
+//  a ticket doesn't disturb the owner.
+
+struct TicketLock
+{
+    __declspec(align(64)) volatile long next;
+    __declspec(align(64)) volatile long serving;
+};
+
+void InitTicketLock(TicketLock* Lock);
+void AcquireTicketLock(TicketLock* Lock);
+void ReleaseTicketLock(TicketLock* Lock);
+
+// =============================================
+//  Hybrid mutex
+//
+//  Spins for a while and then sleeps on the lock word with WaitOnAddress,
+//  an uncontended acquire and release is a single interlocked operation.
+//  Before Windows 8 the waiters sleep on a condition variable instead.
+
+#define HYBRID_MUTEX_SPIN_COUNT 4000
+
+struct HybridMutex
+{
+    volatile long state; // 0 - unlocked, 1 - locked, 2 - locked and there may be sleeping waiters
+};
+
+#define HYBRID_MUTEX_INIT { 0 }
+
+void AcquireHybridMutex(HybridMutex* Mutex);
+bool TryAcquireHybridMutex(HybridMutex* Mutex);
+void ReleaseHybridMutex(HybridMutex* Mutex);
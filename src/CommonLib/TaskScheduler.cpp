@@ -0,0 +1,520 @@
+#include "TaskScheduler.h"
+#include "CommonLib.h"
+#include "Topology.h"
+#include <stdlib.h>
+#include <string.h>
+#include <malloc.h>
+#include <intrin.h>
+
+// Capacity of a worker deque, it should be a power of two
+#define TASK_DEQUE_SIZE      0x1000
+// Max amount of tasks a worker takes from the injection queue at once
+#define TASK_INJECT_BATCH    32
+// Search rounds an idle worker makes before parking
+#define TASK_SPIN_ROUNDS     64
+
+// =============================================
+
+struct TaskDeque
+{
+    __declspec(align(64)) volatile long top;
+    __declspec(align(64)) volatile long bottom;
+    TaskItem* items;
+};
+
+struct TaskSchedulerContext;
+
+struct TaskWorker
+{
+    TaskDeque             deque;
+    TaskSchedulerContext* scheduler;
+    HANDLE                thread;
+    HANDLE                wakeEvent;
+    volatile long         parked;
+    unsigned int          index;
+    unsigned int          random;
+};
+
+struct TaskSchedulerContext
+{
+    TaskWorker*   workers;
+    unsigned int  workersCount;
+
+    SpinAtom      injectLock;
+    TaskItem*     injected;
+    unsigned long injectedMask;
+    unsigned long injectedHead;
+    volatile long injectedCount;
+
+    volatile long parkedCount;
+    volatile long pendingTasks;
+    volatile long stopping;
+};
+
+static _declspec(thread) TaskWorker* st_CurrentWorker = NULL;
+
+// =============================================
+//  Chase-Lev deque
+//
+//  Indices only grow, a difference of two indices is computed in unsigned
+//  arithmetic therefore a wrap-around doesn't break comparisons.
+
+static inline long GetDequeDistance(long Bottom, long Top)
+{
+    return (long)((unsigned long)Bottom - (unsigned long)Top);
+}
+
+static bool PushTaskDeque(TaskDeque* Deque, const TaskItem* Task)
+{
+    long bottom = Deque->bottom;
+    long top = Deque->top;
+
+    if (GetDequeDistance(bottom, top) >= TASK_DEQUE_SIZE)
+        return false;
+
+    Deque->items[bottom & (TASK_DEQUE_SIZE - 1)] = *Task;
+
+    // x86 doesn't reorder stores, the barrier keeps the compiler from it
+    _ReadWriteBarrier();
+    Deque->bottom = bottom + 1;
+    return true;
+}
+
+static bool PopTaskDeque(TaskDeque* Deque, TaskItem* Task)
+{
+    long bottom = Deque->bottom - 1;
+    long top;
+
+    // The store of the bottom should be visible before the top is read, it
+    // requires a full barrier
+    ::InterlockedExchange(&Deque->bottom, bottom);
+    top = Deque->top;
+
+    if (GetDequeDistance(bottom, top) < 0)
+    {
+        Deque->bottom = top;
+        return false;
+    }
+
+    *Task = Deque->items[bottom & (TASK_DEQUE_SIZE - 1)];
+
+    if (bottom != top)
+        return true;
+
+    // The last task, race with thieves for it
+    if (::InterlockedCompareExchange(&Deque->top, top + 1, top) != top)
+    {
+        Deque->bottom = top + 1;
+        return false;
+    }
+
+    Deque->bottom = top + 1;
+    return true;
+}
+
+static bool StealTaskDeque(TaskDeque* Deque, TaskItem* Task)
+{
+    long top = Deque->top;
+    long bottom;
+
+    _ReadWriteBarrier();
+    bottom = Deque->bottom;
+
+    if (GetDequeDistance(bottom, top) <= 0)
+        return false;
+
+    *Task = Deque->items[top & (TASK_DEQUE_SIZE - 1)];
+
+    return (::InterlockedCompareExchange(&Deque->top, top + 1, top) == top);
+}
+
+static bool IsTaskDequeEmpty(TaskDeque* Deque)
+{
+    return (GetDequeDistance(Deque->bottom, Deque->top) <= 0);
+}
+
+// =============================================
+//  Injection queue
+
+static unsigned int InjectTasks(TaskSchedulerContext* Scheduler, const TaskItem* Tasks, unsigned int Count)
+{
+    unsigned int i, capacity = Scheduler->injectedMask + 1;
+
+    AcquireSpinLock(&Scheduler->injectLock);
+
+    if (Count > capacity - (unsigned int)Scheduler->injectedCount)
+        Count = capacity - (unsigned int)Scheduler->injectedCount;
+
+    for (i = 0; i < Count; i++)
+        Scheduler->injected[(Scheduler->injectedHead + Scheduler->injectedCount + i) & Scheduler->injectedMask] = Tasks[i];
+
+    Scheduler->injectedCount += Count;
+
+    ReleaseSpinLock(&Scheduler->injectLock);
+
+    return Count;
+}
+
+// Moves a batch of injected tasks to the worker's deque and returns one of them
+static bool TakeInjectedTasks(TaskSchedulerContext* Scheduler, TaskWorker* Worker, TaskItem* Task)
+{
+    unsigned int i, count;
+
+    if (!Scheduler->injectedCount)
+        return false;
+
+    AcquireSpinLock(&Scheduler->injectLock);
+
+    count = (unsigned int)Scheduler->injectedCount;
+    if (count > TASK_INJECT_BATCH)
+        count = TASK_INJECT_BATCH;
+
+    if (count)
+    {
+        *Task = Scheduler->injected[Scheduler->injectedHead];
+
+        // Our deque is empty here, the rest of the batch always fits into it
+        for (i = 1; i < count; i++)
+            PushTaskDeque(&Worker->deque, &Scheduler->injected[(Scheduler->injectedHead + i) & Scheduler->injectedMask]);
+
+        Scheduler->injectedHead = (Scheduler->injectedHead + count) & Scheduler->injectedMask;
+        Scheduler->injectedCount -= count;
+    }
+
+    ReleaseSpinLock(&Scheduler->injectLock);
+
+    return (count != 0);
+}
+
+// =============================================
+//  Parking
+
+static bool IsWorkAvailable(TaskSchedulerContext* Scheduler)
+{
+    unsigned int i;
+
+    if (Scheduler->injectedCount)
+        return true;
+
+    for (i = 0; i < Scheduler->workersCount; i++)
+        if (!IsTaskDequeEmpty(&Scheduler->workers[i].deque))
+            return true;
+
+    return false;
+}
+
+static void ParkWorker(TaskWorker* Worker)
+{
+    TaskSchedulerContext* scheduler = Worker->scheduler;
+
+    // A worker announces itself and then checks for work once again. A producer
+    // publishes work and then checks for parked workers, the interlocked
+    // operations on both sides guarantee one of them sees the other.
+    ::InterlockedExchange(&Worker->parked, 1);
+    ::InterlockedIncrement(&scheduler->parkedCount);
+
+    if (!IsWorkAvailable(scheduler) && !scheduler->stopping)
+        ::WaitForSingleObject(Worker->wakeEvent, INFINITE);
+
+    // If a producer has already claimed us the event stays signaled and the
+    // next parking returns immediately, it's harmless
+    ::InterlockedExchange(&Worker->parked, 0);
+    ::InterlockedDecrement(&scheduler->parkedCount);
+}
+
+static void WakeWorkers(TaskSchedulerContext* Scheduler, unsigned int Count)
+{
+    unsigned int i;
+
+    ::MemoryBarrier();
+
+    if (!Scheduler->parkedCount)
+        return;
+
+    for (i = 0; i < Scheduler->workersCount && Count; i++)
+    {
+        TaskWorker* worker = Scheduler->workers + i;
+
+        if (worker->parked && ::InterlockedCompareExchange(&worker->parked, 0, 1) == 1)
+        {
+            ::SetEvent(worker->wakeEvent);
+            Count--;
+        }
+    }
+}
+
+// =============================================
+
+static bool StealTask(TaskSchedulerContext* Scheduler, TaskWorker* Worker, TaskItem* Task)
+{
+    unsigned int i, victim;
+
+    // xorshift, it only spreads thieves over victims
+    Worker->random ^= Worker->random << 13;
+    Worker->random ^= Worker->random >> 17;
+    Worker->random ^= Worker->random << 5;
+
+    victim = Worker->random % Scheduler->workersCount;
+
+    for (i = 0; i < Scheduler->workersCount; i++, victim = (victim + 1) % Scheduler->workersCount)
+    {
+        if (victim == Worker->index)
+            continue;
+
+        if (StealTaskDeque(&Scheduler->workers[victim].deque, Task))
+            return true;
+    }
+
+    return false;
+}
+
+static bool FindTask(TaskWorker* Worker, TaskItem* Task)
+{
+    TaskSchedulerContext* scheduler = Worker->scheduler;
+
+    if (PopTaskDeque(&Worker->deque, Task))
+        return true;
+
+    if (TakeInjectedTasks(scheduler, Worker, Task))
+    {
+        // Let the others steal the rest of the batch
+        if (!IsTaskDequeEmpty(&Worker->deque))
+            WakeWorkers(scheduler, 1);
+
+        return true;
+    }
+
+    return StealTask(scheduler, Worker, Task);
+}
+
+static void ExecuteTask(TaskSchedulerContext* Scheduler, TaskItem* Task)
+{
+    Task->routine(Task->parameter);
+    ::InterlockedDecrement(&Scheduler->pendingTasks);
+}
+
+static DWORD WINAPI TaskWorkerRoutine(LPVOID Parameter)
+{
+    TaskWorker* worker = (TaskWorker*)Parameter;
+    TaskSchedulerContext* scheduler = worker->scheduler;
+    TaskItem task;
+    unsigned int i;
+
+    st_CurrentWorker = worker;
+
+    while (true)
+    {
+        if (FindTask(worker, &task))
+        {
+            ExecuteTask(scheduler, &task);
+            continue;
+        }
+
+        for (i = 0; i < TASK_SPIN_ROUNDS; i++)
+        {
+            _mm_pause();
+
+            if (FindTask(worker, &task))
+                break;
+        }
+
+        if (i < TASK_SPIN_ROUNDS)
+        {
+            ExecuteTask(scheduler, &task);
+            continue;
+        }
+
+        if (scheduler->stopping)
+            break;
+
+        ParkWorker(worker);
+    }
+
+    st_CurrentWorker = NULL;
+    return 0;
+}
+
+// =============================================
+
+static void ReleaseScheduler(TaskSchedulerContext* Scheduler)
+{
+    unsigned int i;
+
+    if (Scheduler->workers)
+    {
+        for (i = 0; i < Scheduler->workersCount; i++)
+        {
+            TaskWorker* worker = Scheduler->workers + i;
+
+            if (worker->thread)
+                ::CloseHandle(worker->thread);
+
+            if (worker->wakeEvent)
+                ::CloseHandle(worker->wakeEvent);
+
+            free(worker->deque.items);
+        }
+
+        _aligned_free(Scheduler->workers);
+    }
+
+    free(Scheduler->injected);
+    free(Scheduler);
+}
+
+static void StopWorkers(TaskSchedulerContext* Scheduler)
+{
+    unsigned int i;
+
+    ::InterlockedExchange(&Scheduler->stopping, 1);
+
+    for (i = 0; i < Scheduler->workersCount; i++)
+    {
+        TaskWorker* worker = Scheduler->workers + i;
+
+        if (!worker->thread)
+            continue;
+
+        ::SetEvent(worker->wakeEvent);
+        ::WaitForSingleObject(worker->thread, INFINITE);
+    }
+}
+
+void* CreateTaskScheduler(unsigned int WorkersCount, unsigned int QueueSize)
+{
+    TaskSchedulerContext* scheduler;
+    unsigned long capacity = 1;
+    unsigned int i;
+    bool result = false;
+
+    if (!WorkersCount)
+        WorkersCount = GetAmountOfCPUCores();
+
+    while (capacity < QueueSize)
+        capacity <<= 1;
+
+    scheduler = (TaskSchedulerContext*)malloc(sizeof(TaskSchedulerContext));
+    if (!scheduler)
+        return NULL;
+
+    memset(scheduler, 0, sizeof(TaskSchedulerContext));
+
+    scheduler->injected = (TaskItem*)malloc(sizeof(TaskItem) * capacity);
+    if (!scheduler->injected)
+        goto ReleaseBlock;
+
+    scheduler->injectedMask = capacity - 1;
+
+    scheduler->workers = (TaskWorker*)_aligned_malloc(sizeof(TaskWorker) * WorkersCount, __alignof(TaskWorker));
+    if (!scheduler->workers)
+        goto ReleaseBlock;
+
+    memset(scheduler->workers, 0, sizeof(TaskWorker) * WorkersCount);
+    scheduler->workersCount = WorkersCount;
+
+    for (i = 0; i < WorkersCount; i++)
+    {
+        TaskWorker* worker = scheduler->workers + i;
+
+        worker->scheduler = scheduler;
+        worker->index = i;
+        worker->random = 2463534242u + i * 2654435761u;
+
+        worker->deque.items = (TaskItem*)malloc(sizeof(TaskItem) * TASK_DEQUE_SIZE);
+        if (!worker->deque.items)
+            goto ReleaseBlock;
+
+        worker->wakeEvent = ::CreateEventW(NULL, FALSE, FALSE, NULL);
+        if (!worker->wakeEvent)
+            goto ReleaseBlock;
+    }
+
+    for (i = 0; i < WorkersCount; i++)
+    {
+        TaskWorker* worker = scheduler->workers + i;
+
+        worker->thread = ::CreateThread(NULL, 0, TaskWorkerRoutine, worker, 0, NULL);
+        if (!worker->thread)
+            goto ReleaseBlock;
+
+        // Tasks block on I/O, a worker pinned to a core would leave it idle meanwhile
+        // while others queue up on a busy one. Workers are only spread over NUMA
+        // nodes, the system schedules them within a node.
+        if (GetCpuTopology()->numaNodesCount > 1)
+            SetThreadAffinityToNumaNode(worker->thread, i % GetCpuTopology()->numaNodesCount);
+    }
+
+    result = true;
+
+ReleaseBlock:
+
+    if (!result)
+    {
+        if (scheduler->workers)
+            StopWorkers(scheduler);
+
+        ReleaseScheduler(scheduler);
+        scheduler = NULL;
+    }
+
+    return scheduler;
+}
+
+void DestroyTaskScheduler(void* Scheduler)
+{
+    TaskSchedulerContext* scheduler = (TaskSchedulerContext*)Scheduler;
+
+    WaitForTaskSchedulerIdle(scheduler);
+    StopWorkers(scheduler);
+    ReleaseScheduler(scheduler);
+}
+
+bool SubmitTask(void* Scheduler, TaskRoutine Routine, void* Parameter)
+{
+    TaskItem task;
+
+    task.routine = Routine;
+    task.parameter = Parameter;
+
+    return (SubmitTaskBatch(Scheduler, &task, 1) == 1);
+}
+
+unsigned int SubmitTaskBatch(void* Scheduler, const TaskItem* Tasks, unsigned int Count)
+{
+    TaskSchedulerContext* scheduler = (TaskSchedulerContext*)Scheduler;
+    TaskWorker* worker = st_CurrentWorker;
+    unsigned int submitted = 0;
+
+    ::InterlockedExchangeAdd(&scheduler->pendingTasks, (long)Count);
+
+    // A worker of this pool keeps its own tasks local, others steal them if they're idle
+    if (worker && worker->scheduler == scheduler)
+    {
+        while (submitted < Count && PushTaskDeque(&worker->deque, Tasks + submitted))
+            submitted++;
+    }
+
+    if (submitted < Count)
+        submitted += InjectTasks(scheduler, Tasks + submitted, Count - submitted);
+
+    if (submitted < Count)
+        ::InterlockedExchangeAdd(&scheduler->pendingTasks, -(long)(Count - submitted));
+
+    if (submitted)
+        WakeWorkers(scheduler, submitted);
+
+    return submitted;
+}
+
+void WaitForTaskSchedulerIdle(void* Scheduler)
+{
+    TaskSchedulerContext* scheduler = (TaskSchedulerContext*)Scheduler;
+
+    while (scheduler->pendingTasks)
+        ::Sleep(1);
+}
+
+unsigned int GetTaskSchedulerWorkersCount(void* Scheduler)
+{
+    return ((TaskSchedulerContext*)Scheduler)->workersCount;
+}
@@ -0,0 +1,37 @@
+#pragma once
+
+// =============================================
+//  Work-stealing task scheduler
+//
+//  Every worker owns a Chase-Lev deque: it pushes and pops tasks at the bottom
+//  while idle workers steal from the top. Tasks submitted from outside of the
+//  pool go to a shared injection queue, a worker moves them to its deque in
+//  batches. Idle workers park on their own event and are woken only when work
+//  is published while they sleep.
+//
+//  Tasks are executed in no particular order.
+
+typedef void(*TaskRoutine)(void* Parameter);
+
+struct TaskItem
+{
+    TaskRoutine routine;
+    void*       parameter;
+};
+
+// WorkersCount 0 means a worker per logical processor
+void* CreateTaskScheduler(unsigned int WorkersCount = 0, unsigned int QueueSize = 0x10000);
+
+// Executes all submitted tasks and stops workers
+void DestroyTaskScheduler(void* Scheduler);
+
+// Returns false if queues are full, a caller can run the task itself in this case
+bool SubmitTask(void* Scheduler, TaskRoutine Routine, void* Parameter);
+
+// Returns the amount of tasks that have been submitted, they are always the
+// first ones of the array. A caller can run the rest itself.
+unsigned int SubmitTaskBatch(void* Scheduler, const TaskItem* Tasks, unsigned int Count);
+
+void WaitForTaskSchedulerIdle(void* Scheduler);
+
+unsigned int GetTaskSchedulerWorkersCount(void* Scheduler);
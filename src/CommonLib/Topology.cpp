@@ -0,0 +1,293 @@
+#include "Topology.h"
+#include "CommonLib.h"
+#include <stdlib.h>
+#include <string.h>
+
+// =============================================
+
+static CpuTopology* volatile s_Topology = NULL;
+
+static bool IsAffinityOverlapped(const GROUP_AFFINITY* First, const GROUP_AFFINITY* Second)
+{
+    return (First->Group == Second->Group && (First->Mask & Second->Mask) != 0);
+}
+
+static unsigned int CountAffinityBits(KAFFINITY Mask)
+{
+    unsigned int count = 0;
+
+    while (Mask)
+    {
+        Mask &= Mask - 1;
+        count++;
+    }
+
+    return count;
+}
+
+static PSYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX QueryProcessorInformation(DWORD* Size)
+{
+    PSYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX info = NULL;
+    DWORD size = 0;
+
+    while (!::GetLogicalProcessorInformationEx(RelationAll, info, &size))
+    {
+        free(info);
+
+        if (::GetLastError() != ERROR_INSUFFICIENT_BUFFER)
+            return NULL;
+
+        info = (PSYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX)malloc(size);
+        if (!info)
+            return NULL;
+    }
+
+    *Size = size;
+    return info;
+}
+
+#define FOR_EACH_PROCESSOR_INFO(Entry, Info, Size) \
+    for (Entry = Info; \
+         (char*)Entry < (char*)Info + Size; \
+         Entry = (PSYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX)((char*)Entry + Entry->Size))
+
+static CpuTopology* AllocateTopology(unsigned int CoresCount, unsigned int CacheGroupsCount)
+{
+    CpuTopology* topology;
+    size_t size = sizeof(CpuTopology) + sizeof(CpuCoreInfo) * CoresCount + sizeof(CpuCacheGroupInfo) * CacheGroupsCount;
+
+    topology = (CpuTopology*)malloc(size);
+    if (!topology)
+        return NULL;
+
+    memset(topology, 0, size);
+
+    topology->cores = (CpuCoreInfo*)(topology + 1);
+    topology->cacheGroups = (CpuCacheGroupInfo*)(topology->cores + CoresCount);
+    return topology;
+}
+
+static CpuTopology* BuildFallbackTopology()
+{
+    static CpuTopology s_fallback;
+    static CpuCoreInfo s_cores[sizeof(KAFFINITY) * 8];
+    CpuTopology* topology;
+    unsigned int i, count = GetAmountOfCPUCores();
+
+    if (count > _countof(s_cores))
+        count = _countof(s_cores);
+
+    if (!count)
+        count = 1;
+
+    topology = AllocateTopology(count, 0);
+    if (!topology)
+    {
+        // The static copy keeps GetCpuTopology() infallible
+        topology = &s_fallback;
+        topology->cores = s_cores;
+    }
+
+    topology->logicalCount = count;
+    topology->coresCount = count;
+    topology->numaNodesCount = 1;
+
+    for (i = 0; i < count; i++)
+    {
+        topology->cores[i].affinity.Group = 0;
+        topology->cores[i].affinity.Mask = (KAFFINITY)1 << i;
+        topology->cores[i].siblingsCount = 1;
+    }
+
+    return topology;
+}
+
+static CpuTopology* BuildTopology()
+{
+    PSYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX info, entry;
+    CpuTopology* topology = NULL;
+    unsigned int coresCount = 0, cacheGroupsCount = 0, cacheLevel = 0;
+    unsigned int i, j;
+    DWORD size;
+
+    info = QueryProcessorInformation(&size);
+    if (!info)
+        return BuildFallbackTopology();
+
+    // The last level cache is the highest unified or data cache that is reported
+
+    FOR_EACH_PROCESSOR_INFO(entry, info, size)
+    {
+        if (entry->Relationship == RelationProcessorCore)
+            coresCount++;
+        else if (entry->Relationship == RelationCache && entry->Cache.Type != CacheInstruction && entry->Cache.Level > cacheLevel)
+            cacheLevel = entry->Cache.Level;
+    }
+
+    FOR_EACH_PROCESSOR_INFO(entry, info, size)
+    {
+        if (entry->Relationship == RelationCache && entry->Cache.Type != CacheInstruction && entry->Cache.Level == cacheLevel)
+            cacheGroupsCount++;
+    }
+
+    if (!coresCount)
+    {
+        free(info);
+        return BuildFallbackTopology();
+    }
+
+    topology = AllocateTopology(coresCount, cacheGroupsCount);
+    if (!topology)
+    {
+        free(info);
+        return BuildFallbackTopology();
+    }
+
+    topology->numaNodesCount = 1;
+
+    FOR_EACH_PROCESSOR_INFO(entry, info, size)
+    {
+        if (entry->Relationship == RelationProcessorCore)
+        {
+            CpuCoreInfo* core = topology->cores + topology->coresCount++;
+
+            core->affinity = entry->Processor.GroupMask[0];
+            core->siblingsCount = CountAffinityBits(core->affinity.Mask);
+            topology->logicalCount += core->siblingsCount;
+        }
+        else if (entry->Relationship == RelationCache && entry->Cache.Type != CacheInstruction && entry->Cache.Level == cacheLevel)
+        {
+            CpuCacheGroupInfo* group = topology->cacheGroups + topology->cacheGroupsCount++;
+
+            group->affinity = entry->Cache.GroupMask;
+            group->level = entry->Cache.Level;
+            group->size = entry->Cache.CacheSize;
+        }
+    }
+
+    // Cores are mapped to nodes and cache groups by their processor masks
+
+    FOR_EACH_PROCESSOR_INFO(entry, info, size)
+    {
+        if (entry->Relationship != RelationNumaNode)
+            continue;
+
+        if (entry->NumaNode.NodeNumber >= topology->numaNodesCount)
+            topology->numaNodesCount = entry->NumaNode.NodeNumber + 1;
+
+        for (i = 0; i < topology->coresCount; i++)
+            if (IsAffinityOverlapped(&topology->cores[i].affinity, &entry->NumaNode.GroupMask))
+                topology->cores[i].numaNode = entry->NumaNode.NodeNumber;
+    }
+
+    for (i = 0; i < topology->coresCount; i++)
+    {
+        for (j = 0; j < topology->cacheGroupsCount; j++)
+        {
+            if (IsAffinityOverlapped(&topology->cores[i].affinity, &topology->cacheGroups[j].affinity))
+            {
+                topology->cores[i].cacheGroup = j;
+                break;
+            }
+        }
+    }
+
+    free(info);
+    return topology;
+}
+
+const CpuTopology* GetCpuTopology()
+{
+    CpuTopology* topology = s_Topology;
+
+    if (topology)
+        return topology;
+
+    topology = BuildTopology();
+
+    // Concurrent callers could build it too, the first one wins
+    if (::InterlockedCompareExchangePointer((PVOID volatile*)&s_Topology, topology, NULL) != NULL)
+    {
+        if (topology->cores != (CpuCoreInfo*)(topology + 1))
+            return s_Topology; // The static fallback isn't released
+
+        free(topology);
+        topology = s_Topology;
+    }
+
+    return topology;
+}
+
+unsigned int GetAmountOfPhysicalCores()
+{
+    return GetCpuTopology()->coresCount;
+}
+
+// =============================================
+
+bool SetThreadAffinityToCore(HANDLE Thread, unsigned int Core)
+{
+    const CpuTopology* topology = GetCpuTopology();
+
+    if (Core >= topology->coresCount)
+        return false;
+
+    return (::SetThreadGroupAffinity(Thread, &topology->cores[Core].affinity, NULL) != FALSE);
+}
+
+bool SetThreadAffinityToCacheGroup(HANDLE Thread, unsigned int CacheGroup)
+{
+    const CpuTopology* topology = GetCpuTopology();
+
+    if (CacheGroup >= topology->cacheGroupsCount)
+        return false;
+
+    return (::SetThreadGroupAffinity(Thread, &topology->cacheGroups[CacheGroup].affinity, NULL) != FALSE);
+}
+
+bool SetThreadAffinityToNumaNode(HANDLE Thread, unsigned int Node)
+{
+    GROUP_AFFINITY affinity;
+
+    memset(&affinity, 0, sizeof(affinity));
+
+    if (!::GetNumaNodeProcessorMaskEx((USHORT)Node, &affinity) || !affinity.Mask)
+        return false;
+
+    return (::SetThreadGroupAffinity(Thread, &affinity, NULL) != FALSE);
+}
+
+unsigned int GetCoreForWorker(unsigned int WorkerIndex)
+{
+    return WorkerIndex % GetCpuTopology()->coresCount;
+}
+
+unsigned int GetCurrentNumaNode()
+{
+    PROCESSOR_NUMBER processor;
+    USHORT node;
+
+    ::GetCurrentProcessorNumberEx(&processor);
+
+    if (!::GetNumaProcessorNodeEx(&processor, &node))
+        return 0;
+
+    return node;
+}
+
+void* AllocateNumaLocalMemory(size_t Size, unsigned int Node)
+{
+    void* memory;
+
+    memory = ::VirtualAllocExNuma(::GetCurrentProcess(), NULL, Size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE, Node);
+    if (!memory)
+        memory = ::VirtualAlloc(NULL, Size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+
+    return memory;
+}
+
+void FreeNumaLocalMemory(void* Memory)
+{
+    if (Memory)
+        ::VirtualFree(Memory, 0, MEM_RELEASE);
+}
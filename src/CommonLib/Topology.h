@@ -0,0 +1,59 @@
+#pragma once
+
+#include <Windows.h>
+
+// =============================================
+//  CPU topology
+//
+//  Built once per process from GetLogicalProcessorInformationEx(). Cores are
+//  physical cores, every core may run several SMT siblings. A cache group is
+//  a set of cores that share the last level cache.
+
+struct CpuCoreInfo
+{
+    GROUP_AFFINITY affinity;     // all SMT siblings of the core
+    unsigned int   siblingsCount;
+    unsigned int   numaNode;
+    unsigned int   cacheGroup;
+};
+
+struct CpuCacheGroupInfo
+{
+    GROUP_AFFINITY affinity;
+    unsigned int   level;
+    unsigned int   size;
+};
+
+struct CpuTopology
+{
+    unsigned int       logicalCount;
+    unsigned int       coresCount;
+    unsigned int       numaNodesCount; // the highest node number + 1
+    unsigned int       cacheGroupsCount;
+    CpuCoreInfo*       cores;
+    CpuCacheGroupInfo* cacheGroups;
+};
+
+// Never returns NULL, if the information isn't available every logical
+// processor is reported as a separate core of the node 0
+const CpuTopology* GetCpuTopology();
+
+unsigned int GetAmountOfPhysicalCores();
+
+// =============================================
+//  Thread placement
+
+bool SetThreadAffinityToCore(HANDLE Thread, unsigned int Core);
+bool SetThreadAffinityToCacheGroup(HANDLE Thread, unsigned int CacheGroup);
+bool SetThreadAffinityToNumaNode(HANDLE Thread, unsigned int Node);
+
+// Maps workers to physical cores round-robin, so a core gets a second worker
+// only when every core already has one. Suits CPU-bound workers only, a pinned
+// thread blocked on I/O leaves its core idle.
+unsigned int GetCoreForWorker(unsigned int WorkerIndex);
+
+unsigned int GetCurrentNumaNode();
+
+// Commits memory on a preferred NUMA node, the memory is released by FreeNumaLocalMemory()
+void* AllocateNumaLocalMemory(size_t Size, unsigned int Node);
+void FreeNumaLocalMemory(void* Memory);
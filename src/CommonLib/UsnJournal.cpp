@@ -0,0 +1,412 @@
+#include "UsnJournal.h"
+#include <stdlib.h>
+#include <string.h>
+#include <wchar.h>
+
+// The path cache is reset when it's filled by 3/4
+#define USN_DIRECTORY_PATHS   0x1000
+#define USN_PATH_BUFFER       0x8000
+
+// =============================================
+
+struct UsnDirectoryPath
+{
+    DWORDLONG reference; // 0 for a free slot
+    wchar_t*  path;
+    size_t    length;
+};
+
+struct UsnJournalContext
+{
+    HANDLE            volume;
+    HANDLE            event;
+    OVERLAPPED        overlapped;
+    DWORDLONG         journalId;
+    USN               nextUsn;
+    DWORD             reasonMask;
+    char*             buffer;
+    size_t            bufferSize;
+    UsnDirectoryPath* paths;
+    unsigned int      pathsCount;
+    wchar_t*          pathBuffer;
+};
+
+static inline unsigned int HashReference(DWORDLONG Reference, unsigned int Size)
+{
+    return (unsigned int)((Reference * 0x9E3779B97F4A7C15ull) >> 40) & (Size - 1);
+}
+
+// =============================================
+
+static bool ControlVolume(UsnJournalContext* Context, DWORD Code, void* Input, DWORD InputSize,
+                          void* Output, DWORD OutputSize, DWORD* Returned, HANDLE StopEvent)
+{
+    HANDLE handles[2];
+    DWORD count = 1;
+    DWORD wait;
+
+    if (!::DeviceIoControl(Context->volume, Code, Input, InputSize, Output, OutputSize, Returned, &Context->overlapped)
+        && ::GetLastError() != ERROR_IO_PENDING)
+        return false;
+
+    handles[0] = Context->event;
+    if (StopEvent)
+        handles[count++] = StopEvent;
+
+    wait = ::WaitForMultipleObjects(count, handles, FALSE, INFINITE);
+    if (wait != WAIT_OBJECT_0)
+    {
+        ::CancelIoEx(Context->volume, &Context->overlapped);
+        ::GetOverlappedResult(Context->volume, &Context->overlapped, Returned, TRUE);
+        ::SetLastError(ERROR_OPERATION_ABORTED);
+        return false;
+    }
+
+    return (::GetOverlappedResult(Context->volume, &Context->overlapped, Returned, FALSE) != FALSE);
+}
+
+static bool QueryJournal(UsnJournalContext* Context)
+{
+    USN_JOURNAL_DATA_V0 data;
+    DWORD returned;
+
+    if (!ControlVolume(Context, FSCTL_QUERY_USN_JOURNAL, NULL, 0, &data, sizeof(data), &returned, NULL))
+        return false;
+
+    Context->journalId = data.UsnJournalID;
+    Context->nextUsn = data.NextUsn;
+    return true;
+}
+
+static HANDLE OpenVolume(const wchar_t* Path)
+{
+    wchar_t volumePath[MAX_PATH + 1];
+    wchar_t volumeName[MAX_PATH + 1];
+    size_t length;
+
+    if (!::GetVolumePathNameW(Path, volumePath, _countof(volumePath)))
+        return INVALID_HANDLE_VALUE;
+
+    if (!::GetVolumeNameForVolumeMountPointW(volumePath, volumeName, _countof(volumeName)))
+        return INVALID_HANDLE_VALUE;
+
+    // "\\?\Volume{GUID}\" opens the root directory, the volume itself is without a slash
+    length = wcslen(volumeName);
+    if (length > 0 && volumeName[length - 1] == L'\\')
+        volumeName[length - 1] = L'\0';
+
+    return ::CreateFileW(
+        volumeName,
+        GENERIC_READ,
+        FILE_SHARE_READ | FILE_SHARE_WRITE,
+        NULL,
+        OPEN_EXISTING,
+        FILE_FLAG_OVERLAPPED,
+        NULL
+    );
+}
+
+void* OpenUsnJournal(const wchar_t* Path, DWORD ReasonMask, size_t BufferSize)
+{
+    UsnJournalContext* context;
+    bool result = false;
+
+    context = (UsnJournalContext*)malloc(sizeof(UsnJournalContext));
+    if (!context)
+        return NULL;
+
+    memset(context, 0, sizeof(UsnJournalContext));
+
+    context->reasonMask = ReasonMask;
+    context->bufferSize = (BufferSize < 0x1000 ? 0x1000 : BufferSize);
+
+    context->volume = OpenVolume(Path);
+    if (context->volume == INVALID_HANDLE_VALUE)
+        goto ReleaseBlock;
+
+    context->event = ::CreateEventW(NULL, TRUE, FALSE, NULL);
+    if (!context->event)
+        goto ReleaseBlock;
+
+    context->overlapped.hEvent = context->event;
+
+    context->buffer = (char*)::VirtualAlloc(NULL, context->bufferSize, MEM_COMMIT, PAGE_READWRITE);
+    context->paths = (UsnDirectoryPath*)calloc(USN_DIRECTORY_PATHS, sizeof(UsnDirectoryPath));
+    context->pathBuffer = (wchar_t*)malloc(USN_PATH_BUFFER * sizeof(wchar_t));
+
+    if (!context->buffer || !context->paths || !context->pathBuffer)
+    {
+        ::SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+        goto ReleaseBlock;
+    }
+
+    // Fails with ERROR_JOURNAL_NOT_ACTIVE if the journal isn't enabled, we don't
+    // create it on behalf of a user
+    if (!QueryJournal(context))
+        goto ReleaseBlock;
+
+    result = true;
+
+ReleaseBlock:
+
+    if (!result)
+    {
+        DWORD error = ::GetLastError();
+        CloseUsnJournal(context);
+        ::SetLastError(error);
+        return NULL;
+    }
+
+    return context;
+}
+
+void CloseUsnJournal(void* Journal)
+{
+    UsnJournalContext* context = (UsnJournalContext*)Journal;
+
+    if (context->volume && context->volume != INVALID_HANDLE_VALUE)
+        ::CloseHandle(context->volume);
+
+    if (context->event)
+        ::CloseHandle(context->event);
+
+    if (context->buffer)
+        ::VirtualFree(context->buffer, 0, MEM_RELEASE);
+
+    if (context->paths)
+    {
+        InvalidateUsnDirectoryPaths(context);
+        free(context->paths);
+    }
+
+    if (context->pathBuffer)
+        free(context->pathBuffer);
+
+    free(context);
+}
+
+HANDLE GetUsnJournalVolume(void* Journal)
+{
+    return ((UsnJournalContext*)Journal)->volume;
+}
+
+// =============================================
+
+bool ReadUsnJournal(void* Journal, HANDLE StopEvent, UsnRecordRoutine Callback, void* Parameter)
+{
+    UsnJournalContext* context = (UsnJournalContext*)Journal;
+    READ_USN_JOURNAL_DATA_V0 read;
+    DWORD returned, offset;
+
+    memset(&read, 0, sizeof(read));
+    read.StartUsn = context->nextUsn;
+    read.ReasonMask = context->reasonMask;
+    read.ReturnOnlyOnClose = FALSE;
+    read.Timeout = 0;
+    read.BytesToWaitFor = 1; // wait for the first record, then take everything available
+    read.UsnJournalID = context->journalId;
+
+    if (!ControlVolume(context, FSCTL_READ_USN_JOURNAL, &read, sizeof(read), context->buffer, (DWORD)context->bufferSize, &returned, StopEvent))
+    {
+        // We are too slow and records have been overwritten, the next read
+        // continues with the current position
+        if (::GetLastError() == ERROR_JOURNAL_ENTRY_DELETED)
+        {
+            if (QueryJournal(context))
+                ::SetLastError(ERROR_JOURNAL_ENTRY_DELETED);
+            return false;
+        }
+
+        return false;
+    }
+
+    if (returned < sizeof(USN))
+        return true;
+
+    context->nextUsn = *(USN*)context->buffer;
+
+    for (offset = sizeof(USN); offset + FIELD_OFFSET(USN_RECORD_V2, FileName) <= returned; )
+    {
+        const USN_RECORD_V2* record = (const USN_RECORD_V2*)(context->buffer + offset);
+
+        if (!record->RecordLength || offset + record->RecordLength > returned)
+            break;
+
+        offset += record->RecordLength;
+
+        if (record->MajorVersion == 2)
+            Callback(record, Parameter);
+    }
+
+    return true;
+}
+
+// =============================================
+
+bool GetVolumeRelativePath(HANDLE File, wchar_t* Buffer, size_t BufferLength, size_t* Length)
+{
+    DWORD length;
+
+    length = ::GetFinalPathNameByHandleW(File, Buffer, (DWORD)BufferLength, FILE_NAME_NORMALIZED | VOLUME_NAME_NONE);
+    if (!length)
+        return false;
+
+    if (length >= BufferLength)
+    {
+        ::SetLastError(ERROR_INSUFFICIENT_BUFFER);
+        return false;
+    }
+
+    // The volume root is returned as "\"
+    if (length == 1 && Buffer[0] == L'\\')
+        length = 0;
+
+    Buffer[length] = L'\0';
+    *Length = length;
+    return true;
+}
+
+bool GetUsnDirectoryPath(void* Journal, DWORDLONG Reference, const wchar_t** Path, size_t* Length)
+{
+    UsnJournalContext* context = (UsnJournalContext*)Journal;
+    unsigned int index = HashReference(Reference, USN_DIRECTORY_PATHS);
+    FILE_ID_DESCRIPTOR id;
+    HANDLE directory;
+    wchar_t* path;
+    size_t length;
+    bool result;
+
+    while (context->paths[index].reference)
+    {
+        UsnDirectoryPath* entry = context->paths + index;
+
+        if (entry->reference == Reference)
+        {
+            *Path = entry->path;
+            *Length = entry->length;
+            return true;
+        }
+
+        index = (index + 1) & (USN_DIRECTORY_PATHS - 1);
+    }
+
+    id.dwSize = sizeof(id);
+    id.Type = FileIdType;
+    id.FileId.QuadPart = (LONGLONG)Reference;
+
+    directory = ::OpenFileById(
+        context->volume,
+        &id,
+        0,
+        FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+        NULL,
+        FILE_FLAG_BACKUP_SEMANTICS
+    );
+    if (directory == INVALID_HANDLE_VALUE)
+        return false;
+
+    result = GetVolumeRelativePath(directory, context->pathBuffer, USN_PATH_BUFFER, &length);
+    ::CloseHandle(directory);
+
+    if (!result)
+        return false;
+
+    path = (wchar_t*)malloc((length + 1) * sizeof(wchar_t));
+    if (!path)
+        return false;
+
+    memcpy(path, context->pathBuffer, (length + 1) * sizeof(wchar_t));
+
+    if (context->pathsCount >= USN_DIRECTORY_PATHS / 4 * 3)
+    {
+        InvalidateUsnDirectoryPaths(context);
+        index = HashReference(Reference, USN_DIRECTORY_PATHS);
+    }
+
+    context->paths[index].reference = Reference;
+    context->paths[index].path = path;
+    context->paths[index].length = length;
+    context->pathsCount++;
+
+    *Path = path;
+    *Length = length;
+    return true;
+}
+
+// Keeps probe sequences of the following entries unbroken
+static void RemovePathEntry(UsnJournalContext* Context, unsigned int Index)
+{
+    unsigned int next = Index;
+
+    free(Context->paths[Index].path);
+    Context->paths[Index].reference = 0;
+    Context->pathsCount--;
+
+    while (true)
+    {
+        unsigned int home;
+
+        next = (next + 1) & (USN_DIRECTORY_PATHS - 1);
+        if (!Context->paths[next].reference)
+            break;
+
+        home = HashReference(Context->paths[next].reference, USN_DIRECTORY_PATHS);
+
+        // The entry stays if its home slot is in (Index, next] cyclically
+        if (Index <= next ? (home > Index && home <= next) : (home > Index || home <= next))
+            continue;
+
+        Context->paths[Index] = Context->paths[next];
+        Context->paths[next].reference = 0;
+        Index = next;
+    }
+}
+
+void InvalidateUsnDirectoryPath(void* Journal, DWORDLONG Parent, const wchar_t* Name, size_t Length)
+{
+    UsnJournalContext* context = (UsnJournalContext*)Journal;
+    const wchar_t* parent;
+    size_t parentLength, length;
+    unsigned int i;
+
+    // Without the old path we can't tell affected entries
+    if (!GetUsnDirectoryPath(context, Parent, &parent, &parentLength))
+    {
+        InvalidateUsnDirectoryPaths(context);
+        return;
+    }
+
+    length = parentLength + 1 + Length;
+
+    // An entry moved to the current slot by a removal is checked again
+    for (i = 0; i < USN_DIRECTORY_PATHS; )
+    {
+        UsnDirectoryPath* entry = context->paths + i;
+
+        if (entry->reference
+            && entry->length >= length
+            && (entry->length == length || entry->path[length] == L'\\')
+            && entry->path[parentLength] == L'\\'
+            && _wcsnicmp(entry->path, parent, parentLength) == 0
+            && _wcsnicmp(entry->path + parentLength + 1, Name, Length) == 0)
+        {
+            RemovePathEntry(context, i);
+            continue;
+        }
+
+        i++;
+    }
+}
+
+void InvalidateUsnDirectoryPaths(void* Journal)
+{
+    UsnJournalContext* context = (UsnJournalContext*)Journal;
+    unsigned int i;
+
+    for (i = 0; i < USN_DIRECTORY_PATHS; i++)
+        if (context->paths[i].reference)
+            free(context->paths[i].path);
+
+    memset(context->paths, 0, sizeof(UsnDirectoryPath) * USN_DIRECTORY_PATHS);
+    context->pathsCount = 0;
+}
@@ -0,0 +1,50 @@
+#pragma once
+
+#include <Windows.h>
+#include <winioctl.h>
+
+// =============================================
+//  USN change journal reader
+//
+//  Watches a whole NTFS volume without per-directory handles: every read
+//  returns all records available at the moment up to the buffer size.
+//
+//  NTFS accumulates reasons of a file until its last handle is closed, so a
+//  record repeats reasons of earlier records for the same file. A consumer
+//  should treat them as hints and check the actual state of the file.
+//
+//  Requires administrator rights and an active journal on the volume. A reader
+//  isn't thread-safe, records and paths should be consumed by a single thread.
+
+typedef void(*UsnRecordRoutine)(const USN_RECORD_V2* Record, void* Parameter);
+
+#define USN_JOURNAL_DEFAULT_BUFFER 0x100000
+
+// Path is any path on the volume
+void* OpenUsnJournal(const wchar_t* Path, DWORD ReasonMask, size_t BufferSize = USN_JOURNAL_DEFAULT_BUFFER);
+void CloseUsnJournal(void* Journal);
+
+// Waits for records and passes them to Callback, returns false if StopEvent
+// is signaled or on an error. ERROR_JOURNAL_ENTRY_DELETED means records have
+// been overwritten before we read them, the next call continues with the
+// current position.
+bool ReadUsnJournal(void* Journal, HANDLE StopEvent, UsnRecordRoutine Callback, void* Parameter);
+
+HANDLE GetUsnJournalVolume(void* Journal);
+
+// Returns a volume-relative path of a directory by its file reference, like
+// "\dir\subdir" or an empty string for the volume root. Paths are cached, a
+// returned path is valid until the next call of GetUsnDirectoryPath() or
+// InvalidateUsnDirectoryPaths().
+bool GetUsnDirectoryPath(void* Journal, DWORDLONG Reference, const wchar_t** Path, size_t* Length);
+
+// Drops all cached paths
+void InvalidateUsnDirectoryPaths(void* Journal);
+
+// Should be called when a directory is renamed or deleted, drops cached paths
+// of the directory and its children. Parent and Name are taken from the record
+// of the old name.
+void InvalidateUsnDirectoryPath(void* Journal, DWORDLONG Parent, const wchar_t* Name, size_t Length);
+
+// Volume-relative path of an opened file or directory in the same format
+bool GetVolumeRelativePath(HANDLE File, wchar_t* Buffer, size_t BufferLength, size_t* Length);
@@ -0,0 +1,244 @@
+#include <Windows.h>
+#include <stdio.h>
+#include <LogFormat.h>
+#include <SharedLogSink.h>
+#include <ConsolePrinter.h>
+#include <CommonLib.h>
+
+// =============================================
+
+static const char* GetLevelName(unsigned char Level)
+{
+    static const char* s_levels[MaxLevel] = { "TRACE", "DEBUG", "INFO ", "WARN ", "ERROR" };
+
+    if (Level >= _countof(s_levels))
+        return "?????";
+
+    return s_levels[Level];
+}
+
+static void PrintRecord(const LogRecordHeader* Record)
+{
+    FILETIME local;
+    SYSTEMTIME time;
+
+    ::FileTimeToLocalFileTime((const FILETIME*)&Record->timestamp, &local);
+    ::FileTimeToSystemTime(&local, &time);
+
+    printf(
+        "%04d-%02d-%02d %02d:%02d:%02d.%03d [%5u] %s ",
+        time.wYear, time.wMonth, time.wDay,
+        time.wHour, time.wMinute, time.wSecond, time.wMilliseconds,
+        Record->thread,
+        GetLevelName(Record->level)
+    );
+
+    fwrite(Record + 1, 1, Record->size, stdout);
+}
+
+static bool DecodeSegment(const wchar_t* SegmentPath)
+{
+    HANDLE file = INVALID_HANDLE_VALUE;
+    HANDLE mapping = NULL;
+    const char* view = NULL;
+    const LogSegmentHeader* header;
+    LARGE_INTEGER fileSize;
+    size_t size, offset;
+    bool result = false;
+
+    file = ::CreateFileW(SegmentPath, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL, OPEN_EXISTING, 0, NULL);
+    if (file == INVALID_HANDLE_VALUE)
+    {
+        printf("Error, can't open segment '%S', code %d\n", SegmentPath, ::GetLastError());
+        goto ReleaseBlock;
+    }
+
+    if (!::GetFileSizeEx(file, &fileSize) || fileSize.QuadPart < sizeof(LogSegmentHeader))
+    {
+        printf("Error, invalid segment size '%S'\n", SegmentPath);
+        goto ReleaseBlock;
+    }
+
+    size = (size_t)fileSize.QuadPart;
+
+    mapping = ::CreateFileMappingW(file, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (!mapping)
+    {
+        printf("Error, can't map segment '%S', code %d\n", SegmentPath, ::GetLastError());
+        goto ReleaseBlock;
+    }
+
+    view = (const char*)::MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+    if (!view)
+    {
+        printf("Error, can't map segment '%S', code %d\n", SegmentPath, ::GetLastError());
+        goto ReleaseBlock;
+    }
+
+    header = (const LogSegmentHeader*)view;
+    if (header->signature != LOG_SEGMENT_SIGNATURE || header->version != LOG_SEGMENT_VERSION)
+    {
+        printf("Error, '%S' isn't a log segment\n", SegmentPath);
+        goto ReleaseBlock;
+    }
+
+    offset = header->headerSize;
+
+    while (offset + sizeof(LogRecordHeader) <= size)
+    {
+        const LogRecordHeader* record = (const LogRecordHeader*)(view + offset);
+        size_t recordSize;
+
+        if (!record->size)
+            break;
+
+        recordSize = GetLogRecordSize(record->size);
+        if (offset + recordSize > size)
+            break;
+
+        PrintRecord(record);
+        offset += recordSize;
+    }
+
+    result = true;
+
+ReleaseBlock:
+
+    if (view)
+        ::UnmapViewOfFile(view);
+
+    if (mapping)
+        ::CloseHandle(mapping);
+
+    if (file != INVALID_HANDLE_VALUE)
+        ::CloseHandle(file);
+
+    return result;
+}
+
+static bool ReadSharedLogSlot(const SharedLogSlot* Slot, unsigned long long Index, SharedLogSlot* Output)
+{
+    unsigned long long sequence = Slot->sequence;
+
+    if (sequence != Index + 1)
+        return false;
+
+    ::MemoryBarrier();
+    memcpy(Output, (const void*)Slot, sizeof(SharedLogSlot));
+    ::MemoryBarrier();
+
+    // The writer could reuse the slot while we were copying it
+    return (Slot->sequence == sequence);
+}
+
+static bool TailSharedLog(const wchar_t* Name)
+{
+    HANDLE section = NULL;
+    const SharedLogHeader* header = NULL;
+    const SharedLogSlot* slots;
+    unsigned long long next;
+    wchar_t* sectionName;
+    bool result = false;
+
+    sectionName = BuildWideString(SHARED_LOG_NAME_PREFIX, Name, NULL);
+    if (!sectionName)
+        return false;
+
+    section = ::OpenFileMappingW(FILE_MAP_READ, FALSE, sectionName);
+    if (!section)
+    {
+        printf("Error, can't open shared log '%S', code %d\n", Name, ::GetLastError());
+        goto ReleaseBlock;
+    }
+
+    header = (const SharedLogHeader*)::MapViewOfFile(section, FILE_MAP_READ, 0, 0, 0);
+    if (!header)
+    {
+        printf("Error, can't map shared log '%S', code %d\n", Name, ::GetLastError());
+        goto ReleaseBlock;
+    }
+
+    if (header->signature != SHARED_LOG_SIGNATURE || header->version != SHARED_LOG_VERSION || header->slotSize != sizeof(SharedLogSlot))
+    {
+        printf("Error, '%S' isn't a compatible shared log\n", Name);
+        goto ReleaseBlock;
+    }
+
+    slots = (const SharedLogSlot*)(header + 1);
+
+    // Start from the oldest record that is still in the ring
+    next = header->head;
+    next = (next > header->slotsCount ? next - header->slotsCount : 0);
+
+    while (true)
+    {
+        unsigned long long head = header->head;
+        SharedLogSlot slot;
+
+        if (next == head)
+        {
+            fflush(stdout);
+            ::Sleep(50);
+            continue;
+        }
+
+        if (head - next > header->slotsCount)
+        {
+            printf("... %llu records lost\n", head - next - header->slotsCount);
+            next = head - header->slotsCount;
+            continue;
+        }
+
+        if (!ReadSharedLogSlot(&slots[next % header->slotsCount], next, &slot))
+        {
+            // A slot is being written or has been overwritten, recheck the head
+            ::SwitchToThread();
+            continue;
+        }
+
+        PrintRecord(&slot.record);
+        next++;
+    }
+
+    result = true;
+
+ReleaseBlock:
+
+    if (header)
+        ::UnmapViewOfFile(header);
+
+    if (section)
+        ::CloseHandle(section);
+
+    FreeWideString(sectionName);
+
+    return result;
+}
+
+// =============================================
+
+int wmain(int argc, wchar_t* argv[])
+{
+    int i, result = 0;
+
+    if (argc >= 3 && _wcsicmp(argv[1], L"decode") == 0)
+    {
+        ::SetConsoleOutputCP(CP_UTF8);
+
+        for (i = 2; i < argc; i++)
+            if (!DecodeSegment(argv[i]))
+                result = 2;
+
+        return result;
+    }
+
+    if (argc == 3 && _wcsicmp(argv[1], L"tail") == 0)
+    {
+        ::SetConsoleOutputCP(CP_UTF8);
+        return (TailSharedLog(argv[2]) ? 0 : 2);
+    }
+
+    printf("Usage: LogViewer decode <segment.blog> [<segment.blog> ...]\n");
+    printf("       LogViewer tail <shared log name>\n");
+    return 1;
+}
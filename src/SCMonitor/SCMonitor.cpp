@@ -3,6 +3,7 @@
 #include <iostream>
 #include <sstream>
 #include "ServicesMonitor.h"
+#include <Metrics.h>
 
 std::wstring ServiceNotificationToUnicode(DWORD notifications)
 {
@@ -255,6 +256,29 @@ void SCMNotificationCallback(
     std::wcout << L"[" << ServiceNotificationToUnicode(notification).c_str() << L"] " << serviceName << L" " << std::endl;
 }
 
+void PrintMetrics()
+{
+    static const char* histograms[] = {
+        "dispatcher.callback_latency",
+        "services.subscribers_latency",
+    };
+    MetricHistogramSnapshot snapshot;
+
+    std::cout << "dispatcher.callbacks: " << GetMetricCounter(RegisterMetricCounter("dispatcher.callbacks")) << std::endl;
+
+    for (auto i = 0; i < _countof(histograms); i++)
+    {
+        if (!GetMetricHistogram(RegisterMetricHistogram(histograms[i]), &snapshot) || !snapshot.count)
+            continue;
+
+        std::cout << snapshot.name << ": count " << snapshot.count
+            << ", avg " << snapshot.sum / snapshot.count << "ns"
+            << ", p50 " << snapshot.p50 << "ns"
+            << ", p99 " << snapshot.p99 << "ns"
+            << ", max " << snapshot.max << "ns" << std::endl;
+    }
+}
+
 int wmain(int argc, wchar_t* argv[])
 {
     try
@@ -275,5 +299,7 @@ int wmain(int argc, wchar_t* argv[])
         std::cout << "Unhandled exception: " << e.what() << std::endl;
     }
 
+    PrintMetrics();
+
     return 0;
 }
@@ -1,9 +1,17 @@
 #include "ServicesMonitor.h"
+#include <Metrics.h>
+#include <TaskScheduler.h>
 #include <iostream>
 #include <vector>
 
 // ============================================
 
+static unsigned int s_dispatchedCallbacksMetric = RegisterMetricCounter("dispatcher.callbacks");
+static unsigned int s_callbackLatencyMetric     = RegisterMetricHistogram("dispatcher.callback_latency");
+static unsigned int s_subscribersLatencyMetric  = RegisterMetricHistogram("services.subscribers_latency");
+
+// ============================================
+
 ThrowSystemError::ThrowSystemError(DWORD errorCode, const char* errorMessage)
 {
     throw std::system_error(errorCode, std::system_category(), errorMessage);
@@ -148,7 +156,10 @@ void BaseMonitorDispatcher::NotificationDispatcher()
                 while (!m_dispatchCallbacks.empty())
                 {
                     auto& item = m_dispatchCallbacks.front();
+                    auto started = StartMetricTimer();
                     (item.first)(item.second);
+                    RecordMetricLatency(s_callbackLatencyMetric, started);
+                    AddMetricCounter(s_dispatchedCallbacksMetric);
                     m_dispatchCallbacks.pop();
                 }
             }
@@ -254,12 +265,22 @@ const DWORD ServicesMonitor::s_serviceNotifyMask = SERVICE_NOTIFY_RUNNING | SERV
                                                  | SERVICE_NOTIFY_START_PENDING | SERVICE_NOTIFY_STOP_PENDING;
 
 ServicesMonitor::ServicesMonitor() :
+    m_scheduler(NULL),
+    m_eventsDispatching(false),
     m_monitoringStarted(false),
     m_scManager(NULL)
 {
     m_scManager = ::OpenSCManager(NULL, SERVICES_ACTIVE_DATABASE, SC_MANAGER_ENUMERATE_SERVICE);
     if (!m_scManager)
         ThrowSystemError error(::GetLastError(), "ServicesMonitor::ServicesMonitor -> OpenSCManager()");
+
+    // Only one task dispatches events at a time, a single worker is enough
+    m_scheduler = CreateTaskScheduler(1);
+    if (!m_scheduler)
+    {
+        ::CloseServiceHandle(m_scManager);
+        throw std::exception("ServicesMonitor::ServicesMonitor: can't create task scheduler");
+    }
 }
 
 ServicesMonitor::~ServicesMonitor()
@@ -270,6 +291,8 @@ ServicesMonitor::~ServicesMonitor()
         if (it->second.handle)
             ::CloseServiceHandle(it->second.handle);
 
+    DestroyTaskScheduler(m_scheduler);
+
     ::CloseServiceHandle(m_scManager);
 }
 
@@ -429,6 +452,9 @@ void ServicesMonitor::StopMonitoring()
 
     BaseMonitorDispatcher::StopMonitor();
 
+    // Subscribers mustn't be called after monitoring is stopped
+    WaitForTaskSchedulerIdle(m_scheduler);
+
     m_services.clear();
 
     m_monitoringStarted = false;
@@ -442,13 +468,9 @@ void CALLBACK ServicesMonitor::ServiceNotificationDispatcherRoutine(PVOID parame
     auto& monitor = *context.monitor;
 
     std::lock_guard<std::mutex> locker(monitor.m_servicesMutex);
-    for (auto it = monitor.m_subscibers.begin(); it != monitor.m_subscibers.end(); it++)
-    {
-        auto callback = (*it).first;
-        auto param = (*it).second;
-        callback(notification.dwNotificationTriggered, serviceContext.name.c_str(), serviceContext.status, notification.ServiceStatus, param);
-        serviceContext.status = notification.ServiceStatus;
-    }
+
+    monitor.PostSubscribersEvent(notification.dwNotificationTriggered, serviceContext.name.c_str(), serviceContext.status, notification.ServiceStatus);
+    serviceContext.status = notification.ServiceStatus;
 
     if (!serviceContext.handle)
         return;
@@ -529,12 +551,7 @@ void CALLBACK ServicesMonitor::SCMNotificationDispatcherRoutine(PVOID parameter)
         std::cout << e.what() << std::endl;
     }
 
-    for (auto it = monitor.m_subscibers.begin(); it != monitor.m_subscibers.end(); it++)
-    {
-        auto callback = (*it).first;
-        auto param = (*it).second;
-        callback(notification.dwNotificationTriggered, clearServiceName, notification.ServiceStatus, notification.ServiceStatus, param);
-    }
+    monitor.PostSubscribersEvent(notification.dwNotificationTriggered, clearServiceName, notification.ServiceStatus, notification.ServiceStatus);
 
     context.active = true;
     auto errorCode = NotifyServiceStatusChangeW(
@@ -570,3 +587,58 @@ void ServicesMonitor::InstallSCMNotification(void* parameter)
     if (errorCode != ERROR_SUCCESS)
         std::cout << "ServicesMonitor::InstallSCMNotification -> NotifyServiceStatusChangeW() failed with code: " << errorCode << std::endl;
 }
+
+void ServicesMonitor::PostSubscribersEvent(DWORD notification, const wchar_t* serviceName, const SERVICE_STATUS_PROCESS& oldStatus, const SERVICE_STATUS_PROCESS& newStatus)
+{
+    SubscribersEvent event;
+
+    event.notification = notification;
+    event.serviceName = serviceName;
+    event.oldStatus = oldStatus;
+    event.newStatus = newStatus;
+
+    {
+        std::lock_guard<std::mutex> locker(m_eventsMutex);
+
+        m_events.push(std::move(event));
+
+        // A running task picks the event up, a new one would break the order
+        if (m_eventsDispatching)
+            return;
+
+        m_eventsDispatching = true;
+    }
+
+    if (!SubmitTask(m_scheduler, DispatchSubscribersEvents, this))
+        DispatchSubscribersEvents(this);
+}
+
+void ServicesMonitor::DispatchSubscribersEvents(void* parameter)
+{
+    auto monitor = reinterpret_cast<ServicesMonitor*>(parameter);
+
+    std::unique_lock<std::mutex> locker(monitor->m_eventsMutex);
+
+    while (!monitor->m_events.empty())
+    {
+        auto event = std::move(monitor->m_events.front());
+        monitor->m_events.pop();
+
+        locker.unlock();
+
+        auto started = StartMetricTimer();
+
+        for (auto it = monitor->m_subscibers.begin(); it != monitor->m_subscibers.end(); it++)
+        {
+            auto callback = (*it).first;
+            auto param = (*it).second;
+            callback(event.notification, event.serviceName.c_str(), event.oldStatus, event.newStatus, param);
+        }
+
+        RecordMetricLatency(s_subscribersLatencyMetric, started);
+
+        locker.lock();
+    }
+
+    monitor->m_eventsDispatching = false;
+}
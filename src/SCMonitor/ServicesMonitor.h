@@ -9,6 +9,7 @@
 #include <mutex>
 #include <thread>
 #include <memory>
+#include <ObjectPool.h>
 
 struct ThrowSystemError
 {
@@ -47,8 +48,9 @@ private:
 
     std::shared_ptr<std::thread> m_dispatcherThread;
 
+    // Queue nodes are recycled by the pool, pushing a callback doesn't touch the heap
     typedef std::pair<MonitorWorkCallback, void*> WorkCallbackItem;
-    std::queue< WorkCallbackItem, std::list<WorkCallbackItem> > m_dispatchCallbacks;
+    std::queue< WorkCallbackItem, std::list< WorkCallbackItem, PoolAllocator<WorkCallbackItem> > > m_dispatchCallbacks;
 
     std::mutex m_controlMutex;
     std::mutex m_dispatcherPauseMutex;
@@ -134,6 +136,21 @@ private:
     std::mutex m_servicesMutex;
     std::map<std::wstring, ServiceContext> m_services;
 
+    struct SubscribersEvent
+    {
+        DWORD notification;
+        std::wstring serviceName;
+        SERVICE_STATUS_PROCESS oldStatus;
+        SERVICE_STATUS_PROCESS newStatus;
+    };
+
+    // Subscribers are called by a pool task, the dispatcher thread only queues
+    // an event. Events are dispatched one at a time in order of arrival.
+    void* m_scheduler;
+    std::mutex m_eventsMutex;
+    std::queue< SubscribersEvent, std::list< SubscribersEvent, PoolAllocator<SubscribersEvent> > > m_events;
+    bool m_eventsDispatching;
+
     static const DWORD s_serviceNotifyMask;
 
     void EnumAndInsertServices();
@@ -144,6 +161,9 @@ private:
     static void CALLBACK SCMNotificationDispatcherRoutine(PVOID parameter);
     static void InstallSCMNotification(void* parameter);
 
+    void PostSubscribersEvent(DWORD notification, const wchar_t* serviceName, const SERVICE_STATUS_PROCESS& oldStatus, const SERVICE_STATUS_PROCESS& newStatus);
+    static void DispatchSubscribersEvents(void* parameter);
+
 protected:
 
     bool m_monitoringStarted;